@@ -38,6 +38,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -199,67 +200,193 @@ add_dir(const char *hintsfile, const char *name, int trusted)
 	dirs[ndirs++] = name;
 }
 
+/*
+ * Process wide cache of the shared library names found in each directory
+ * scanned, so that analysing many packages in one run does not readdir(3)
+ * the same directories over and over.  An entry is reused for as long as
+ * the directory's identity and modification time are unchanged.
+ */
+struct shlib_dir {
+	UT_hash_handle	 hh;
+	dev_t		 dev;
+	ino_t		 ino;
+	struct timespec	 mtime;
+	char		**names;
+	size_t		 nnames;
+	char		 path[];
+};
+
+static struct shlib_dir *shlib_dirs = NULL;
+
+static void
+shlib_dir_free(struct shlib_dir *sd)
+{
+	size_t	i;
+
+	for (i = 0; i < sd->nnames; i++)
+		free(sd->names[i]);
+	free(sd->names);
+	free(sd);
+}
+
+void
+shlib_dir_cache_free(void)
+{
+	struct shlib_dir	*sd1, *sd2;
+
+	HASH_ITER(hh, shlib_dirs, sd1, sd2) {
+		HASH_DEL(shlib_dirs, sd1);
+		shlib_dir_free(sd1);
+	}
+	shlib_dirs = NULL;
+}
+
+/* Expect shlibs to follow the name pattern libfoo.so.N if
+   strictnames is true -- ie. when searching the default
+   library search path.
+
+   Otherwise, allow any name ending in .so or .so.N --
+   ie. when searching RPATH or RUNPATH and assuming it
+   contains private shared libraries which can follow just
+   about any naming convention */
+static bool
+shlib_name_valid(const char *name, bool strictnames)
+{
+	int		 len;
+	const char	*vers;
+
+	len = strlen(name);
+	if (strictnames) {
+		/* Name can't be shorter than "libx.so" */
+		if (len < 7 || strncmp(name, "lib", 3) != 0)
+			return (false);
+	}
+
+	vers = name + len;
+	while (vers > name && (isdigit(*(vers-1)) || *(vers-1) == '.'))
+		vers--;
+	if (vers == name + len) {
+		if (len < 3 || strncmp(vers - 3, ".so", 3) != 0)
+			return (false);
+	} else if (vers < name + 3 || strncmp(vers - 3, ".so.", 4) != 0)
+		return (false);
+
+	return (true);
+}
+
 static int
-scan_dirs_for_shlibs(struct shlib_list **shlib_list, int numdirs,
-		     const char **dirlist, bool strictnames)
+shlib_dir_add_name(struct shlib_dir *sd, const char *name)
 {
-	int	i;
+	char	**names;
 
-	/* Expect shlibs to follow the name pattern libfoo.so.N if
-	   strictnames is true -- ie. when searching the default
-	   library search path.
+	names = realloc(sd->names, (sd->nnames + 1) * sizeof(char *));
+	if (names == NULL)
+		return (EPKG_FATAL);
+	sd->names = names;
+	if ((sd->names[sd->nnames] = strdup(name)) == NULL)
+		return (EPKG_FATAL);
+	sd->nnames++;
 
-	   Otherwise, allow any name ending in .so or .so.N --
-	   ie. when searching RPATH or RUNPATH and assuming it
-	   contains private shared libraries which can follow just
-	   about any naming convention */
+	return (EPKG_OK);
+}
 
-	for (i = 0;  i < numdirs;  i++) {
-		DIR		*dirp;
-		struct dirent	*dp;
+/*
+ * Return the cached listing of dir, reading the directory again if it
+ * changed since it was last seen.  NULL if it cannot be read.
+ */
+static struct shlib_dir *
+shlib_dir_get(const char *dir)
+{
+	struct shlib_dir	*sd;
+	struct stat		 st;
+	DIR			*dirp;
+	struct dirent		*dp;
+	size_t			 len;
+
+	HASH_FIND_STR(shlib_dirs, dir, sd);
+
+	if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		if (sd != NULL) {
+			HASH_DEL(shlib_dirs, sd);
+			shlib_dir_free(sd);
+		}
+		return (NULL);
+	}
 
-		if ((dirp = opendir(dirlist[i])) == NULL)
+	if (sd != NULL) {
+		if (sd->dev == st.st_dev && sd->ino == st.st_ino &&
+		    sd->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    sd->mtime.tv_nsec == st.st_mtim.tv_nsec)
+			return (sd);
+		HASH_DEL(shlib_dirs, sd);
+		shlib_dir_free(sd);
+	}
+
+	if ((dirp = opendir(dir)) == NULL)
+		return (NULL);
+
+	len = strlen(dir) + 1;
+	if ((sd = calloc(1, sizeof(struct shlib_dir) + len)) == NULL) {
+		warnx("Out of memory");
+		closedir(dirp);
+		return (NULL);
+	}
+	strlcpy(sd->path, dir, len);
+	sd->dev = st.st_dev;
+	sd->ino = st.st_ino;
+	sd->mtime = st.st_mtim;
+
+	while ((dp = readdir(dirp)) != NULL) {
+		/* Only regular files and sym-links. On some
+		   filesystems d_type is not set, on these the d_type
+		   field will be DT_UNKNOWN. */
+		if (dp->d_type != DT_REG && dp->d_type != DT_LNK &&
+		    dp->d_type != DT_UNKNOWN)
 			continue;
-		while ((dp = readdir(dirp)) != NULL) {
-			int		 len;
-			int		 ret;
-			const char	*vers;
 
-			/* Only regular files and sym-links. On some
-			   filesystems d_type is not set, on these the d_type
-			   field will be DT_UNKNOWN. */
-			if (dp->d_type != DT_REG && dp->d_type != DT_LNK &&
-			    dp->d_type != DT_UNKNOWN)
-				continue;
+		/* Keep whatever could be a library, the naming
+		   convention is checked when the listing is used */
+		if (!shlib_name_valid(dp->d_name, false))
+			continue;
+
+		if (shlib_dir_add_name(sd, dp->d_name) != EPKG_OK) {
+			warnx("Out of memory");
+			closedir(dirp);
+			shlib_dir_free(sd);
+			return (NULL);
+		}
+	}
+	closedir(dirp);
 
-			len = strlen(dp->d_name);
-			if (strictnames) {
-				/* Name can't be shorter than "libx.so" */
-				if (len < 7 ||
-				    strncmp(dp->d_name, "lib", 3) != 0)
-					continue;
-			}
+	HASH_ADD_KEYPTR(hh, shlib_dirs, sd->path, len - 1, sd);
 
-			vers = dp->d_name + len;
-			while (vers > dp->d_name &&
-			       (isdigit(*(vers-1)) || *(vers-1) == '.'))
-				vers--;
-			if (vers == dp->d_name + len) {
-				if (strncmp(vers - 3, ".so", 3) != 0)
-					continue;
-			} else if (vers < dp->d_name + 3 ||
-			    strncmp(vers - 3, ".so.", 4) != 0)
+	return (sd);
+}
+
+static int
+scan_dirs_for_shlibs(struct shlib_list **shlib_list, int numdirs,
+		     const char **dirlist, bool strictnames)
+{
+	struct shlib_dir	*sd;
+	size_t			 j;
+	int			 i;
+	int			 ret;
+
+	for (i = 0;  i < numdirs;  i++) {
+		if ((sd = shlib_dir_get(dirlist[i])) == NULL)
+			continue;
+
+		for (j = 0; j < sd->nnames; j++) {
+			if (strictnames &&
+			    !shlib_name_valid(sd->names[j], true))
 				continue;
 
 			/* We have a valid shared library name. */
 			ret = shlib_list_add(shlib_list, dirlist[i],
-					      dp->d_name);
-			if (ret != EPKG_OK) {
-				closedir(dirp);
+					      sd->names[j]);
+			if (ret != EPKG_OK)
 				return ret;
-			}
 		}
-		closedir(dirp);
 	}
 	return 0;
 }
@@ -321,7 +448,22 @@ int shlib_list_from_rpath(const char *rpath_str, const char *dirpath)
 int 
 shlib_list_from_elf_hints(const char *hintsfile)
 {
-	read_elf_hints(hintsfile, 1);
+	static char		hints_read[MAXPATHLEN];
+	static struct stat	hints_st;
+	struct stat		st;
+
+	/* The search path only changes when ldconfig(8) rewrites the
+	   hints file: don't read it again on every call */
+	if (stat(hintsfile, &st) == -1 ||
+	    strcmp(hints_read, hintsfile) != 0 ||
+	    st.st_dev != hints_st.st_dev || st.st_ino != hints_st.st_ino ||
+	    st.st_mtim.tv_sec != hints_st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != hints_st.st_mtim.tv_nsec) {
+		ndirs = 0;
+		read_elf_hints(hintsfile, 1);
+		strlcpy(hints_read, hintsfile, sizeof(hints_read));
+		hints_st = st;
+	}
 
 	return (scan_dirs_for_shlibs(&shlibs, ndirs, dirs, true));
 }
@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <inttypes.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <limits.h>
@@ -344,26 +345,75 @@ packing_finish(struct packing *pack)
 	return (EPKG_OK);
 }
 
+/*
+ * Apply the COMPRESSION_LEVEL and COMPRESSION_THREADS settings to the
+ * compression filter; unsupported options only emit a debug message, the
+ * archive is then created with the filter defaults.
+ */
+static void
+packing_set_filter_options(struct archive *a, const char *filter,
+    bool threaded)
+{
+	char val[16];
+	int64_t level, threads;
+
+	level = pkg_object_int(pkg_config_get("COMPRESSION_LEVEL"));
+	threads = pkg_object_int(pkg_config_get("COMPRESSION_THREADS"));
+
+	if (level >= 0) {
+		snprintf(val, sizeof(val), "%"PRId64, level);
+		if (archive_write_set_filter_option(a, filter,
+		    "compression-level", val) != ARCHIVE_OK)
+			pkg_debug(1, "%s: cannot set compression level %s: %s",
+			    filter, val, archive_error_string(a));
+	}
+
+	if (threads < 0) {
+		pkg_emit_notice("Invalid COMPRESSION_THREADS %"PRId64
+		    ", compressing with a single thread", threads);
+		threads = 1;
+	}
+
+	if (threaded && threads != 1) {
+		snprintf(val, sizeof(val), "%"PRId64, threads);
+		if (archive_write_set_filter_option(a, filter, "threads",
+		    val) != ARCHIVE_OK)
+			pkg_debug(1, "%s: cannot use %s threads: %s", filter,
+			    val, archive_error_string(a));
+	}
+}
+
 static const char *
 packing_set_format(struct archive *a, pkg_formats format)
 {
 	const char *notsupp_fmt = "%s is not supported, trying %s";
 
 	switch (format) {
+	case TZST:
+#if ARCHIVE_VERSION_NUMBER >= 3003003
+		if (archive_write_add_filter_zstd(a) == ARCHIVE_OK) {
+			packing_set_filter_options(a, "zstd", true);
+			return ("tzst");
+		} else
+#endif
+			pkg_emit_error(notsupp_fmt, "zstd", "xz");
 	case TXZ:
-		if (archive_write_add_filter_xz(a) == ARCHIVE_OK)
+		if (archive_write_add_filter_xz(a) == ARCHIVE_OK) {
+			packing_set_filter_options(a, "xz", true);
 			return ("txz");
-		else
+		} else
 			pkg_emit_error(notsupp_fmt, "xz", "bzip2");
 	case TBZ:
-		if (archive_write_add_filter_bzip2(a) == ARCHIVE_OK)
+		if (archive_write_add_filter_bzip2(a) == ARCHIVE_OK) {
+			packing_set_filter_options(a, "bzip2", false);
 			return ("tbz");
-		else
+		} else
 			pkg_emit_error(notsupp_fmt, "bzip2", "gzip");
 	case TGZ:
-		if (archive_write_add_filter_gzip(a) == ARCHIVE_OK)
+		if (archive_write_add_filter_gzip(a) == ARCHIVE_OK) {
+			packing_set_filter_options(a, "gzip", false);
 			return ("tgz");
-		else
+		} else
 			pkg_emit_error(notsupp_fmt, "gzip", "plain tar");
 	case TAR:
 		archive_write_add_filter_none(a);
@@ -379,6 +429,8 @@ packing_format_from_string(const char *str)
 		return TXZ;
 	if (strcmp(str, "txz") == 0)
 		return TXZ;
+	if (strcmp(str, "tzst") == 0)
+		return TZST;
 	if (strcmp(str, "tbz") == 0)
 		return TBZ;
 	if (strcmp(str, "tgz") == 0)
@@ -395,6 +447,9 @@ packing_format_to_string(pkg_formats format)
 	const char *res = NULL;
 
 	switch (format) {
+	case TZST:
+		res = "tzst";
+		break;
 	case TXZ:
 		res = "txz";
 		break;
@@ -47,6 +47,7 @@
 #include "pkg.h"
 #include "private/pkg.h"
 #include "private/event.h"
+#include "private/ldconfig.h"
 
 #define REPO_NAME_PREFIX "repo-"
 #ifndef PORTSDIR
@@ -294,6 +295,36 @@ static struct config_entry c[] = {
 		"NO",
 		"Match package names case sensitively",
 	},
+	{
+		PKG_INT,
+		"COMPRESSION_LEVEL",
+		"-1",
+		"Compression level of created packages and catalogues, -1 for the compressor default",
+	},
+	{
+		PKG_INT,
+		"COMPRESSION_THREADS",
+		"1",
+		"Number of threads used to compress packages and catalogues, 0 for one per CPU",
+	},
+	{
+		PKG_BOOL,
+		"SQLITE_WAL",
+		"NO",
+		"Use write-ahead logging for the local database so readers never wait on writers",
+	},
+	{
+		PKG_INT,
+		"SQLITE_MMAP_SIZE",
+		"67108864",
+		"Bytes of the local database to access through mmap(2), 0 to disable",
+	},
+	{
+		PKG_INT,
+		"SQLITE_CACHE_SIZE",
+		"8192",
+		"Size in KiB of the page cache of each database connection",
+	},
 };
 
 static bool parsed = false;
@@ -947,8 +978,10 @@ pkg_shutdown(void)
 		/* NOTREACHED */
 	}
 
+	pkg_event_pipe_flush();
 	ucl_object_unref(config);
 	HASH_FREE(repos, pkg_repo_free);
+	shlib_dir_cache_free();
 
 	parsed = false;
 
@@ -66,6 +66,11 @@ pkg_create_from_dir(struct pkg *pkg, const char *root,
 
 	/*
 	 * Get / compute size / checksum if not provided in the manifest
+	 *
+	 * This reads the files a first time, they are read again when they
+	 * are archived below: the manifest holding the checksums has to be
+	 * the first entry of the compressed stream, so they cannot be
+	 * computed while the data is being archived.
 	 */
 	while (pkg_files(pkg, &file) == EPKG_OK) {
 		const char *pkg_path = pkg_file_path(file);
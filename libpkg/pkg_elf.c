@@ -35,12 +35,14 @@
 #include <sys/elf_common.h>
 #endif
 #include <sys/stat.h>
+#include <sys/sysctl.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <dlfcn.h>
 #include <elf-hints.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <gelf.h>
 #include <libgen.h>
@@ -48,7 +50,11 @@
 #include <link.h>
 #endif
 #include <paths.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -63,6 +69,65 @@
 
 #define roundup2(x, y)	(((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
 
+#define ELF_SCAN_CHUNK	8
+
+/*
+ * What analysing one packaged file found out.  Filled in by the scanning
+ * threads, which do not touch the package, and applied to it afterwards in
+ * file order.
+ */
+struct elf_info {
+	char		*path;
+	int		 ret;
+	int		 error;		/* errno of a failed lstat(2) */
+	char		*errmsg;
+	bool		 is_elf;
+	bool		 is_shlib;
+	char		*rpath;
+	char		**needed;
+	size_t		 nneeded;
+};
+
+struct elf_scan {
+	struct elf_info	*info;
+	size_t		 len;
+	size_t		 next;
+	pthread_mutex_t	 lock;
+};
+
+/* Resolution of one DT_NEEDED entry, for a given RPATH */
+struct shlib_memo {
+	int		 ret;
+	int		 in_pkg;	/* -1: not looked up yet */
+	char		 path[MAXPATHLEN];
+	size_t		 keylen;
+	UT_hash_handle	 hh;
+	char		 key[];
+};
+
+/* Installed package owning a resolved library, if any */
+struct shlib_owner {
+	char		*path;
+	bool		 found;
+	char		*origin;
+	char		*name;
+	char		*version;
+	bool		 locked;
+	UT_hash_handle	 hh;
+};
+
+/*
+ * Per run state of the actions: the same few libraries are needed by most
+ * of the files of a package, resolve them and look their owner up once.
+ */
+struct elf_analysis {
+	struct pkgdb		*db;
+	const char		*rpath;
+	const char		*dir;
+	struct shlib_memo	*memo;
+	struct shlib_owner	*owners;
+};
+
 static int
 filter_system_shlibs(const char *name, char *path, size_t pathlen)
 {
@@ -80,122 +145,259 @@ filter_system_shlibs(const char *name, char *path, size_t pathlen)
 		return (EPKG_END); /* ignore libs from base */
 
 	if (path != NULL)
-		strncpy(path, shlib_path, pathlen);
+		strlcpy(path, shlib_path, pathlen);
 
 	return (EPKG_OK);
 } 
 
+static struct shlib_memo *
+shlib_resolve(struct elf_analysis *ea, const char *name)
+{
+	struct shlib_memo *m;
+	size_t namelen, rpathlen = 0, dirlen = 0, keylen;
+
+	/* key: name, and the RPATH with the directory $ORIGIN stands for */
+	namelen = strlen(name) + 1;
+	if (ea->rpath != NULL) {
+		rpathlen = strlen(ea->rpath) + 1;
+		dirlen = strlen(ea->dir) + 1;
+	}
+	keylen = namelen + rpathlen + dirlen;
+
+	if (keylen <= MAXPATHLEN * 3) {
+		char key[keylen];
+
+		memcpy(key, name, namelen);
+		if (ea->rpath != NULL) {
+			memcpy(key + namelen, ea->rpath, rpathlen);
+			memcpy(key + namelen + rpathlen, ea->dir, dirlen);
+		}
+		HASH_FIND(hh, ea->memo, key, keylen, m);
+		if (m != NULL)
+			return (m);
+	}
+
+	if ((m = calloc(1, sizeof(struct shlib_memo) + keylen)) == NULL) {
+		pkg_emit_errno("calloc", "shlib_memo");
+		return (NULL);
+	}
+	memcpy(m->key, name, namelen);
+	if (ea->rpath != NULL) {
+		memcpy(m->key + namelen, ea->rpath, rpathlen);
+		memcpy(m->key + namelen + rpathlen, ea->dir, dirlen);
+	}
+	m->keylen = keylen;
+	m->in_pkg = -1;
+	m->ret = filter_system_shlibs(name, m->path, sizeof(m->path));
+	HASH_ADD(hh, ea->memo, key, keylen, m);
+
+	return (m);
+}
+
+/* Does the package itself ship a library the linker could not resolve? */
+static bool
+shlib_in_pkg(struct pkg *pkg, struct shlib_memo *m, const char *name)
+{
+	struct pkg_file *file = NULL;
+	const char *filepath;
+	size_t namelen, len;
+
+	if (m->in_pkg != -1)
+		return (m->in_pkg);
+
+	m->in_pkg = 0;
+	namelen = strlen(name);
+	while (pkg_files(pkg, &file) == EPKG_OK) {
+		filepath = pkg_file_path(file);
+		len = strlen(filepath);
+		if (len >= namelen &&
+		    strcmp(&filepath[len - namelen], name) == 0) {
+			m->in_pkg = 1;
+			break;
+		}
+	}
+
+	return (m->in_pkg);
+}
+
+static int
+shlib_unresolved(struct pkg *pkg, struct shlib_memo *m, const char *fpath,
+    const char *name, bool is_shlib)
+{
+	const char *pkgname, *pkgversion;
+
+	/* Ignore link resolution errors if we're analysing a
+	   shared library. */
+	if (is_shlib)
+		return (EPKG_OK);
+
+	if (shlib_in_pkg(pkg, m, name)) {
+		pkg_addshlib_required(pkg, name);
+		return (EPKG_OK);
+	}
+
+	pkg_get(pkg, PKG_NAME, &pkgname, PKG_VERSION, &pkgversion);
+	warnx("(%s-%s) %s - shared library %s not found",
+	      pkgname, pkgversion, fpath, name);
+
+	return (EPKG_FATAL);
+}
+
 /* ARGSUSED */
 static int
-add_shlibs_to_pkg(__unused void *actdata, struct pkg *pkg, const char *fpath,
+add_shlibs_to_pkg(void *actdata, struct pkg *pkg, const char *fpath,
 		  const char *name, bool is_shlib)
 {
-	const char *pkgname, *pkgversion;
-	struct pkg_file *file = NULL;
-	const char *filepath;
+	struct shlib_memo *m;
+
+	if ((m = shlib_resolve(actdata, name)) == NULL)
+		return (EPKG_FATAL);
 
-	switch(filter_system_shlibs(name, NULL, 0)) {
+	switch(m->ret) {
 	case EPKG_OK:		/* A non-system library */
 		pkg_addshlib_required(pkg, name);
 		return (EPKG_OK);
 	case EPKG_END:		/* A system library */
 		return (EPKG_OK);
 	default:
-		/* Ignore link resolution errors if we're analysing a
-		   shared library. */
-		if (is_shlib)
-			return (EPKG_OK);
-
-		while (pkg_files(pkg, &file) == EPKG_OK) {
-			filepath = pkg_file_path(file);
-			if (strcmp(&filepath[strlen(filepath) - strlen(name)], name) == 0) {
-				pkg_addshlib_required(pkg, name);
-				return (EPKG_OK);
-			}
-		}
+		return (shlib_unresolved(pkg, m, fpath, name, is_shlib));
+	}
+}
 
-		pkg_get(pkg, PKG_NAME, &pkgname, PKG_VERSION, &pkgversion);
-		warnx("(%s-%s) %s - shared library %s not found",
-		      pkgname, pkgversion, fpath, name);
+static struct shlib_owner *
+shlib_owner(struct elf_analysis *ea, const char *path)
+{
+	struct shlib_owner *o;
+	struct pkgdb_it *it;
+	struct pkg *d = NULL;
+	const char *origin, *name, *version;
+	bool locked;
+
+	HASH_FIND_STR(ea->owners, path, o);
+	if (o != NULL)
+		return (o);
+
+	if ((o = calloc(1, sizeof(struct shlib_owner))) == NULL ||
+	    (o->path = strdup(path)) == NULL) {
+		free(o);
+		pkg_emit_errno("calloc", "shlib_owner");
+		return (NULL);
+	}
 
-		return (EPKG_FATAL);
+	if ((it = pkgdb_query_which(ea->db, path, false)) != NULL) {
+		if (pkgdb_it_next(it, &d, PKG_LOAD_BASIC) == EPKG_OK) {
+			pkg_get(d, PKG_ORIGIN,  &origin,
+				   PKG_NAME,    &name,
+				   PKG_VERSION, &version,
+				   PKG_LOCKED,  &locked);
+			o->found = true;
+			o->origin = strdup(origin);
+			o->name = strdup(name);
+			o->version = strdup(version);
+			o->locked = locked;
+			pkg_free(d);
+		}
+		pkgdb_it_free(it);
 	}
+	HASH_ADD_KEYPTR(hh, ea->owners, o->path, strlen(o->path), o);
+
+	return (o);
 }
 
 static int
 test_depends(void *actdata, struct pkg *pkg, const char *fpath,
 	     const char *name, bool is_shlib)
 {
-	struct pkgdb *db = actdata;
-	struct pkg_dep *dep = NULL;
-	struct pkgdb_it *it = NULL;
-	struct pkg *d;
-	const char *deporigin, *depname, *depversion;
+	struct elf_analysis *ea = actdata;
+	struct shlib_memo *m;
+	struct shlib_owner *o;
 	const char *origin;
-	const char *pkgname, *pkgversion;
-	bool deplocked;
-	char pathbuf[MAXPATHLEN];
-	struct pkg_file *file = NULL;
-	const char *filepath;
 
-	assert(db != NULL);
+	assert(ea->db != NULL);
 
-	switch(filter_system_shlibs(name, pathbuf, sizeof(pathbuf))) {
+	if ((m = shlib_resolve(ea, name)) == NULL)
+		return (EPKG_FATAL);
+
+	switch(m->ret) {
 	case EPKG_OK:		/* A non-system library */
 		break;
 	case EPKG_END:		/* A system library */
 		return (EPKG_OK);
 	default:
-		/* Ignore link resolution errors if we're analysing a
-		   shared library. */
-		if (is_shlib)
-			return (EPKG_OK);
-
-		while (pkg_files(pkg, &file) == EPKG_OK) {
-			filepath = pkg_file_path(file);
-			if (strcmp(&filepath[strlen(filepath) - strlen(name)], name) == 0) {
-				pkg_addshlib_required(pkg, name);
-				return (EPKG_OK);
-			}
-		}
-		pkg_get(pkg, PKG_NAME, &pkgname, PKG_VERSION, &pkgversion);
-		warnx("(%s-%s) %s - shared library %s not found",
-		      pkgname, pkgversion, fpath, name);
-		return (EPKG_FATAL);
+		return (shlib_unresolved(pkg, m, fpath, name, is_shlib));
 	}
 
 	pkg_addshlib_required(pkg, name);
 
-	if ((it = pkgdb_query_which(db, pathbuf, false)) == NULL)
+	if ((o = shlib_owner(ea, m->path)) == NULL || !o->found ||
+	    o->origin == NULL || o->name == NULL || o->version == NULL)
 		return (EPKG_OK);
 
-	d = NULL;
-	if (pkgdb_it_next(it, &d, PKG_LOAD_BASIC) == EPKG_OK) {
-		pkg_get(d, PKG_ORIGIN,  &deporigin,
-			   PKG_NAME,    &depname,
-			   PKG_VERSION, &depversion,
-			   PKG_LOCKED,  &deplocked);
-
-		dep = pkg_dep_lookup(pkg, deporigin);
-		pkg_get(pkg, PKG_ORIGIN, &origin);
-
-		if (dep == NULL && strcmp(origin, deporigin) != 0) {
-			pkg_debug(1, "Autodeps: adding unlisted depends (%s): %s-%s",
-			    pathbuf, depname, depversion);
-			pkg_adddep(pkg, depname, deporigin, depversion,
-			    deplocked);
-		}
-		pkg_free(d);
+	pkg_get(pkg, PKG_ORIGIN, &origin);
+	if (pkg_dep_lookup(pkg, o->origin) == NULL &&
+	    strcmp(origin, o->origin) != 0) {
+		pkg_debug(1, "Autodeps: adding unlisted depends (%s): %s-%s",
+		    m->path, o->name, o->version);
+		pkg_adddep(pkg, o->name, o->origin, o->version, o->locked);
 	}
 
-	pkgdb_it_free(it);
 	return (EPKG_OK);
 }
 
+static void
+elf_analysis_free(struct elf_analysis *ea)
+{
+	struct shlib_memo *m, *mtmp;
+	struct shlib_owner *o, *otmp;
+
+	HASH_ITER(hh, ea->memo, m, mtmp) {
+		HASH_DEL(ea->memo, m);
+		free(m);
+	}
+	HASH_ITER(hh, ea->owners, o, otmp) {
+		HASH_DEL(ea->owners, o);
+		free(o->path);
+		free(o->origin);
+		free(o->name);
+		free(o->version);
+		free(o);
+	}
+}
+
+static void
+elf_info_error(struct elf_info *ei, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (ei->errmsg == NULL && vasprintf(&ei->errmsg, fmt, ap) == -1)
+		ei->errmsg = NULL;
+	va_end(ap);
+	ei->ret = EPKG_FATAL;
+}
+
 static int
-analyse_elf(struct pkg *pkg, const char *fpath,
-	int (action)(void *, struct pkg *, const char *, const char *, bool),
-	void *actdata)
+elf_info_add_needed(struct elf_info *ei, const char *shlib)
+{
+	char **needed;
+
+	needed = realloc(ei->needed, (ei->nneeded + 1) * sizeof(char *));
+	if (needed == NULL)
+		return (EPKG_FATAL);
+	ei->needed = needed;
+	if ((ei->needed[ei->nneeded] = strdup(shlib)) == NULL)
+		return (EPKG_FATAL);
+	ei->nneeded++;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Read the dynamic section of one file: runs on the scanning threads, so
+ * it only records what it finds in ei.
+ */
+static void
+elf_info_scan(struct elf_info *ei)
 {
 	Elf *e = NULL;
 	GElf_Ehdr elfhdr;
@@ -206,7 +408,7 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	Elf_Data *data;
 	GElf_Dyn *dyn, dyn_mem;
 	struct stat sb;
-	int ret = EPKG_OK;
+	const char *fpath = ei->path;
 
 	size_t numdyn = 0;
 	size_t sh_link = 0;
@@ -214,50 +416,49 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	const char *osname;
 	const char *shlib;
 
-	bool developer = false;
-	bool is_shlib = false;
-
-	developer = pkg_object_bool(pkg_config_get("DEVELOPER_MODE"));
-
 	int fd;
 
-	if (lstat(fpath, &sb) != 0)
-		pkg_emit_errno("fstat() failed for", fpath);
+	ei->ret = EPKG_OK;
+
+	if (lstat(fpath, &sb) != 0) {
+		ei->error = errno;
+		ei->ret = EPKG_END;
+		return;
+	}
 	/* ignore empty files and non regular files */
-	if (sb.st_size == 0 || !S_ISREG(sb.st_mode))
-		return (EPKG_END); /* Empty file or sym-link: no results */
+	if (sb.st_size == 0 || !S_ISREG(sb.st_mode)) {
+		ei->ret = EPKG_END; /* Empty file or sym-link: no results */
+		return;
+	}
 
 	if ((fd = open(fpath, O_RDONLY, 0)) < 0) {
-		return (EPKG_FATAL);
+		ei->ret = EPKG_FATAL;
+		return;
 	}
 
 	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
-		ret = EPKG_FATAL;
-		pkg_emit_error("elf_begin() for %s failed: %s", fpath,
+		elf_info_error(ei, "elf_begin() for %s failed: %s", fpath,
 		    elf_errmsg(-1));
 		goto cleanup;
 	}
 
 	if (elf_kind(e) != ELF_K_ELF) {
 		/* Not an elf file: no results */
-		ret = EPKG_END;
+		ei->ret = EPKG_END;
 		goto cleanup;
 	}
 
-	if (developer)
-		pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+	ei->is_elf = true;
 
 	if (gelf_getehdr(e, &elfhdr) == NULL) {
-		ret = EPKG_FATAL;
-		pkg_emit_error("getehdr() failed: %s.", elf_errmsg(-1));
+		elf_info_error(ei, "getehdr() failed: %s.", elf_errmsg(-1));
 		goto cleanup;
 	}
 
 	while ((scn = elf_nextscn(e, scn)) != NULL) {
 		if (gelf_getshdr(scn, &shdr) != &shdr) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getshdr() for %s failed: %s", fpath,
-			    elf_errmsg(-1));
+			elf_info_error(ei, "getshdr() for %s failed: %s",
+			    fpath, elf_errmsg(-1));
 			goto cleanup;
 		}
 		switch (shdr.sh_type) {
@@ -280,34 +481,34 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	 * dynamic == NULL means not a dynamically linked elf
 	 */
 	if (dynamic == NULL) {
-		ret = EPKG_END;
+		ei->ret = EPKG_END;
 		goto cleanup; /* not a dynamically linked elf: no results */
 	}
 
 	if (note != NULL) {
 		if ((data = elf_getdata(note, NULL)) == NULL) {
-			ret = EPKG_END; /* Some error occurred, ignore this file */
+			ei->ret = EPKG_END; /* Some error occurred, ignore this file */
 			goto cleanup;
 		}
 		if (data->d_buf == NULL) {
-			ret = EPKG_END; /* No osname available */
+			ei->ret = EPKG_END; /* No osname available */
 			goto cleanup;
 		}
 		osname = (const char *) data->d_buf + sizeof(Elf_Note);
 		if (strncasecmp(osname, "freebsd", sizeof("freebsd")) != 0 &&
 		    strncasecmp(osname, "dragonfly", sizeof("dragonfly")) != 0) {
-			ret = EPKG_END;	/* Foreign (probably linux) ELF object */
+			ei->ret = EPKG_END;	/* Foreign (probably linux) ELF object */
 			goto cleanup;
 		}
 	} else {
 		if (elfhdr.e_ident[EI_OSABI] != ELFOSABI_FREEBSD) {
-			ret = EPKG_END;
+			ei->ret = EPKG_END;
 			goto cleanup;
 		}
 	}
 
 	if ((data = elf_getdata(dynamic, NULL)) == NULL) {
-		ret = EPKG_END; /* Some error occurred, ignore this file */
+		ei->ret = EPKG_END; /* Some error occurred, ignore this file */
 		goto cleanup;
 	}
 
@@ -323,30 +524,24 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 	   against them would be required.  Shared libraries are
 	   distinguished by a DT_SONAME tag */
 
-	rpath_list_init();
 	for (dynidx = 0; dynidx < numdyn; dynidx++) {
 		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath,
-			    elf_errmsg(-1));
+			elf_info_error(ei, "getdyn() failed for %s: %s",
+			    fpath, elf_errmsg(-1));
 			goto cleanup;
 		}
 
-		if (dyn->d_tag == DT_SONAME) {
-			is_shlib = true;
-
-			/* The file being scanned is a shared library
-			   *provided* by the package. Record this if
-			   appropriate */
-
-			pkg_addshlib_provided(pkg, basename(fpath));
-		}
+		/* The file being scanned is a shared library
+		   *provided* by the package. */
+		if (dyn->d_tag == DT_SONAME)
+			ei->is_shlib = true;
 
 		if (dyn->d_tag != DT_RPATH && dyn->d_tag != DT_RUNPATH)
 			continue;
-		
-		shlib_list_from_rpath(elf_strptr(e, sh_link, dyn->d_un.d_val), 
-				      dirname(fpath));
+
+		shlib = elf_strptr(e, sh_link, dyn->d_un.d_val);
+		if (shlib != NULL && (ei->rpath = strdup(shlib)) == NULL)
+			elf_info_error(ei, "Out of memory");
 		break;
 	}
 
@@ -354,9 +549,8 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 
 	for (dynidx = 0; dynidx < numdyn; dynidx++) {
 		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath,
-			    elf_errmsg(-1));
+			elf_info_error(ei, "getdyn() failed for %s: %s",
+			    fpath, elf_errmsg(-1));
 			goto cleanup;
 		}
 
@@ -364,18 +558,169 @@ analyse_elf(struct pkg *pkg, const char *fpath,
 			continue;
 
 		shlib = elf_strptr(e, sh_link, dyn->d_un.d_val);
-
-		action(actdata, pkg, fpath, shlib, is_shlib);
+		if (shlib != NULL && elf_info_add_needed(ei, shlib) != EPKG_OK) {
+			elf_info_error(ei, "Out of memory");
+			goto cleanup;
+		}
 	}
 
 cleanup:
-	rpath_list_free();
-
 	if (e != NULL)
 		elf_end(e);
 	close(fd);
+}
 
-	return (ret);
+/*
+ * Record what elf_info_scan() found in the package, resolving the needed
+ * libraries with action.
+ */
+static int
+elf_info_apply(struct pkg *pkg, struct elf_info *ei,
+	int (action)(void *, struct pkg *, const char *, const char *, bool),
+	struct elf_analysis *ea, bool developer)
+{
+	char dir[MAXPATHLEN];
+	size_t i;
+
+	if (ei->error != 0) {
+		errno = ei->error;
+		pkg_emit_errno("lstat() failed for", ei->path);
+	}
+	if (ei->errmsg != NULL)
+		pkg_emit_error("%s", ei->errmsg);
+
+	if (developer && ei->is_elf)
+		pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+
+	if (ei->ret != EPKG_OK)
+		return (ei->ret);
+
+	if (ei->is_shlib)
+		pkg_addshlib_provided(pkg, basename(ei->path));
+
+	ea->rpath = ei->rpath;
+	ea->dir = NULL;
+	rpath_list_init();
+	if (ei->rpath != NULL) {
+		strlcpy(dir, ei->path, sizeof(dir));
+		strlcpy(dir, dirname(dir), sizeof(dir));
+		ea->dir = dir;
+		shlib_list_from_rpath(ei->rpath, dir);
+	}
+
+	for (i = 0; i < ei->nneeded; i++)
+		action(ea, pkg, ei->path, ei->needed[i], ei->is_shlib);
+
+	rpath_list_free();
+	ea->rpath = ea->dir = NULL;
+
+	return (EPKG_OK);
+}
+
+static void *
+elf_scan_worker(void *arg)
+{
+	struct elf_scan *scan = arg;
+	size_t i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&scan->lock);
+		i = scan->next;
+		end = i + ELF_SCAN_CHUNK;
+		if (end > scan->len)
+			end = scan->len;
+		scan->next = end;
+		pthread_mutex_unlock(&scan->lock);
+
+		if (i >= end)
+			break;
+		for (; i < end; i++)
+			elf_info_scan(&scan->info[i]);
+	}
+
+	return (NULL);
+}
+
+static void
+elf_scan_free(struct elf_scan *scan)
+{
+	struct elf_info *ei;
+	size_t i, j;
+
+	for (i = 0; i < scan->len; i++) {
+		ei = &scan->info[i];
+		for (j = 0; j < ei->nneeded; j++)
+			free(ei->needed[j]);
+		free(ei->needed);
+		free(ei->rpath);
+		free(ei->errmsg);
+		free(ei->path);
+	}
+	free(scan->info);
+}
+
+/*
+ * Parse the ELF headers of every file of pkg, found under root (joined
+ * with sep), over hw.ncpu threads.
+ */
+static int
+elf_scan_files(struct elf_scan *scan, struct pkg *pkg, const char *root,
+    const char *sep)
+{
+	struct pkg_file *file = NULL;
+	struct elf_info *ei;
+	pthread_t *tids = NULL;
+	int num_workers, started = 0, i;
+	size_t len;
+
+	memset(scan, 0, sizeof(struct elf_scan));
+	scan->info = calloc(pkg_list_count(pkg, PKG_FILES) + 1,
+	    sizeof(struct elf_info));
+	if (scan->info == NULL) {
+		pkg_emit_errno("calloc", "elf_scan");
+		return (EPKG_FATAL);
+	}
+
+	while (pkg_files(pkg, &file) == EPKG_OK) {
+		ei = &scan->info[scan->len];
+		if (root != NULL) {
+			if (asprintf(&ei->path, "%s%s%s", root, sep,
+			    pkg_file_path(file)) == -1)
+				ei->path = NULL;
+		} else
+			ei->path = strdup(pkg_file_path(file));
+		if (ei->path == NULL) {
+			pkg_emit_errno("malloc", "elf_scan");
+			elf_scan_free(scan);
+			return (EPKG_FATAL);
+		}
+		scan->len++;
+	}
+
+	len = sizeof(num_workers);
+	if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
+		num_workers = 1;
+	if ((size_t)num_workers > scan->len / ELF_SCAN_CHUNK)
+		num_workers = scan->len / ELF_SCAN_CHUNK;
+
+	pthread_mutex_init(&scan->lock, NULL);
+	if (num_workers > 1 &&
+	    (tids = calloc(num_workers, sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < num_workers; i++) {
+			if (pthread_create(&tids[i], NULL, elf_scan_worker,
+			    scan) != 0)
+				break;
+			started++;
+		}
+	}
+	/* this thread does its share, or all of it */
+	elf_scan_worker(scan);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&scan->lock);
+
+	return (EPKG_OK);
 }
 
 static int
@@ -401,11 +746,12 @@ analyse_fpath(struct pkg *pkg, const char *fpath)
 int
 pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 {
-	struct pkg_file *file = NULL;
+	struct elf_analysis ea;
+	struct elf_scan scan;
 	int ret = EPKG_OK;
-	char fpath[MAXPATHLEN];
 	bool autodeps = false;
 	bool developer = false;
+	size_t i;
 	int (*action)(void *, struct pkg *, const char *, const char *, bool);
 
 	autodeps = pkg_object_bool(pkg_config_get("AUTODEPS"));
@@ -419,6 +765,9 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 	else
 		action = add_shlibs_to_pkg;
 
+	memset(&ea, 0, sizeof(ea));
+	ea.db = db;
+
 	shlib_list_init();
 
 	ret = shlib_list_from_elf_hints(_PATH_ELF_HINTS);
@@ -431,23 +780,25 @@ pkg_analyse_files(struct pkgdb *db, struct pkg *pkg, const char *stage)
 				PKG_CONTAINS_STATIC_LIBS |
 				PKG_CONTAINS_H_OR_LA);
 
-	while (pkg_files(pkg, &file) == EPKG_OK) {
-		if (stage != NULL)
-			snprintf(fpath, sizeof(fpath), "%s/%s", stage, pkg_file_path(file));
-		else
-			strlcpy(fpath, pkg_file_path(file), sizeof(fpath));
+	if ((ret = elf_scan_files(&scan, pkg, stage, "/")) != EPKG_OK)
+		goto cleanup;
 
-		ret = analyse_elf(pkg, fpath, action, db);
+	for (i = 0; i < scan.len; i++) {
+		ret = elf_info_apply(pkg, &scan.info[i], action, &ea,
+		    developer);
 		if (developer) {
 			if (ret != EPKG_OK && ret != EPKG_END)
-				goto cleanup;
-			analyse_fpath(pkg, fpath);
+				break;
+			analyse_fpath(pkg, scan.info[i].path);
 		}
 	}
+	elf_scan_free(&scan);
 
-	ret = EPKG_OK;
+	if (!developer || ret == EPKG_END)
+		ret = EPKG_OK;
 
 cleanup:
+	elf_analysis_free(&ea);
 	shlib_list_free();
 
 	return (ret);
@@ -456,8 +807,9 @@ cleanup:
 int
 pkg_register_shlibs(struct pkg *pkg, const char *root)
 {
-	struct pkg_file        *file = NULL;
-	char fpath[MAXPATHLEN];
+	struct elf_analysis ea;
+	struct elf_scan scan;
+	size_t i;
 
 	pkg_list_free(pkg, PKG_SHLIBS_REQUIRED);
 
@@ -470,14 +822,15 @@ pkg_register_shlibs(struct pkg *pkg, const char *root)
 		return (EPKG_FATAL);
 	}
 
-	while(pkg_files(pkg, &file) == EPKG_OK) {
-		if (root != NULL) {
-			snprintf(fpath, sizeof(fpath), "%s%s", root, pkg_file_path(file));
-			analyse_elf(pkg, fpath, add_shlibs_to_pkg, NULL);
-		} else
-			analyse_elf(pkg, pkg_file_path(file), add_shlibs_to_pkg, NULL);
+	memset(&ea, 0, sizeof(ea));
+	if (elf_scan_files(&scan, pkg, root, "") == EPKG_OK) {
+		for (i = 0; i < scan.len; i++)
+			elf_info_apply(pkg, &scan.info[i], add_shlibs_to_pkg,
+			    &ea, false);
+		elf_scan_free(&scan);
 	}
 
+	elf_analysis_free(&ea);
 	shlib_list_free();
 	return (EPKG_OK);
 }
@@ -26,10 +26,14 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
-#define _WITH_DPRINTF
 #include "pkg.h"
 #include "private/pkg.h"
 #include "private/event.h"
@@ -52,6 +56,195 @@ sbuf_json_escape(struct sbuf *buf, const char *str)
 	return (sbuf_data(buf));
 }
 
+/*
+ * Messages for the event pipe are queued in a ring buffer which is
+ * drained without blocking whenever the reader accepts data.  Progress
+ * ticks are held back in a single slot until they can be committed to
+ * the ring, so a slow reader sees fewer ticks instead of stalling pkg.
+ */
+#define EVPIPE_RING_SIZE	(64 * 1024)
+
+static struct evpipe {
+	char		*ring;
+	size_t		 cap;
+	size_t		 head;
+	size_t		 len;
+	struct sbuf	*msg;
+	struct sbuf	*buf;
+	struct sbuf	*progress;
+	pkg_event_t	 progress_type;
+	bool		 pending;
+	bool		 broken;
+} evp;
+static pthread_mutex_t evp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+evpipe_init(void)
+{
+	int flags;
+
+	if (evp.ring != NULL)
+		return (EPKG_OK);
+
+	if ((evp.ring = malloc(EVPIPE_RING_SIZE)) == NULL)
+		return (EPKG_FATAL);
+	evp.cap = EVPIPE_RING_SIZE;
+	evp.head = evp.len = 0;
+	evp.msg = sbuf_new_auto();
+	evp.buf = sbuf_new_auto();
+	evp.progress = sbuf_new_auto();
+
+	if ((flags = fcntl(eventpipe, F_GETFL)) != -1 &&
+	    (flags & O_NONBLOCK) == 0)
+		fcntl(eventpipe, F_SETFL, flags | O_NONBLOCK);
+
+	return (EPKG_OK);
+}
+
+static bool
+evpipe_append(const char *data, size_t len, bool grow)
+{
+	char	*ring;
+	size_t	 cap, tail, part;
+
+	if (evp.cap - evp.len < len) {
+		/* only messages which must not be lost enlarge the ring */
+		if (!grow)
+			return (false);
+		cap = evp.cap;
+		while (cap - evp.len < len)
+			cap *= 2;
+		if ((ring = malloc(cap)) == NULL)
+			return (false);
+		part = evp.cap - evp.head;
+		if (part > evp.len)
+			part = evp.len;
+		memcpy(ring, evp.ring + evp.head, part);
+		memcpy(ring + part, evp.ring, evp.len - part);
+		free(evp.ring);
+		evp.ring = ring;
+		evp.cap = cap;
+		evp.head = 0;
+	}
+
+	tail = (evp.head + evp.len) % evp.cap;
+	part = evp.cap - tail;
+	if (part > len)
+		part = len;
+	memcpy(evp.ring + tail, data, part);
+	memcpy(evp.ring, data + part, len - part);
+	evp.len += len;
+
+	return (true);
+}
+
+static void
+evpipe_commit_progress(void)
+{
+	if (!evp.pending)
+		return;
+
+	if (evpipe_append(sbuf_data(evp.progress), sbuf_len(evp.progress),
+	    false))
+		evp.pending = false;
+}
+
+static void
+evpipe_flush(bool wait)
+{
+	struct pollfd	 pfd;
+	size_t		 chunk;
+	ssize_t		 n;
+
+	pfd.fd = eventpipe;
+	pfd.events = POLLOUT;
+
+	for (;;) {
+		evpipe_commit_progress();
+		if (evp.len == 0)
+			break;
+
+		chunk = evp.cap - evp.head;
+		if (chunk > evp.len)
+			chunk = evp.len;
+		n = write(eventpipe, evp.ring + evp.head, chunk);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && wait) {
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if (errno != EAGAIN) {
+				/* the reader went away: discard from now on */
+				evp.broken = true;
+				evp.len = 0;
+				evp.pending = false;
+			}
+			break;
+		}
+		evp.head = (evp.head + n) % evp.cap;
+		evp.len -= n;
+	}
+
+	if (evp.len == 0)
+		evp.head = 0;
+}
+
+static bool
+evpipe_is_progress(struct pkg_event *ev)
+{
+	switch (ev->type) {
+	case PKG_EVENT_FETCHING:
+		return (ev->e_fetching.done < ev->e_fetching.total);
+	case PKG_EVENT_UPDATE_ADD:
+		return (ev->e_upd_add.done < ev->e_upd_add.total);
+	case PKG_EVENT_UPDATE_REMOVE:
+		return (ev->e_upd_remove.done < ev->e_upd_remove.total);
+	default:
+		return (false);
+	}
+}
+
+static void
+evpipe_queue(struct pkg_event *ev, struct sbuf *msg)
+{
+	if (evpipe_is_progress(ev)) {
+		/* a newer tick of the same kind supersedes the held one */
+		if (evp.pending && evp.progress_type != ev->type)
+			evpipe_commit_progress();
+		sbuf_clear(evp.progress);
+		sbuf_bcat(evp.progress, sbuf_data(msg), sbuf_len(msg));
+		sbuf_finish(evp.progress);
+		evp.progress_type = ev->type;
+		evp.pending = true;
+	} else {
+		evpipe_commit_progress();
+		evp.pending = false;
+		evpipe_append(sbuf_data(msg), sbuf_len(msg), true);
+	}
+
+	/* the reader has to see a question before pkg waits for its answer */
+	evpipe_flush(ev->type == PKG_EVENT_QUERY_YESNO ||
+	    ev->type == PKG_EVENT_QUERY_SELECT);
+}
+
+void
+pkg_event_pipe_flush(void)
+{
+	pthread_mutex_lock(&evp_lock);
+	if (evp.ring != NULL) {
+		if (eventpipe >= 0 && !evp.broken)
+			evpipe_flush(true);
+		free(evp.ring);
+		sbuf_delete(evp.msg);
+		sbuf_delete(evp.buf);
+		sbuf_delete(evp.progress);
+		memset(&evp, 0, sizeof(evp));
+	}
+	pthread_mutex_unlock(&evp_lock);
+}
+
 static void
 pipeevent(struct pkg_event *ev)
 {
@@ -63,8 +256,15 @@ pipeevent(struct pkg_event *ev)
 	if (eventpipe < 0)
 		return;
 
-	msg = sbuf_new_auto();
-	buf = sbuf_new_auto();
+	pthread_mutex_lock(&evp_lock);
+	if (evp.broken || evpipe_init() != EPKG_OK) {
+		pthread_mutex_unlock(&evp_lock);
+		return;
+	}
+
+	msg = evp.msg;
+	buf = evp.buf;
+	sbuf_clear(msg);
 
 	switch(ev->type) {
 	case PKG_EVENT_ERRNO:
@@ -370,10 +570,12 @@ pipeevent(struct pkg_event *ev)
 	default:
 		break;
 	}
-	sbuf_finish(msg);
-	dprintf(eventpipe, "%s\n", sbuf_data(msg));
-	sbuf_delete(msg);
-	sbuf_delete(buf);
+	if (sbuf_len(msg) > 0) {
+		sbuf_putc(msg, '\n');
+		sbuf_finish(msg);
+		evpipe_queue(ev, msg);
+	}
+	pthread_mutex_unlock(&evp_lock);
 }
 
 void
@@ -157,10 +157,11 @@ pkg_jobs_maybe_match_file(struct job_pattern *jp, const char *pattern)
 	dot_pos = strrchr(pattern, '.');
 	if (dot_pos != NULL) {
 		/*
-		 * Compare suffix with .txz or .tbz
+		 * Compare suffix with .txz, .tzst or .tbz
 		 */
 		dot_pos ++;
 		if (strcmp(dot_pos, "txz") == 0 ||
+			strcmp(dot_pos, "tzst") == 0 ||
 			strcmp(dot_pos, "tbz") == 0 ||
 			strcmp(dot_pos, "tgz") == 0 ||
 			strcmp(dot_pos, "tar") == 0) {
@@ -2006,6 +2007,7 @@ pkg_jobs_execute(struct pkg_jobs *j)
 
 cleanup:
 	pkgdb_transaction_commit(j->db->sqlite, "upgrade");
+	pkgdb_checkpoint(j->db);
 	pkgdb_release_lock(j->db, PKGDB_LOCK_EXCLUSIVE);
 	pkg_manifest_keys_free(keys);
 
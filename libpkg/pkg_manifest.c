@@ -1118,17 +1118,6 @@ emit_manifest(struct pkg *pkg, struct sbuf **out, short flags)
 	return (EPKG_OK);
 }
 
-static void
-pkg_emit_manifest_digest(const unsigned char *digest, size_t len, char *hexdigest)
-{
-	unsigned int i;
-
-	for (i = 0; i < len; i ++)
-		sprintf(hexdigest + (i * 2), "%02x", digest[i]);
-
-	hexdigest[len * 2] = '\0';
-}
-
 /*
  * This routine is able to output to either a (FILE *) or a (struct sbuf *). It
  * exist only to avoid code duplication and should not be called except from
@@ -1162,7 +1151,7 @@ pkg_emit_manifest_generic(struct pkg *pkg, void *out, short flags,
 
 	if (pdigest != NULL) {
 		SHA256_Final(digest, sign_ctx);
-		pkg_emit_manifest_digest(digest, sizeof(digest), *pdigest);
+		bin_to_hex(digest, sizeof(digest), *pdigest);
 		free(sign_ctx);
 	}
 
@@ -27,10 +27,13 @@
  */
 
 #include <sys/stat.h>
+#include <sys/sysctl.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <regex.h>
 #define _WITH_GETLINE
 #include <stdio.h>
@@ -47,6 +50,28 @@
 
 static ucl_object_t *keyword_schema = NULL;
 
+/* below this many files per worker the staging scan stays sequential */
+#define PLIST_SCAN_CHUNK	32
+
+/*
+ * A @file entry waiting for the staging scan: the owner, group and mode
+ * are resolved when the line is parsed, lstat(2) and the checksum are
+ * filled in later, possibly by another thread.
+ */
+struct plist_file {
+	char *path;
+	char *line;
+	char *uname;
+	char *gname;
+	mode_t perm;
+	struct stat st;
+	int error;		/* errno of a failed lstat(2) */
+	int open_error;		/* errno of a failed open(2) */
+	int hash_error;		/* errno of a failed checksum */
+	bool hashed;
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+};
+
 struct keyword {
 	/* 64 is more than enough for this */
 	char keyword[64];
@@ -80,6 +105,12 @@ struct plist {
 		size_t cap;
 	} post_patterns;
 	struct keyword *keywords;
+	struct external_keyword *ext_keywords;
+	struct {
+		struct plist_file *f;
+		size_t len;
+		size_t cap;
+	} files;
 };
 
 struct file_attr {
@@ -93,6 +124,22 @@ struct action {
 	struct action *next;
 };
 
+/* A keyword definition loaded from PLIST_KEYWORDS_DIR or PORTSDIR */
+struct external_keyword {
+	char *keyword;
+	int status;
+	ucl_object_t *obj;
+	struct file_attr *attr;
+	const char *pre_install;
+	const char *post_install;
+	const char *pre_deinstall;
+	const char *post_deinstall;
+	const char *pre_upgrade;
+	const char *post_upgrade;
+	struct action *actions;
+	UT_hash_handle hh;
+};
+
 static int setprefix(struct plist *, char *, struct file_attr *);
 static int dirrm(struct plist *, char *, struct file_attr *);
 static int dirrmtry(struct plist *, char *, struct file_attr *);
@@ -332,14 +379,8 @@ file(struct plist *p, char *line, struct file_attr *a)
 {
 	size_t len;
 	char path[MAXPATHLEN];
-	char stagedpath[MAXPATHLEN];
-	char *testpath;
-	struct stat st;
-	char *buf;
-	bool regular = false;
-	bool developer;
-	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
-	int ret = EPKG_OK;
+	struct plist_file *f, *files;
+	const char *owner, *group;
 
 	len = strlen(line);
 
@@ -351,60 +392,223 @@ file(struct plist *p, char *line, struct file_attr *a)
 	else
 		snprintf(path, sizeof(path), "%s%s%s", p->prefix,
 		    p->slash, line);
-	testpath = path;
 
+	if (p->files.len == p->files.cap) {
+		p->files.cap = p->files.cap == 0 ? 64 : p->files.cap * 2;
+		files = realloc(p->files.f,
+		    p->files.cap * sizeof(struct plist_file));
+		if (files == NULL) {
+			pkg_emit_errno("realloc", "plist files");
+			free_file_attr(a);
+			return (EPKG_FATAL);
+		}
+		p->files.f = files;
+	}
+
+	owner = p->uname;
+	group = p->gname;
+	f = &p->files.f[p->files.len++];
+	memset(f, 0, sizeof(*f));
+	f->perm = p->perm;
+	if (a != NULL) {
+		if (a->owner != NULL)
+			owner = a->owner;
+		if (a->group != NULL)
+			group = a->group;
+		if (a->mode != 0)
+			f->perm = a->mode;
+	}
+	f->path = strdup(path);
+	f->line = strdup(line);
+	f->uname = owner != NULL ? strdup(owner) : NULL;
+	f->gname = group != NULL ? strdup(group) : NULL;
+
+	free_file_attr(a);
+	return (EPKG_OK);
+}
+
+static void
+plist_file_stat(struct plist *p, struct plist_file *f)
+{
+	char stagedpath[MAXPATHLEN];
+	const char *testpath;
+	int fd;
+
+	testpath = f->path;
 	if (p->stage != NULL) {
-		snprintf(stagedpath, sizeof(stagedpath), "%s%s", p->stage, path);
+		snprintf(stagedpath, sizeof(stagedpath), "%s%s", p->stage,
+		    f->path);
 		testpath = stagedpath;
 	}
 
-	if (lstat(testpath, &st) == -1) {
-		pkg_emit_errno("lstat", testpath);
-		if (p->stage != NULL)
-			ret = EPKG_FATAL;
-		developer = pkg_object_bool(pkg_config_get("DEVELOPER_MODE"));
-		if (developer) {
-			pkg_emit_developer_mode("Plist error, missing file: %s", line);
-			ret = EPKG_FATAL;
+	if (lstat(testpath, &f->st) == -1) {
+		f->error = errno;
+		return;
+	}
+
+	if (!S_ISREG(f->st.st_mode))
+		return;
+
+	if (pkg_type(p->pkg) == PKG_OLD_FILE) {
+		f->hashed = (md5_file(testpath, f->sum) == EPKG_OK);
+		return;
+	}
+
+	if ((fd = open(testpath, O_RDONLY)) == -1) {
+		f->open_error = errno;
+		return;
+	}
+	f->hash_error = sha256_fd_quiet(fd, f->sum);
+	f->hashed = (f->hash_error == 0);
+	close(fd);
+}
+
+struct plist_scan {
+	struct plist *p;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+static void *
+plist_scan_worker(void *arg)
+{
+	struct plist_scan *scan = arg;
+	size_t i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&scan->lock);
+		i = scan->next;
+		end = i + PLIST_SCAN_CHUNK;
+		if (end > scan->p->files.len)
+			end = scan->p->files.len;
+		scan->next = end;
+		pthread_mutex_unlock(&scan->lock);
+
+		if (i >= end)
+			break;
+		for (; i < end; i++)
+			plist_file_stat(scan->p, &scan->p->files.f[i]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * lstat(2) and checksum every staged file collected by file(), spreading
+ * the work over hw.ncpu threads, then register the files in plist order.
+ */
+static int
+plist_scan_files(struct plist *p)
+{
+	struct plist_scan scan;
+	struct plist_file *f;
+	pthread_t *tids = NULL;
+	char stagedpath[MAXPATHLEN];
+	const char *testpath;
+	bool regular, developer;
+	int num_workers, started = 0, i;
+	int ret = EPKG_OK;
+	size_t len, n;
+
+	len = sizeof(num_workers);
+	if (sysctlbyname("hw.ncpu", &num_workers, &len, NULL, 0) == -1)
+		num_workers = 1;
+	if ((size_t)num_workers > p->files.len / PLIST_SCAN_CHUNK)
+		num_workers = p->files.len / PLIST_SCAN_CHUNK;
+	/* md5_file() reports its own errors, keep those on this thread */
+	if (pkg_type(p->pkg) == PKG_OLD_FILE)
+		num_workers = 0;
+
+	scan.p = p;
+	scan.next = 0;
+	pthread_mutex_init(&scan.lock, NULL);
+
+	if (num_workers > 1 &&
+	    (tids = calloc(num_workers, sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < num_workers; i++) {
+			if (pthread_create(&tids[i], NULL, plist_scan_worker,
+			    &scan) != 0)
+				break;
+			started++;
+		}
+	}
+	/* this thread does its share, or all of it */
+	plist_scan_worker(&scan);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&scan.lock);
+
+	for (n = 0; n < p->files.len; n++) {
+		f = &p->files.f[n];
+		testpath = f->path;
+		if (p->stage != NULL) {
+			snprintf(stagedpath, sizeof(stagedpath), "%s%s",
+			    p->stage, f->path);
+			testpath = stagedpath;
 		}
-	} else {
-		buf = NULL;
-		regular = false;
 
-		if (S_ISDIR(st.st_mode)) {
-			pkg_emit_error("Plist error, directory listed as a file: %s", line);
-			free_file_attr(a);
-			return (EPKG_FATAL);
-		} else if (S_ISREG(st.st_mode))
-			regular = true;
+		if (f->error != 0) {
+			errno = f->error;
+			pkg_emit_errno("lstat", testpath);
+			if (p->stage != NULL)
+				ret = EPKG_FATAL;
+			developer = pkg_object_bool(pkg_config_get("DEVELOPER_MODE"));
+			if (developer) {
+				pkg_emit_developer_mode("Plist error, missing file: %s", f->line);
+				ret = EPKG_FATAL;
+			}
+			continue;
+		}
+
+		if (S_ISDIR(f->st.st_mode)) {
+			pkg_emit_error("Plist error, directory listed as a file: %s", f->line);
+			ret = EPKG_FATAL;
+			continue;
+		}
+		if (f->open_error != 0) {
+			errno = f->open_error;
+			pkg_emit_errno("open", testpath);
+		}
+		if (f->hash_error != 0) {
+			errno = f->hash_error;
+			pkg_emit_errno("sha256", testpath);
+		}
 
+		regular = S_ISREG(f->st.st_mode);
 
 		/* special case for hardlinks */
-		if (st.st_nlink > 1)
-			regular = is_hardlink(p->hardlinks, &st);
-
-		if (regular) {
-			p->flatsize += st.st_size;
-			if (pkg_type(p->pkg) == PKG_OLD_FILE)
-				md5_file(testpath, sha256);
-			else
-				sha256_file(testpath, sha256);
-			buf = sha256;
-		}
-		if (a != NULL)
-			ret = pkg_addfile_attr(p->pkg, path, buf,
-			    a->owner ? a->owner : p->uname,
-			    a->group ? a->group : p->gname,
-			    a->mode ? a->mode : p->perm, true);
-		else
-			ret = pkg_addfile_attr(p->pkg, path, buf, p->uname,
-			    p->gname, p->perm, true);
+		if (f->st.st_nlink > 1)
+			regular = is_hardlink(p->hardlinks, &f->st);
+
+		if (regular)
+			p->flatsize += f->st.st_size;
+
+		if (pkg_addfile_attr(p->pkg, f->path,
+		    regular && f->hashed ? f->sum : NULL,
+		    f->uname, f->gname, f->perm, true) != EPKG_OK)
+			ret = EPKG_FATAL;
 	}
 
-	free_file_attr(a);
 	return (ret);
 }
 
+static void
+plist_free_files(struct plist *p)
+{
+	struct plist_file *f;
+	size_t n;
+
+	for (n = 0; n < p->files.len; n++) {
+		f = &p->files.f[n];
+		free(f->path);
+		free(f->line);
+		free(f->uname);
+		free(f->gname);
+	}
+	free(p->files.f);
+}
+
 static int
 setmod(struct plist *p, char *line, struct file_attr *a)
 {
@@ -702,24 +906,24 @@ keyword_free(struct keyword *k)
 	free(k);
 }
 
-static int
-parse_actions(const ucl_object_t *o, struct plist *p,
-    char *line, struct file_attr *a)
+static void
+compile_actions(const ucl_object_t *o, struct external_keyword *k)
 {
 	const ucl_object_t *cur;
 	ucl_object_iter_t it = NULL;
+	struct action *a;
 	int i;
 
 	while ((cur = ucl_iterate_object(o, &it, true))) {
 		for (i = 0; list_actions[i].name != NULL; i++) {
 			if (!strcasecmp(ucl_object_tostring(cur), list_actions[i].name)) {
-				list_actions[i].perform(p, line, a);
+				a = malloc(sizeof(struct action));
+				a->perform = list_actions[i].perform;
+				LL_APPEND(k->actions, a);
 				break;
 			}
 		}
 	}
-
-	return (EPKG_OK);
 }
 
 static void
@@ -760,59 +964,105 @@ parse_attributes(const ucl_object_t *o, struct file_attr **a) {
 	}
 }
 
-static int
-apply_keyword_file(ucl_object_t *obj, struct plist *p, char *line, struct file_attr *attr)
+static void
+external_keyword_free(struct external_keyword *k)
+{
+	free(k->keyword);
+	free_file_attr(k->attr);
+	LL_FREE(k->actions, free);
+	if (k->obj != NULL)
+		ucl_object_unref(k->obj);
+	free(k);
+}
+
+static const char *
+keyword_script(const ucl_object_t *obj, const char *key)
 {
 	const ucl_object_t *o;
+
+	if ((o = ucl_object_find_key(obj, key)) == NULL)
+		return (NULL);
+
+	return (ucl_object_tostring(o));
+}
+
+static void
+append_keyword_script(struct sbuf *buf, const char *script, struct plist *p,
+    char *line)
+{
 	char *cmd;
 
-	if ((o = ucl_object_find_key(obj,  "attributes")))
-		parse_attributes(o, &attr);
+	if (script == NULL)
+		return;
 
-	if ((o = ucl_object_find_key(obj, "pre-install"))) {
-		format_exec_cmd(&cmd, ucl_object_tostring(o), p->prefix, p->last_file, line);
-		sbuf_printf(p->pre_install_buf, "%s\n", cmd);
-		free(cmd);
-	}
+	format_exec_cmd(&cmd, script, p->prefix, p->last_file, line);
+	sbuf_printf(buf, "%s\n", cmd);
+	free(cmd);
+}
 
-	if ((o = ucl_object_find_key(obj, "post-install"))) {
-		format_exec_cmd(&cmd, ucl_object_tostring(o), p->prefix, p->last_file, line);
-		sbuf_printf(p->post_install_buf, "%s\n", cmd);
-		free(cmd);
+/*
+ * Each action frees the attributes it is given, so hand every one of
+ * them its own copy of the keyword attributes merged over the ones
+ * given on the plist line.
+ */
+static struct file_attr *
+keyword_attr(const struct file_attr *kattr, const struct file_attr *attr)
+{
+	struct file_attr *a;
+	const char *owner = NULL, *group = NULL;
+	mode_t mode = 0;
+
+	if (attr != NULL) {
+		owner = attr->owner;
+		group = attr->group;
+		mode = attr->mode;
 	}
-
-	if ((o = ucl_object_find_key(obj, "pre-deinstall"))) {
-		format_exec_cmd(&cmd, ucl_object_tostring(o), p->prefix, p->last_file, line);
-		sbuf_printf(p->pre_deinstall_buf, "%s\n", cmd);
-		free(cmd);
+	if (kattr != NULL) {
+		if (kattr->owner != NULL)
+			owner = kattr->owner;
+		if (kattr->group != NULL)
+			group = kattr->group;
+		if (kattr->mode != 0)
+			mode = kattr->mode;
 	}
+	if (owner == NULL && group == NULL && mode == 0)
+		return (NULL);
 
-	if ((o = ucl_object_find_key(obj, "post-deinstall"))) {
-		format_exec_cmd(&cmd, ucl_object_tostring(o), p->prefix, p->last_file, line);
-		sbuf_printf(p->post_deinstall_buf, "%s\n", cmd);
-		free(cmd);
-	}
+	if ((a = calloc(1, sizeof(struct file_attr))) == NULL)
+		return (NULL);
+	if (owner != NULL)
+		a->owner = strdup(owner);
+	if (group != NULL)
+		a->group = strdup(group);
+	a->mode = mode;
 
-	if ((o = ucl_object_find_key(obj, "pre-upgrade"))) {
-		format_exec_cmd(&cmd, ucl_object_tostring(o), p->prefix, p->last_file, line);
-		sbuf_printf(p->pre_deinstall_buf, "%s\n", cmd);
-		free(cmd);
-	}
+	return (a);
+}
 
-	if ((o = ucl_object_find_key(obj, "post-upgrade"))) {
-		format_exec_cmd(&cmd, ucl_object_tostring(o), p->prefix, p->last_file, line);
-		sbuf_printf(p->post_deinstall_buf, "%s\n", cmd);
-		free(cmd);
-	}
+static int
+apply_keyword_file(struct external_keyword *k, struct plist *p, char *line,
+    struct file_attr *attr)
+{
+	struct action *a;
+
+	append_keyword_script(p->pre_install_buf, k->pre_install, p, line);
+	append_keyword_script(p->post_install_buf, k->post_install, p, line);
+	append_keyword_script(p->pre_deinstall_buf, k->pre_deinstall, p, line);
+	append_keyword_script(p->post_deinstall_buf, k->post_deinstall, p,
+	    line);
+	append_keyword_script(p->pre_deinstall_buf, k->pre_upgrade, p, line);
+	append_keyword_script(p->post_deinstall_buf, k->post_upgrade, p, line);
+
+	LL_FOREACH(k->actions, a)
+		a->perform(p, line, keyword_attr(k->attr, attr));
 
-	if ((o = ucl_object_find_key(obj,  "actions")))
-		parse_actions(o, p, line, attr);
+	free_file_attr(attr);
 
 	return (EPKG_OK);
 }
 
 static ucl_object_t *
-external_yaml_keyword(char *keyword)
+external_yaml_keyword(const char *keyword)
 {
 	const char *keyword_dir = NULL;
 	char keyfile_path[MAXPATHLEN];
@@ -830,16 +1080,32 @@ external_yaml_keyword(char *keyword)
 	return (yaml_to_ucl(keyfile_path, NULL, 0));
 }
 
-static int
-external_keyword(struct plist *plist, char *keyword, char *line, struct file_attr *attr)
+/*
+ * Load, validate and compile the definition of an external keyword.
+ * The result, including a failure, is remembered for the whole plist so
+ * that the keyword file is only read and validated once.
+ */
+static struct external_keyword *
+external_keyword_compile(struct plist *plist, const char *keyword)
 {
 	struct ucl_parser *parser;
+	struct external_keyword *k;
 	const char *keyword_dir = NULL;
 	char keyfile_path[MAXPATHLEN];
-	int ret = EPKG_UNKNOWN;
 	ucl_object_t *o, *schema;
+	const ucl_object_t *obj;
 	struct ucl_schema_error err;
 
+	if ((k = calloc(1, sizeof(struct external_keyword))) == NULL)
+		return (NULL);
+	if ((k->keyword = strdup(keyword)) == NULL) {
+		free(k);
+		return (NULL);
+	}
+	k->status = EPKG_UNKNOWN;
+	HASH_ADD_KEYPTR(hh, plist->ext_keywords, k->keyword,
+	    strlen(k->keyword), k);
+
 	keyword_dir = pkg_object_string(pkg_config_get("PLIST_KEYWORDS_DIR"));
 	if (keyword_dir == NULL) {
 		keyword_dir = pkg_object_string(pkg_config_get("PORTSDIR"));
@@ -852,14 +1118,14 @@ external_keyword(struct plist *plist, char *keyword, char *line, struct file_att
 
 	if (eaccess(keyfile_path, R_OK) != 0) {
 		if ((o = external_yaml_keyword(keyword)) == NULL)
-			return (EPKG_UNKNOWN);
+			return (k);
 	} else {
 		parser = ucl_parser_new(0);
 		if (!ucl_parser_add_file(parser, keyfile_path)) {
 			pkg_emit_error("cannot parse keyword: %s",
 			    ucl_parser_get_error(parser));
 			ucl_parser_free(parser);
-			return (EPKG_UNKNOWN);
+			return (k);
 		}
 
 		o = ucl_parser_get_object(parser);
@@ -872,13 +1138,42 @@ external_keyword(struct plist *plist, char *keyword, char *line, struct file_att
 		if (!ucl_object_validate(schema, o, &err)) {
 			pkg_emit_error("Keyword definition %s cannot be validated: %s", keyfile_path, err.msg);
 			ucl_object_unref(o);
-			return (EPKG_FATAL);
+			k->status = EPKG_FATAL;
+			return (k);
 		}
 	}
 
-	ret = apply_keyword_file(o, plist, line, attr);
+	k->obj = o;
+	if ((obj = ucl_object_find_key(o, "attributes")))
+		parse_attributes(obj, &k->attr);
+	k->pre_install = keyword_script(o, "pre-install");
+	k->post_install = keyword_script(o, "post-install");
+	k->pre_deinstall = keyword_script(o, "pre-deinstall");
+	k->post_deinstall = keyword_script(o, "post-deinstall");
+	k->pre_upgrade = keyword_script(o, "pre-upgrade");
+	k->post_upgrade = keyword_script(o, "post-upgrade");
+	if ((obj = ucl_object_find_key(o, "actions")))
+		compile_actions(obj, k);
+	k->status = EPKG_OK;
+
+	return (k);
+}
 
-	return (ret);
+static int
+external_keyword(struct plist *plist, char *keyword, char *line, struct file_attr *attr)
+{
+	struct external_keyword *k;
+
+	HASH_FIND_STR(plist->ext_keywords, keyword, k);
+	if (k == NULL && (k = external_keyword_compile(plist, keyword)) == NULL)
+		return (EPKG_FATAL);
+
+	if (k->status != EPKG_OK) {
+		free_file_attr(attr);
+		return (k->status);
+	}
+
+	return (apply_keyword_file(k, plist, line, attr));
 }
 
 static int
@@ -931,9 +1226,9 @@ parse_keywords(struct plist *plist, char *keyword, char *line)
 		permstr[strlen(permstr) - 1] = '\0';
 		attr = calloc(1, sizeof(struct file_attr));
 		if (*owner != '\0')
-			attr->owner = owner;
+			attr->owner = strdup(owner);
 		if (*group != '\0')
-			attr->group = group;
+			attr->group = strdup(group);
 		if (*permstr != '\0') {
 			attr->mode = getmode(set, 0);
 			free(set);
@@ -1003,6 +1298,10 @@ ports_parse_plist(struct pkg *pkg, const char *plist, const char *stage)
 	pplist.hardlinks = NULL;
 	pplist.flatsize = 0;
 	pplist.keywords = NULL;
+	pplist.ext_keywords = NULL;
+	pplist.files.f = NULL;
+	pplist.files.len = 0;
+	pplist.files.cap = 0;
 	pplist.post_patterns.buf = NULL;
 	pplist.post_patterns.patterns = NULL;
 	pplist.post_patterns.cap = 0;
@@ -1079,6 +1378,10 @@ ports_parse_plist(struct pkg *pkg, const char *plist, const char *stage)
 
 	free(line);
 
+	if (plist_scan_files(&pplist) != EPKG_OK)
+		ret = EPKG_FATAL;
+	plist_free_files(&pplist);
+
 	pkg_set(pkg, PKG_FLATSIZE, pplist.flatsize);
 
 	flush_script_buffer(pplist.pre_install_buf, pkg,
@@ -1097,6 +1400,7 @@ ports_parse_plist(struct pkg *pkg, const char *plist, const char *stage)
 	HASH_FREE(pplist.hardlinks, free);
 
 	HASH_FREE(pplist.keywords, keyword_free);
+	HASH_FREE(pplist.ext_keywords, external_keyword_free);
 
 	if (pplist.pkgdep != NULL)
 		free(pplist.pkgdep);
@@ -850,10 +850,10 @@ format_annotations(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while ((note = pkg_object_iterate(an, &it))) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     note, count, PP_A);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     note, count, PP_A);
 			count++;
 		}
@@ -904,10 +904,10 @@ format_shlibs_required(struct sbuf *sbuf, const void *data, struct percent_esc *
 		count = 1;
 		while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     shlib, count, PP_B);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     shlib, count, PP_B);
 			count++;
 		}
@@ -953,10 +953,10 @@ format_categories(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while ((cat = pkg_object_iterate(obj, &it))) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     cat, count, PP_C);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt), 
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET, 
 				     cat, count, PP_C);
 			count++;
 		}
@@ -997,10 +997,10 @@ format_directories(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while (pkg_dirs(pkg, &dir) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt), 
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET, 
 					     dir, count, PP_D);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     dir, count, PP_D);
 			count++;
 		}
@@ -1100,10 +1100,10 @@ format_files(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while (pkg_files(pkg, &file) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     file, count, PP_F);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     file, count, PP_F);
 			count++;
 		}
@@ -1199,10 +1199,10 @@ format_groups(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while(pkg_groups(pkg, &group) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     group, count, PP_G);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     group, count, PP_G);
 			count++;
 		}
@@ -1268,10 +1268,10 @@ format_licenses(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while ((lic = pkg_object_iterate(obj, &iter))) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     lic, count, PP_L);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     lic, count, PP_L);
 			count++;
 		}
@@ -1337,10 +1337,10 @@ format_options(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while (pkg_options(pkg, &opt) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     opt, count, PP_O);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     opt, count, PP_O);
 			count++;
 		}
@@ -1438,10 +1438,10 @@ format_users(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while (pkg_users(pkg, &user) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     user, count, PP_U);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     user, count, PP_U);
 			count++;
 		}
@@ -1521,10 +1521,10 @@ format_shlibs_provided(struct sbuf *sbuf, const void *data, struct percent_esc *
 		count = 1;
 		while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     shlib, count, PP_b);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     shlib, count, PP_b);
 			count++;
 		}
@@ -1566,10 +1566,10 @@ format_dependencies(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while (pkg_deps(pkg, &dep) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     dep, count, PP_d);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     dep, count, PP_d);
 			count++;
 		}
@@ -1752,10 +1752,10 @@ format_requirements(struct sbuf *sbuf, const void *data, struct percent_esc *p)
 		count = 1;
 		while (pkg_rdeps(pkg, &req) == EPKG_OK) {
 			if (count > 1)
-				iterate_item(sbuf, pkg, sbuf_data(p->sep_fmt),
+				iterate_item(sbuf, pkg, p, SEP_FMT_SET,
 					     req, count, PP_r);
 
-			iterate_item(sbuf, pkg, sbuf_data(p->item_fmt),
+			iterate_item(sbuf, pkg, p, ITEM_FMT_SET,
 				     req, count, PP_r);
 			count++;
 		}
@@ -1922,6 +1922,11 @@ clear_percent_esc(struct percent_esc *p)
 	sbuf_clear(p->sep_fmt);
 	sbuf_finish(p->sep_fmt);
 
+	pkg_printf_free(p->item_prog);
+	p->item_prog = NULL;
+	pkg_printf_free(p->sep_prog);
+	p->sep_prog = NULL;
+
 	p->fmt_code = '\0';
 
 	return (p);
@@ -1935,6 +1940,8 @@ free_percent_esc(struct percent_esc *p)
 			sbuf_delete(p->item_fmt);
 		if (p->sep_fmt)
 			sbuf_delete(p->sep_fmt);
+		pkg_printf_free(p->item_prog);
+		pkg_printf_free(p->sep_prog);
 		free(p);
 	}
 	return;
@@ -2259,43 +2266,32 @@ set_list_defaults(struct percent_esc *p, const char *item_fmt,
 }
 
 struct sbuf *
-iterate_item(struct sbuf *sbuf, const struct pkg *pkg, const char *format,
-	     const void *data, int count, unsigned context)
+iterate_item(struct sbuf *sbuf, const struct pkg *pkg, struct percent_esc *p,
+	     unsigned which, const void *data, int count, unsigned context)
 {
-	const char		*f;
-	struct percent_esc	*p;
+	struct pkg_printf_prog	**prog;
+	struct sbuf		 *format;
 
-	/* Scan the format string and interpret any escapes */
+	/* Compile the item or separator format the first time round,
+	   and reuse it for the rest of the list */
 
-	f = format;
-	p = new_percent_esc();
+	if (which == SEP_FMT_SET) {
+		prog = &p->sep_prog;
+		format = p->sep_fmt;
+	} else {
+		prog = &p->item_prog;
+		format = p->item_fmt;
+	}
 
-	if (p == NULL) {
+	if (*prog == NULL)
+		*prog = compile_format(sbuf_data(format), context);
+
+	if (*prog == NULL) {
 		sbuf_clear(sbuf);
 		return (sbuf);	/* Out of memory */
 	}
 
-	while ( *f != '\0' ) {
-		switch(*f) {
-		case '%':
-			f = process_format_trailer(sbuf, p, f, pkg, data, count, context);
-			break;
-		case '\\':
-			f = process_escape(sbuf, f);
-			break;
-		default:
-			sbuf_putc(sbuf, *f);
-			f++;
-			break;
-		}
-		if (f == NULL) {
-			sbuf_clear(sbuf);
-			break;	/* Out of memory */
-		}
-	}
-
-	free_percent_esc(p);
-	return (sbuf);
+	return (exec_item(sbuf, *prog, pkg, data, count));
 }
 
 const char *
@@ -2770,48 +2766,275 @@ process_escape(struct sbuf *sbuf, const char *f)
 	return (f);
 }
 
-const char *
-process_format_trailer(struct sbuf *sbuf, struct percent_esc *p,
-		       const char *f, const struct pkg *pkg, 
-		       const void *data, int count, unsigned context)
-{
-	const char		*fstart;
-	struct sbuf		*s;
-
-	fstart = f;
-	f = parse_format(f, context, p);
-
-	if (p->fmt_code == PP_ROW_COUNTER)
-		s = fmt[p->fmt_code].fmt_handler(sbuf, &count, p);
-	else if (p->fmt_code > PP_LAST_FORMAT)
-		s = fmt[p->fmt_code].fmt_handler(sbuf, NULL, p);
-	else if (fmt[p->fmt_code].struct_pkg)
-		s = fmt[p->fmt_code].fmt_handler(sbuf, pkg, p);
-	else
-		s = fmt[p->fmt_code].fmt_handler(sbuf, data, p);
+/*
+ * A compiled format is a list of operations, each of which either
+ * copies a chunk of literal text (with the \ escapes already
+ * expanded) or calls one format handler.  All the text lives in one
+ * sbuf; ops refer to it by offset.  For a handler the text is the
+ * escape as written, output unchanged if the handler fails.
+ */
+struct pkg_printf_op {
+	struct percent_esc	*p;	/* NULL for literal text */
+	size_t			 off;
+	size_t			 len;
+};
 
+struct pkg_printf_prog {
+	struct sbuf		*text;
+	struct pkg_printf_op	*ops;
+	unsigned		 nops;
+	unsigned		 cap;
+};
 
-	if (s == NULL) {
-		f = fstart + 1;	/* Eat just the % on error */
-	}
+static struct pkg_printf_op *
+add_op(struct pkg_printf_prog *prog, struct percent_esc *p, size_t off)
+{
+	struct pkg_printf_op	*op;
 
-	clear_percent_esc(p);
+	if (prog->nops == prog->cap) {
+		prog->cap = prog->cap == 0 ? 8 : prog->cap * 2;
+		prog->ops = reallocf(prog->ops,
+		    prog->cap * sizeof(struct pkg_printf_op));
+		if (prog->ops == NULL) {
+			prog->nops = 0;
+			return (NULL);
+		}
+	}
+	op = &prog->ops[prog->nops++];
+	op->p = p;
+	op->off = off;
+	op->len = sbuf_len(prog->text) - off;
 
-	return (f);
+	return (op);
 }
 
-const char *
-process_format_main(struct sbuf *sbuf, struct percent_esc *p,
-		const char *fstart, const char *fend, void *data)
+static bool
+add_literal(struct pkg_printf_prog *prog, size_t off)
 {
-	struct sbuf		*s;
+	struct pkg_printf_op	*op;
+
+	if (sbuf_len(prog->text) == (ssize_t)off)
+		return (true);
+
+	/* Extend the previous chunk of text if this follows on */
+	if (prog->nops > 0) {
+		op = &prog->ops[prog->nops - 1];
+		if (op->p == NULL && op->off + op->len == off) {
+			op->len = sbuf_len(prog->text) - op->off;
+			return (true);
+		}
+	}
+
+	return (add_op(prog, NULL, off) != NULL);
+}
 
-	s = fmt[p->fmt_code].fmt_handler(sbuf, data, p);
+static void
+exec_op(struct sbuf *sbuf, struct pkg_printf_op *op, const char *text,
+	const void *data)
+{
+	unsigned	flags;
 
-	clear_percent_esc(p);
+	/* The value formatters consume the ? and # modifiers, so put
+	   them back for the next time round */
+	flags = op->p->flags;
 
 	/* Pass through unprocessed on error */
-	return (s == NULL ? fstart : fend);
+	if (fmt[op->p->fmt_code].fmt_handler(sbuf, data, op->p) == NULL)
+		sbuf_bcat(sbuf, text + op->off, op->len);
+
+	op->p->flags = flags;
+}
+
+struct pkg_printf_prog *
+compile_format(const char *format, unsigned context)
+{
+	struct pkg_printf_prog	*prog;
+	struct percent_esc	*p;
+	const char		*f, *fend;
+	size_t			 off;
+
+	if ((prog = calloc(1, sizeof(struct pkg_printf_prog))) == NULL)
+		return (NULL);
+	if ((prog->text = sbuf_new_auto()) == NULL) {
+		free(prog);
+		return (NULL);
+	}
+
+	f = format;
+	while (*f != '\0') {
+		off = sbuf_len(prog->text);
+
+		switch (*f) {
+		case '%':
+			if ((p = new_percent_esc()) == NULL)
+				goto oom;
+			fend = parse_format(f, context, p);
+
+			/* Unknown format codes are passed through: the
+			   '%' is literal, and the rest is scanned again
+			   as ordinary text */
+			if (p->fmt_code == PP_UNKNOWN) {
+				free_percent_esc(p);
+				sbuf_putc(prog->text, '%');
+				f++;
+				if (!add_literal(prog, off))
+					goto oom;
+				break;
+			}
+
+			sbuf_bcat(prog->text, f, fend - f);
+			if (add_op(prog, p, off) == NULL) {
+				free_percent_esc(p);
+				goto oom;
+			}
+			f = fend;
+			break;
+		case '\\':
+			f = process_escape(prog->text, f);
+			if (!add_literal(prog, off))
+				goto oom;
+			break;
+		default:
+			sbuf_putc(prog->text, *f);
+			f++;
+			if (!add_literal(prog, off))
+				goto oom;
+			break;
+		}
+	}
+
+	if (sbuf_finish(prog->text) != 0)
+		goto oom;
+
+	return (prog);
+
+oom:
+	pkg_printf_free(prog);
+	return (NULL);
+}
+
+struct sbuf *
+exec_item(struct sbuf *sbuf, struct pkg_printf_prog *prog,
+	  const struct pkg *pkg, const void *data, int count)
+{
+	struct pkg_printf_op	*op;
+	const void		*arg;
+	const char		*text;
+	unsigned		 i;
+
+	text = sbuf_data(prog->text);
+
+	for (i = 0; i < prog->nops; i++) {
+		op = &prog->ops[i];
+
+		if (op->p == NULL) {
+			sbuf_bcat(sbuf, text + op->off, op->len);
+			continue;
+		}
+
+		if (op->p->fmt_code == PP_ROW_COUNTER)
+			arg = &count;
+		else if (op->p->fmt_code > PP_LAST_FORMAT)
+			arg = NULL;
+		else if (fmt[op->p->fmt_code].struct_pkg)
+			arg = pkg;
+		else
+			arg = data;
+
+		exec_op(sbuf, op, text, arg);
+	}
+
+	return (sbuf);
+}
+
+/**
+ * Parse a format string once, for printing many packages with it.
+ * @param format String with embedded %-escapes indicating what to output
+ * @return the compiled format, or NULL if out of memory
+ */
+struct pkg_printf_prog *
+pkg_printf_compile(const char * restrict format)
+{
+	assert(format != NULL);
+
+	return (compile_format(format, PP_PKG));
+}
+
+/**
+ * Free a format compiled by pkg_printf_compile()
+ */
+void
+pkg_printf_free(struct pkg_printf_prog *prog)
+{
+	unsigned	i;
+
+	if (prog == NULL)
+		return;
+
+	for (i = 0; i < prog->nops; i++)
+		free_percent_esc(prog->ops[i].p);
+	free(prog->ops);
+	sbuf_delete(prog->text);
+	free(prog);
+}
+
+/**
+ * store data from pkg into sbuf as indicated by a compiled format.
+ * @param sbuf contains the result
+ * @param prog format compiled by pkg_printf_compile()
+ * @param ... Varargs list of struct pkg etc. supplying the data
+ * @return sbuf
+ */
+struct sbuf *
+pkg_printf_exec(struct sbuf * restrict sbuf, struct pkg_printf_prog *prog, ...)
+{
+	va_list		 ap;
+
+	va_start(ap, prog);
+	sbuf = pkg_printf_vexec(sbuf, prog, ap);
+	va_end(ap);
+
+	return (sbuf);
+}
+
+/**
+ * store data from pkg into sbuf as indicated by a compiled format.
+ * @param sbuf contains the result
+ * @param prog format compiled by pkg_printf_compile()
+ * @param ap Arglist with struct pkg etc. supplying the data
+ * @return sbuf
+ */
+struct sbuf *
+pkg_printf_vexec(struct sbuf * restrict sbuf, struct pkg_printf_prog *prog,
+		 va_list ap)
+{
+	struct pkg_printf_op	*op;
+	const char		*text;
+	void			*data;
+	unsigned		 i;
+
+	assert(sbuf != NULL);
+	assert(prog != NULL);
+
+	text = sbuf_data(prog->text);
+
+	for (i = 0; i < prog->nops; i++) {
+		op = &prog->ops[i];
+
+		if (op->p == NULL) {
+			sbuf_bcat(sbuf, text + op->off, op->len);
+			continue;
+		}
+
+		if (op->p->fmt_code <= PP_LAST_FORMAT)
+			data = va_arg(ap, void *);
+		else
+			data = NULL;
+
+		exec_op(sbuf, op, text, data);
+	}
+
+	return (sbuf);
 }
 
 /**
@@ -3092,47 +3315,21 @@ struct sbuf *
 pkg_sbuf_vprintf(struct sbuf * restrict sbuf, const char * restrict format,
 		 va_list ap)
 {
-	const char		*f, *fend;
-	struct percent_esc	*p;
-	void		*data;
+	struct pkg_printf_prog	*prog;
 
 	assert(sbuf != NULL);
 	assert(format != NULL);
 
-	f = format;
-	p = new_percent_esc();
+	prog = compile_format(format, PP_PKG);
 
-	if (p == NULL) {
+	if (prog == NULL) {
 		sbuf_clear(sbuf);
 		return (sbuf);	/* Out of memory */
 	}
 
-	while ( *f != '\0' ) {
-		switch(*f) {
-		case '%':
-			fend = parse_format(f, PP_PKG, p);
-
-			if (p->fmt_code <= PP_LAST_FORMAT)
-				data = va_arg(ap, void *);
-			else
-				data = NULL;
-			f = process_format_main(sbuf, p, f, fend, data);
-			break;
-		case '\\':
-			f = process_escape(sbuf, f);
-			break;
-		default:
-			sbuf_putc(sbuf, *f);
-			f++;
-			break;
-		}
-		if (f == NULL) {
-			sbuf_clear(sbuf);
-			break;	/* Error: out of memory */
-		}
-	}
+	sbuf = pkg_printf_vexec(sbuf, prog, ap);
 
-	free_percent_esc(p);
+	pkg_printf_free(prog);
 	return (sbuf);
 }
 /*
@@ -99,7 +99,9 @@ pkg_repo_cached_name(struct pkg *pkg, char *dest, size_t destlen)
 
 		/*
 		 * The real naming scheme:
-		 * <cachedir>/<name>-<version>-<checksum>.txz
+		 * <cachedir>/<name>-<version>-<checksum>.<ext>
+		 * where <ext> is the one of the package in the repository
+		 * (txz, tzst...)
 		 */
 		pkg_snprintf(dest, destlen, "%S/%n-%v-%z%S",
 				cachedir, pkg, pkg, pkg, ext);
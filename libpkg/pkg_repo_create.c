@@ -124,6 +124,7 @@ pkg_read_pkg_file(void *data)
 		if (strcmp(ext, ".tgz") != 0 &&
 				strcmp(ext, ".tbz") != 0 &&
 				strcmp(ext, ".txz") != 0 &&
+				strcmp(ext, ".tzst") != 0 &&
 				strcmp(ext, ".tar") != 0)
 			continue;
 
@@ -85,7 +85,7 @@ pkg_repo_meta_open_schema_v1()
 			"version = {type = integer};\n"
 			"maintainer = {type = string};\n"
 			"source = {type = string};\n"
-			"packing_format = {enum = [txz, tbz, tgz]};\n"
+			"packing_format = {enum = [tzst, txz, tbz, tgz]};\n"
 			"digest_format = {enum = [sha256]};\n"
 			"digests = {type = string};\n"
 			"manifests = {type = string};\n"
@@ -335,6 +335,113 @@ pkg_version_cmp(const char * const pkg1, const char * const pkg2)
 	return (result);
 }
 
+/*
+ * A parsed version: the components of ${PORTVERSION} as returned by
+ * get_component(), with the `+' separators kept as block markers so that
+ * pkg_version_key_cmp() walks them exactly like pkg_version_cmp() does.
+ */
+struct pkg_version_key {
+	unsigned long epoch;
+	unsigned long revision;
+	size_t ncomponents;
+	struct version_key_component {
+		version_component vc;
+		bool block;
+	} c[];
+};
+
+int
+pkg_version_key_new(struct pkg_version_key **key, const char *version)
+{
+	const char *v, *ve, *pos;
+	struct pkg_version_key *k;
+	unsigned long epoch, revision;
+	size_t n = 0;
+
+	assert(key != NULL);
+
+	v = split_version(version, &ve, &epoch, &revision);
+	if (v == NULL)
+		return (EPKG_FATAL);
+
+	/*
+	 * Every component consumes at least one character, so the length
+	 * of the version is an upper bound of their number.
+	 */
+	k = malloc(sizeof(struct pkg_version_key) +
+	    (ve - v) * sizeof(struct version_key_component));
+	if (k == NULL) {
+		pkg_emit_errno("malloc", "pkg_version_key");
+		return (EPKG_FATAL);
+	}
+	k->epoch = epoch;
+	k->revision = revision;
+
+	for (pos = v; pos < ve; n++) {
+		if (*pos == '+') {
+			k->c[n].block = true;
+			pos++;
+		} else {
+			memset(&k->c[n].vc, 0, sizeof(k->c[n].vc));
+			k->c[n].block = false;
+			pos = get_component(pos, &k->c[n].vc);
+		}
+	}
+	k->ncomponents = n;
+
+	*key = k;
+
+	return (EPKG_OK);
+}
+
+void
+pkg_version_key_free(struct pkg_version_key *key)
+{
+	free(key);
+}
+
+int
+pkg_version_key_cmp(const struct pkg_version_key *k1,
+    const struct pkg_version_key *k2)
+{
+	static const version_component zero = {0, 0, 0};
+	const version_component *vc1, *vc2;
+	size_t i1 = 0, i2 = 0;
+	int result = 0;
+
+	if (k1->epoch != k2->epoch)
+		return (k1->epoch < k2->epoch ? -1 : 1);
+
+	while (result == 0 &&
+	    (i1 < k1->ncomponents || i2 < k2->ncomponents)) {
+		bool block_v1 = (i1 >= k1->ncomponents || k1->c[i1].block);
+		bool block_v2 = (i2 >= k2->ncomponents || k2->c[i2].block);
+
+		if (block_v1 && block_v2) {
+			if (i1 < k1->ncomponents)
+				i1++;
+			if (i2 < k2->ncomponents)
+				i2++;
+			continue;
+		}
+
+		vc1 = block_v1 ? &zero : &k1->c[i1++].vc;
+		vc2 = block_v2 ? &zero : &k2->c[i2++].vc;
+
+		if (vc1->n != vc2->n)
+			result = (vc1->n < vc2->n ? -1 : 1);
+		else if (vc1->a != vc2->a)
+			result = (vc1->a < vc2->a ? -1 : 1);
+		else if (vc1->pl != vc2->pl)
+			result = (vc1->pl < vc2->pl ? -1 : 1);
+	}
+
+	if (result == 0 && k1->revision != k2->revision)
+		result = (k1->revision < k2->revision ? -1 : 1);
+
+	return (result);
+}
+
 pkg_change_t
 pkg_version_change(const struct pkg * restrict pkg)
 {
@@ -33,18 +33,22 @@
 
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/time.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
 #include <grp.h>
 #include <libutil.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 
 #include <sqlite3.h>
 
@@ -72,7 +76,7 @@
 */
 
 #define DB_SCHEMA_MAJOR	0
-#define DB_SCHEMA_MINOR	22
+#define DB_SCHEMA_MINOR	24
 
 #define DBVERSION (DB_SCHEMA_MAJOR * 1000 + DB_SCHEMA_MINOR)
 
@@ -87,6 +91,7 @@ static int prstmt_initialize(struct pkgdb *db);
 /* static int run_prstmt(sql_prstmt_index s, ...); */
 static void prstmt_finalize(struct pkgdb *db);
 static int pkgdb_insert_scripts(struct pkg *pkg, int64_t package_id, sqlite3 *s);
+static void pkgdb_integrity_free(struct pkgdb *db);
 
 
 extern int sqlite3_shell(int, char**);
@@ -126,8 +131,98 @@ static struct column_mapping {
 	{ NULL,		-1 }
 };
 
+/*
+ * Prepared statements are kept on the pkgdb handle, keyed by their final SQL
+ * text, that is by the template and the database it was expanded for.  They
+ * are reset and rebound on each use instead of being prepared again.  A
+ * statement still stepped by an iterator is not shared: a fresh one is
+ * prepared and finalized on release.
+ */
+#define PKGDB_STMT_CACHE_MAX	128
+
+/* Pages in the local WAL before sqlite checkpoints on its own */
+#define PKGDB_WAL_AUTOCHECKPOINT	10000
+/* Size the local WAL is truncated back to when it starts over */
+#define PKGDB_WAL_SIZE_LIMIT		(16 * 1024 * 1024)
+
+struct pkgdb_stmt {
+	char		*sql;
+	sqlite3_stmt	*stmt;
+	bool		 busy;
+	UT_hash_handle	 hh;
+};
+
+sqlite3_stmt *
+pkgdb_stmt_get(struct pkgdb *db, const char *sql)
+{
+	struct pkgdb_stmt	*s;
+	sqlite3_stmt		*stmt;
+
+	assert(db != NULL && sql != NULL);
+
+	HASH_FIND_STR(db->stmts, sql, s);
+	if (s != NULL && !s->busy) {
+		s->busy = true;
+		return (s->stmt);
+	}
+
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (NULL);
+	}
+
+	if (s != NULL || HASH_COUNT(db->stmts) >= PKGDB_STMT_CACHE_MAX)
+		return (stmt);
+
+	if ((s = calloc(1, sizeof(struct pkgdb_stmt))) == NULL ||
+	    (s->sql = strdup(sql)) == NULL) {
+		free(s);
+		return (stmt);
+	}
+	s->stmt = stmt;
+	s->busy = true;
+	HASH_ADD_KEYPTR(hh, db->stmts, s->sql, strlen(s->sql), s);
+
+	return (stmt);
+}
+
+void
+pkgdb_stmt_release(struct pkgdb *db, sqlite3_stmt *stmt)
+{
+	struct pkgdb_stmt	*s = NULL;
+	const char		*sql;
+
+	if (stmt == NULL)
+		return;
+
+	if (db != NULL && (sql = sqlite3_sql(stmt)) != NULL)
+		HASH_FIND_STR(db->stmts, sql, s);
+
+	if (s == NULL || s->stmt != stmt) {
+		sqlite3_finalize(stmt);
+		return;
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	s->busy = false;
+}
+
+static void
+pkgdb_stmt_cache_free(struct pkgdb *db)
+{
+	struct pkgdb_stmt	*s, *stmp;
+
+	HASH_ITER(hh, db->stmts, s, stmp) {
+		HASH_DEL(db->stmts, s);
+		sqlite3_finalize(s->stmt);
+		free(s->sql);
+		free(s);
+	}
+}
+
 static int
-load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
+load_val(struct pkgdb *db, struct pkg *pkg, const char *sql, unsigned flags,
     int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
 {
 	sqlite3_stmt	*stmt;
@@ -140,10 +235,8 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -152,12 +245,12 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		pkg_adddata(pkg, sqlite3_column_text(stmt, 0));
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db);
+		ERROR_SQLITE(db->sqlite);
 		return (EPKG_FATAL);
 	}
 
@@ -166,7 +259,7 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 }
 
 static int
-load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
+load_tag_val(struct pkgdb *db, struct pkg *pkg, const char *sql, unsigned flags,
 	     int (*pkg_addtagval)(struct pkg *pkg, const char *tag, const char *val),
 	     int list)
 {
@@ -180,10 +273,8 @@ load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -192,12 +283,12 @@ load_tag_val(sqlite3 *db, struct pkg *pkg, const char *sql, unsigned flags,
 		pkg_addtagval(pkg, sqlite3_column_text(stmt, 0),
 			      sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db);
+		ERROR_SQLITE(db->sqlite);
 		return (EPKG_FATAL);
 	}
 
@@ -523,7 +614,8 @@ pkgdb_init(sqlite3 *sdb)
 		"path TEXT PRIMARY KEY,"
 		"sha256 TEXT,"
 		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
-			" ON UPDATE CASCADE"
+			" ON UPDATE CASCADE,"
+		"name TEXT"
 	");"
 	"CREATE TABLE directories ("
 		"id INTEGER PRIMARY KEY,"
@@ -649,6 +741,23 @@ pkgdb_init(sqlite3 *sdb)
 	"CREATE INDEX pkg_conflicts_pid ON pkg_conflicts(package_id);"
 	"CREATE INDEX pkg_conflicts_cid ON pkg_conflicts(conflict_id);"
 	"CREATE INDEX pkg_provides_id ON pkg_provides(package_id);"
+	/* reverse lookups used by pkg query -e */
+	"CREATE INDEX deps_name ON deps(name);"
+	"CREATE INDEX pkg_categories_category_id ON pkg_categories(category_id);"
+	"CREATE INDEX pkg_licenses_license_id ON pkg_licenses(license_id);"
+	"CREATE INDEX pkg_option_option_id ON pkg_option(option_id);"
+	"CREATE INDEX pkg_shlibs_required_shlib_id ON pkg_shlibs_required(shlib_id);"
+	"CREATE INDEX pkg_shlibs_provided_shlib_id ON pkg_shlibs_provided(shlib_id);"
+	"CREATE INDEX pkg_annotation_tag_id ON pkg_annotation(tag_id);"
+	"CREATE INDEX pkg_annotation_value_id ON pkg_annotation(value_id);"
+	"CREATE INDEX files_name ON files(name);"
+
+	/* fill in the basename of files registered by older versions */
+	"CREATE TRIGGER files_name AFTER INSERT ON files "
+		"WHEN new.name IS NULL BEGIN "
+		"UPDATE files SET name = " PKGDB_SQL_BASENAME("new.path") " "
+		"WHERE path = new.path; "
+	"END;"
 
 	"CREATE VIEW pkg_shlibs AS SELECT * FROM pkg_shlibs_required;"
 	"CREATE TRIGGER pkg_shlibs_update "
@@ -1037,6 +1146,105 @@ pkgdb_access(unsigned mode, unsigned database)
 	return (retval);
 }
 
+/*
+ * Switch the journal mode of the local database to mode, if not NULL, and
+ * report whether it ends up in write-ahead logging mode.  SQLite keeps the
+ * old mode when it cannot switch, e.g. while another connection is open.
+ */
+static bool
+pkgdb_journal_wal(sqlite3 *s, const char *mode)
+{
+	sqlite3_stmt	*stmt;
+	char		 sql[64];
+	bool		 wal = false;
+
+	if (mode == NULL)
+		strlcpy(sql, "PRAGMA main.journal_mode;", sizeof(sql));
+	else
+		snprintf(sql, sizeof(sql), "PRAGMA main.journal_mode = %s;",
+		    mode);
+
+	pkg_debug(4, "Pkgdb: running '%s'", sql);
+	if (sqlite3_prepare_v2(s, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		return (false);
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		wal = (strcasecmp(sqlite3_column_text(stmt, 0), "wal") == 0);
+
+	sqlite3_finalize(stmt);
+
+	return (wal);
+}
+
+static int
+pkgdb_tune(struct pkgdb *db)
+{
+	bool		 want_wal;
+	int64_t		 mmap_size, cache_size;
+
+	want_wal = pkg_object_bool(pkg_config_get("SQLITE_WAL"));
+	mmap_size = pkg_object_int(pkg_config_get("SQLITE_MMAP_SIZE"));
+	cache_size = pkg_object_int(pkg_config_get("SQLITE_CACHE_SIZE"));
+
+	/* A negative cache_size is a size in KiB rather than in pages */
+	if (sql_exec(db->sqlite, "PRAGMA mmap_size = %" PRId64 ";"
+	    "PRAGMA cache_size = %" PRId64 ";",
+	    mmap_size, -cache_size) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	db->wal = pkgdb_journal_wal(db->sqlite, NULL);
+	if (want_wal != db->wal && !sqlite3_db_readonly(db->sqlite, "main"))
+		db->wal = pkgdb_journal_wal(db->sqlite,
+		    want_wal ? "WAL" : "DELETE");
+
+	/*
+	 * Checkpoints are run by pkgdb_checkpoint() once a batch of jobs
+	 * is committed rather than every 1000 pages in the middle of an
+	 * upgrade; the large automatic threshold only bounds the log of a
+	 * single huge transaction.
+	 */
+	if (db->wal && sql_exec(db->sqlite, "PRAGMA wal_autocheckpoint = %d;"
+	    "PRAGMA journal_size_limit = %d;", PKGDB_WAL_AUTOCHECKPOINT,
+	    PKGDB_WAL_SIZE_LIMIT) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+static int
+pkgdb_wal_checkpoint(struct pkgdb *db, int mode)
+{
+	int	 frames, done, ret;
+
+	assert(db != NULL);
+
+	if (!db->wal || sqlite3_db_readonly(db->sqlite, "main"))
+		return (EPKG_OK);
+
+	ret = sqlite3_wal_checkpoint_v2(db->sqlite, "main", mode, &frames,
+	    &done);
+	if (ret == SQLITE_BUSY) {
+		pkg_debug(1, "local WAL in use by a reader, not restarted");
+		return (EPKG_END);
+	}
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+	pkg_debug(1, "checkpointed %d of %d frames of the local WAL",
+	    done, frames);
+
+	return (EPKG_OK);
+}
+
+int
+pkgdb_checkpoint(struct pkgdb *db)
+{
+	return (pkgdb_wal_checkpoint(db, SQLITE_CHECKPOINT_PASSIVE));
+}
+
 int
 pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 {
@@ -1147,6 +1355,11 @@ pkgdb_open_all(struct pkgdb **db_p, pkgdb_t type, const char *reponame)
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
+
+		if (pkgdb_tune(db) != EPKG_OK) {
+			pkgdb_close(db);
+			return (EPKG_FATAL);
+		}
 	}
 
 	if (type == PKGDB_REMOTE || type == PKGDB_MAYBE_REMOTE) {
@@ -1176,14 +1389,27 @@ pkgdb_close(struct pkgdb *db)
 	if (db->prstmt_initialized)
 		prstmt_finalize(db);
 
+	pkgdb_stmt_cache_free(db);
+	pkgdb_integrity_free(db);
+
 	if (db->sqlite != NULL) {
 		assert(db->lock_count == 0);
 		if (db->type == PKGDB_REMOTE) {
 			pkgdb_detach_remotes(db->sqlite);
 		}
 
-		if (!sqlite3_db_readonly(db->sqlite, "main"))
+		if (!sqlite3_db_readonly(db->sqlite, "main")) {
+			/*
+			 * A passive checkpoint never lets the log start over
+			 * from its beginning: when no reader is attached,
+			 * restart it so that it does not grow without bound,
+			 * and cut it back to PKGDB_WAL_SIZE_LIMIT.  Do not
+			 * wait for readers to go away.
+			 */
+			sqlite3_busy_timeout(db->sqlite, 0);
+			pkgdb_wal_checkpoint(db, SQLITE_CHECKPOINT_RESTART);
 			pkg_plugins_hook_run(PKG_PLUGIN_HOOK_PKGDB_CLOSE_RW, NULL, db);
+		}
 
 		sqlite3_close(db->sqlite);
 	}
@@ -1320,6 +1546,27 @@ pkgdb_transaction_rollback(sqlite3 *sqlite, const char *savepoint)
 }
 
 
+static struct pkgdb_it *
+pkgdb_it_alloc(struct pkgdb *db, int type, short flags)
+{
+	struct pkgdb_it	*it;
+	int		 i;
+
+	if ((it = calloc(1, sizeof(struct pkgdb_it))) == NULL) {
+		pkg_emit_errno("malloc", "pkgdb_it");
+		return (NULL);
+	}
+
+	it->db = db;
+	it->sqlite = db->sqlite;
+	it->type = type;
+	it->flags = flags;
+	for (i = 0; i < PKGDB_IT_SORT_MAX; i++)
+		it->sort[i] = -1;
+
+	return (it);
+}
+
 struct pkgdb_it *
 pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short flags)
 {
@@ -1329,21 +1576,198 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short flags)
 	assert(!(flags & (PKGDB_IT_FLAG_CYCLED & PKGDB_IT_FLAG_ONCE)));
 	assert(!(flags & (PKGDB_IT_FLAG_AUTO & (PKGDB_IT_FLAG_CYCLED | PKGDB_IT_FLAG_ONCE))));
 
-	if ((it = malloc(sizeof(struct pkgdb_it))) == NULL) {
-		pkg_emit_errno("malloc", "pkgdb_it");
-		sqlite3_finalize(s);
+	if ((it = pkgdb_it_alloc(db, type, flags)) == NULL) {
+		pkgdb_stmt_release(db, s);
 		return (NULL);
 	}
 
-	it->db = db;
-	it->sqlite = db->sqlite;
 	it->stmt = s;
-	it->type = type;
-	it->flags = flags;
-	it->finished = 0;
 	return (it);
 }
 
+struct pkgdb_it *
+pkgdb_it_new_repos(struct pkgdb *db, const char *reponame,
+    const char *repo_sql, const char *tail, const char * const *sort,
+    int type, short flags)
+{
+	struct pkgdb_it		*it;
+	struct pkgdb_it_repo	*repos;
+	sqlite3_stmt		*list = NULL;
+	sqlite3_stmt		*stmt;
+	struct sbuf		*sql;
+	const char		*dbname;
+	int			 i, col;
+
+	assert(db != NULL && repo_sql != NULL);
+
+	if ((it = pkgdb_it_alloc(db, type, flags)) == NULL)
+		return (NULL);
+
+	if (reponame == NULL && sqlite3_prepare_v2(db->sqlite,
+	    "PRAGMA database_list;", -1, &list, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		pkgdb_it_free(it);
+		return (NULL);
+	}
+
+	sql = sbuf_new_auto();
+	for (;;) {
+		if (list != NULL) {
+			if (sqlite3_step(list) != SQLITE_ROW)
+				break;
+			dbname = sqlite3_column_text(list, 1);
+			if (strcmp(dbname, "main") == 0 ||
+			    strcmp(dbname, "temp") == 0)
+				continue;
+		} else if (it->nrepos == 0)
+			dbname = reponame;
+		else
+			break;
+
+		repos = realloc(it->repos,
+		    (it->nrepos + 1) * sizeof(struct pkgdb_it_repo));
+		if (repos == NULL) {
+			pkg_emit_errno("realloc", "pkgdb_it");
+			goto error;
+		}
+		it->repos = repos;
+
+		sbuf_clear(sql);
+		sbuf_printf(sql, repo_sql, dbname);
+		if (tail != NULL)
+			sbuf_cat(sql, tail);
+		sbuf_finish(sql);
+
+		pkg_debug(4, "Pkgdb: running '%s'", sbuf_data(sql));
+		if ((stmt = pkgdb_stmt_get(db, sbuf_data(sql))) == NULL)
+			goto error;
+		it->repos[it->nrepos].stmt = stmt;
+		it->repos[it->nrepos].state = SQLITE_OK;
+		it->nrepos++;
+	}
+
+	if (list != NULL)
+		sqlite3_finalize(list);
+	sbuf_delete(sql);
+
+	if (it->nrepos == 0) {
+		pkgdb_it_free(it);
+		return (NULL);
+	}
+
+	it->stmt = it->repos[0].stmt;
+	for (i = 0; sort != NULL && sort[i] != NULL &&
+	    i < PKGDB_IT_SORT_MAX; i++) {
+		for (col = 0; col < sqlite3_column_count(it->stmt); col++) {
+			if (strcmp(sqlite3_column_name(it->stmt, col),
+			    sort[i]) == 0) {
+				it->sort[i] = col;
+				break;
+			}
+		}
+		assert(it->sort[i] != -1);
+	}
+
+	return (it);
+
+error:
+	if (list != NULL)
+		sqlite3_finalize(list);
+	sbuf_delete(sql);
+	pkgdb_it_free(it);
+	return (NULL);
+}
+
+void
+pkgdb_it_bind_text(struct pkgdb_it *it, int idx, const char *val)
+{
+	unsigned int	 i;
+
+	if (it->repos == NULL) {
+		sqlite3_bind_text(it->stmt, idx, val, -1, SQLITE_TRANSIENT);
+		return;
+	}
+
+	for (i = 0; i < it->nrepos; i++)
+		sqlite3_bind_text(it->repos[i].stmt, idx, val, -1,
+		    SQLITE_TRANSIENT);
+}
+
+static int
+pkgdb_it_repo_cmp(struct pkgdb_it *it, sqlite3_stmt *a, sqlite3_stmt *b)
+{
+	const char	*va, *vb;
+	int		 i, cmp;
+
+	for (i = 0; i < PKGDB_IT_SORT_MAX && it->sort[i] != -1; i++) {
+		va = sqlite3_column_text(a, it->sort[i]);
+		vb = sqlite3_column_text(b, it->sort[i]);
+		/* like SQLite, sort NULL first */
+		if (va == NULL || vb == NULL)
+			cmp = (va != NULL) - (vb != NULL);
+		else
+			cmp = strcmp(va, vb);
+		if (cmp != 0)
+			return (cmp);
+	}
+
+	return (0);
+}
+
+/*
+ * Step a fanned out iterator: advance the statement which gave the previous
+ * row, and point it->stmt at the statement holding the next row in sort
+ * order.  The state of each statement is SQLITE_OK when it must be stepped,
+ * otherwise the result of its last step.
+ */
+static int
+pkgdb_it_step_repos(struct pkgdb_it *it)
+{
+	struct pkgdb_it_repo	*r, *best = NULL;
+	unsigned int		 i;
+
+	for (i = 0; i < it->nrepos; i++) {
+		r = &it->repos[i];
+		if (r->state == SQLITE_OK) {
+			r->state = sqlite3_step(r->stmt);
+			if (r->state != SQLITE_ROW && r->state != SQLITE_DONE)
+				return (r->state);
+		}
+		if (r->state != SQLITE_ROW)
+			continue;
+		if (best == NULL) {
+			best = r;
+			if (it->sort[0] == -1)
+				break;
+		} else if (pkgdb_it_repo_cmp(it, r->stmt, best->stmt) < 0)
+			best = r;
+	}
+
+	if (best == NULL)
+		return (SQLITE_DONE);
+
+	best->state = SQLITE_OK;
+	it->stmt = best->stmt;
+
+	return (SQLITE_ROW);
+}
+
+static void
+pkgdb_it_rewind(struct pkgdb_it *it)
+{
+	unsigned int	 i;
+
+	if (it->repos == NULL) {
+		sqlite3_reset(it->stmt);
+		return;
+	}
+
+	for (i = 0; i < it->nrepos; i++) {
+		sqlite3_reset(it->repos[i].stmt);
+		it->repos[i].state = SQLITE_OK;
+	}
+}
+
 static struct load_on_flag {
 	int	flag;
 	int	(*load)(struct pkgdb *db, struct pkg *p);
@@ -1379,7 +1803,8 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, unsigned flags)
 	if (it->finished && (it->flags & PKGDB_IT_FLAG_ONCE))
 		return (EPKG_END);
 
-	switch (sqlite3_step(it->stmt)) {
+	switch (it->repos != NULL ? pkgdb_it_step_repos(it) :
+	    sqlite3_step(it->stmt)) {
 	case SQLITE_ROW:
 		if (*pkg_p == NULL) {
 			ret = pkg_new(pkg_p, it->type);
@@ -1409,7 +1834,7 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, unsigned flags)
 	case SQLITE_DONE:
 		it->finished ++;
 		if (it->flags & PKGDB_IT_FLAG_CYCLED) {
-			sqlite3_reset(it->stmt);
+			pkgdb_it_rewind(it);
 			return (EPKG_OK);
 		}
 		else {
@@ -1431,16 +1856,23 @@ pkgdb_it_reset(struct pkgdb_it *it)
 		return;
 
 	it->finished = 0;
-	sqlite3_reset(it->stmt);
+	pkgdb_it_rewind(it);
 }
 
 void
 pkgdb_it_free(struct pkgdb_it *it)
 {
+	unsigned int	 i;
+
 	if (it == NULL)
 		return;
 
-	sqlite3_finalize(it->stmt);
+	if (it->repos != NULL) {
+		for (i = 0; i < it->nrepos; i++)
+			pkgdb_stmt_release(it->db, it->repos[i].stmt);
+		free(it->repos);
+	} else
+		pkgdb_stmt_release(it->db, it->stmt);
 	free(it);
 }
 
@@ -1548,7 +1980,7 @@ pkgdb_get_match_how(match_t match)
 struct pkgdb_it *
 pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 {
-	char		 sql[BUFSIZ];
+	struct sbuf	*sql;
 	sqlite3_stmt	*stmt;
 	const char	*comp = NULL;
 
@@ -1557,19 +1989,24 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 
 	comp = pkgdb_get_pattern_query(pattern, match);
 
-	sqlite3_snprintf(sizeof(sql), sql,
-			"SELECT id, origin, name, version, comment, desc, "
-				"message, arch, maintainer, www, "
-				"prefix, flatsize, licenselogic, automatic, "
-				"locked, time "
-			"FROM packages AS p%s "
-			"ORDER BY p.name;", comp);
+	/* a MATCH_CONDITION can be arbitrarily long, do not bound it */
+	sql = sbuf_new_auto();
+	sbuf_cat(sql,
+	    "SELECT id, origin, name, version, comment, desc, "
+		"message, arch, maintainer, www, "
+		"prefix, flatsize, licenselogic, automatic, "
+		"locked, time "
+	    "FROM packages AS p");
+	if (comp != NULL)
+		sbuf_cat(sql, comp);
+	sbuf_cat(sql, " ORDER BY p.name;");
+	sbuf_finish(sql);
 
-	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	pkg_debug(4, "Pkgdb: running '%s'", sbuf_data(sql));
+	stmt = pkgdb_stmt_get(db, sbuf_data(sql));
+	sbuf_delete(sql);
+	if (stmt == NULL)
 		return (NULL);
-	}
 
 	if (match != MATCH_ALL && match != MATCH_CONDITION)
 		sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
@@ -1577,29 +2014,90 @@ pkgdb_query(struct pkgdb *db, const char *pattern, match_t match)
 	return (pkgdb_it_new(db, stmt, PKG_INSTALLED, PKGDB_IT_FLAG_ONCE));
 }
 
+/*
+ * Narrow a GLOB over file paths to index ranges: the literal prefix of the
+ * pattern bounds the paths, and a literal last component gives the basename.
+ * prefix and upper get empty when the pattern starts with a wildcard, name
+ * when its last component is not a literal.
+ */
+static void
+pkgdb_which_glob_bounds(const char *glob, char *prefix, char *upper,
+    char *name, size_t len)
+{
+	size_t		 plen;
+	const char	*base;
+
+	plen = strcspn(glob, "*?[");
+	if (plen >= len)
+		plen = len - 1;
+	memcpy(prefix, glob, plen);
+	prefix[plen] = '\0';
+
+	/* the smallest string above every path starting with prefix */
+	strlcpy(upper, prefix, len);
+	if (plen > 0 && (unsigned char)upper[plen - 1] < UCHAR_MAX)
+		upper[plen - 1]++;
+	else
+		prefix[0] = upper[0] = '\0';
+
+	/* a wildcard or a class may match a slash: only trust a literal tail */
+	name[0] = '\0';
+	base = strrchr(glob, '/');
+	if (base != NULL && strchr(glob, '[') == NULL &&
+	    strpbrk(base + 1, "*?") == NULL)
+		strlcpy(name, base + 1, len);
+}
+
 struct pkgdb_it *
 pkgdb_query_which(struct pkgdb *db, const char *path, bool glob)
 {
 	sqlite3_stmt	*stmt;
-	char	sql[BUFSIZ];
-
+	char		 prefix[MAXPATHLEN], upper[MAXPATHLEN];
+	char		 name[MAXPATHLEN];
+	struct sbuf	*sql;
 
 	assert(db != NULL);
-	sqlite3_snprintf(sizeof(sql), sql,
-			"SELECT p.id, p.origin, p.name, p.version, p.comment, p.desc, "
-			"p.message, p.arch, p.maintainer, p.www, "
-			"p.prefix, p.flatsize, p.time "
-			"FROM packages AS p "
-			"LEFT JOIN files AS f ON p.id = f.package_id "
-			"WHERE f.path %s ?1 GROUP BY p.id;", glob ? "GLOB" : "=");
 
-	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (NULL);
+	sql = sbuf_new_auto();
+	sbuf_cat(sql,
+	    "SELECT p.id, p.origin, p.name, p.version, p.comment, p.desc, "
+	    "p.message, p.arch, p.maintainer, p.www, "
+	    "p.prefix, p.flatsize, p.time "
+	    "FROM files AS f "
+	    "JOIN packages AS p ON p.id = f.package_id ");
+
+	/*
+	 * Drive the lookup from the files index: the path primary key for
+	 * an exact path or a literal prefix, files_name for a literal
+	 * basename.
+	 */
+	if (!glob)
+		sbuf_cat(sql, "WHERE f.path = ?1;");
+	else {
+		pkgdb_which_glob_bounds(path, prefix, upper, name,
+		    sizeof(name));
+		sbuf_cat(sql, "WHERE f.path GLOB ?1 ");
+		if (prefix[0] != '\0')
+			sbuf_cat(sql, "AND f.path >= ?2 AND f.path < ?3 ");
+		if (name[0] != '\0')
+			sbuf_cat(sql, "AND f.name = ?4 ");
+		sbuf_cat(sql, "GROUP BY p.id;");
 	}
+	sbuf_finish(sql);
+
+	pkg_debug(4, "Pkgdb: running '%s'", sbuf_data(sql));
+	stmt = pkgdb_stmt_get(db, sbuf_data(sql));
+	sbuf_delete(sql);
+	if (stmt == NULL)
+		return (NULL);
 
 	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_TRANSIENT);
+	if (glob && prefix[0] != '\0') {
+		sqlite3_bind_text(stmt, 2, prefix, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_TRANSIENT);
+	}
+	if (glob && name[0] != '\0')
+		sqlite3_bind_text(stmt, 4, name, -1, SQLITE_TRANSIENT);
 
 	return (pkgdb_it_new(db, stmt, PKG_INSTALLED, PKGDB_IT_FLAG_ONCE));
 }
@@ -1620,10 +2118,8 @@ pkgdb_query_shlib_required(struct pkgdb *db, const char *shlib)
 	assert(db != NULL);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (NULL);
-	}
 
 	sqlite3_bind_text(stmt, 1, shlib, -1, SQLITE_TRANSIENT);
 
@@ -1646,10 +2142,8 @@ pkgdb_query_shlib_provided(struct pkgdb *db, const char *shlib)
 	assert(db != NULL);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (NULL);
-	}
 
 	sqlite3_bind_text(stmt, 1, shlib, -1, SQLITE_TRANSIENT);
 
@@ -1668,10 +2162,8 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 	assert(db != NULL);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_TRANSIENT);
 
@@ -1680,7 +2172,7 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 	if (ret == SQLITE_ROW)
 		*res = sqlite3_column_int64(stmt, 0);
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_ROW) {
 		ERROR_SQLITE(db->sqlite);
@@ -1719,16 +2211,14 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 		pkg_get(pkg, PKG_REPONAME, &reponame);
 		sqlite3_snprintf(sizeof(sql), sql, reposql, reponame);
 		pkg_debug(4, "Pkgdb: running '%s'", sql);
-		ret = sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, sql);
 	} else {
 		pkg_debug(4, "Pkgdb: running '%s'", mainsql);
-		ret = sqlite3_prepare_v2(db->sqlite, mainsql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, mainsql);
 	}
 
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if (stmt == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -1739,7 +2229,7 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 			   sqlite3_column_text(stmt, 2),
 			   sqlite3_column_int(stmt, 3));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DEPS);
@@ -1780,16 +2270,14 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 		pkg_get(pkg, PKG_REPONAME, &reponame);
 		sqlite3_snprintf(sizeof(sql), sql, reposql, reponame, reponame);
 		pkg_debug(4, "Pkgdb: running '%s'", sql);
-		ret = sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, sql);
 	} else {
 		pkg_debug(4, "Pkgdb: running '%s'", mainsql);
-		ret = sqlite3_prepare_v2(db->sqlite, mainsql, -1, &stmt, NULL);
+		stmt = pkgdb_stmt_get(db, mainsql);
 	}
 
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if (stmt == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ORIGIN, &origin);
 	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
@@ -1800,7 +2288,7 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 			    sqlite3_column_text(stmt, 2),
 			    sqlite3_column_int(stmt, 3));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_RDEPS);
@@ -1831,10 +2319,8 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -1843,7 +2329,7 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 		pkg_addfile(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_text(stmt, 1), false);
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_FILES);
@@ -1875,10 +2361,8 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -1888,7 +2372,7 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		    sqlite3_column_int(stmt, 1), false);
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DIRS);
 		ERROR_SQLITE(db->sqlite);
@@ -1921,7 +2405,7 @@ pkgdb_load_license(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_LICENSES,
+	return (load_val(db, pkg, sql, PKG_LOAD_LICENSES,
 	    pkg_addlicense, PKG_LICENSES));
 }
 
@@ -1946,7 +2430,7 @@ pkgdb_load_category(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CATEGORIES,
+	return (load_val(db, pkg, sql, PKG_LOAD_CATEGORIES,
 	    pkg_addcategory, PKG_CATEGORIES));
 }
 
@@ -1966,7 +2450,7 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_USERS,
+	ret = load_val(db, pkg, sql, PKG_LOAD_USERS,
 	    pkg_adduser, PKG_USERS);
 
 	/* TODO get user uidstr from local database */
@@ -1996,7 +2480,7 @@ pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_GROUPS,
+	ret = load_val(db, pkg, sql, PKG_LOAD_GROUPS,
 	    pkg_addgroup, PKG_GROUPS);
 
 	while (pkg_groups(pkg, &g) == EPKG_OK) {
@@ -2030,7 +2514,7 @@ pkgdb_load_shlib_required(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_SHLIBS_REQUIRED,
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS_REQUIRED,
 	    pkg_addshlib_required, PKG_SHLIBS_REQUIRED));
 }
 
@@ -2056,7 +2540,7 @@ pkgdb_load_shlib_provided(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_SHLIBS_PROVIDED,
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS_PROVIDED,
 	    pkg_addshlib_provided, PKG_SHLIBS_PROVIDED));
 }
 
@@ -2084,7 +2568,7 @@ pkgdb_load_annotations(struct pkgdb *db, struct pkg *pkg)
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main",
                     "main", "main");
 
-	return (load_tag_val(db->sqlite, pkg, sql, PKG_LOAD_ANNOTATIONS,
+	return (load_tag_val(db, pkg, sql, PKG_LOAD_ANNOTATIONS,
 		   pkg_addannotation, PKG_ANNOTATIONS));
 }
 
@@ -2106,10 +2590,8 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 		return (EPKG_OK);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ROWID, &rowid);
 	sqlite3_bind_int64(stmt, 1, rowid);
@@ -2118,7 +2600,7 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 		pkg_addscript(pkg, sqlite3_column_text(stmt, 0),
 		    sqlite3_column_int(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
@@ -2208,7 +2690,7 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		}
 
 		pkg_debug(4, "Pkgdb> adding option");
-		ret = load_tag_val(db->sqlite, pkg, sql, PKG_LOAD_OPTIONS,
+		ret = load_tag_val(db, pkg, sql, PKG_LOAD_OPTIONS,
 				   pkg_addtagval, PKG_OPTIONS);
 		if (ret != EPKG_OK)
 			break;
@@ -2228,7 +2710,7 @@ pkgdb_load_mtree(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
+	return (load_val(db, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
 }
 
 int
@@ -2252,7 +2734,7 @@ pkgdb_load_conflicts(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CONFLICTS,
+	return (load_val(db, pkg, sql, PKG_LOAD_CONFLICTS,
 			pkg_addconflict, PKG_CONFLICTS));
 }
 
@@ -2275,7 +2757,7 @@ pkgdb_load_provides(struct pkgdb *db, struct pkg *pkg)
 	} else
 		sqlite3_snprintf(sizeof(sql), sql, basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_PROVIDES,
+	return (load_val(db, pkg, sql, PKG_LOAD_PROVIDES,
 			pkg_addconflict, PKG_PROVIDES));
 }
 
@@ -2343,14 +2825,14 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 	},
 	[FILES] = {
 		NULL,
-		"INSERT INTO files (path, sha256, package_id) "
-		"VALUES (?1, ?2, ?3)",
+		"INSERT INTO files (path, sha256, package_id, name) "
+		"VALUES (?1, ?2, ?3, " PKGDB_SQL_BASENAME("?1") ")",
 		"TTI",
 	},
 	[FILES_REPLACE] = {
 		NULL,
-		"INSERT OR REPLACE INTO files (path, sha256, package_id) "
-		"VALUES (?1, ?2, ?3)",
+		"INSERT OR REPLACE INTO files (path, sha256, package_id, name) "
+		"VALUES (?1, ?2, ?3, " PKGDB_SQL_BASENAME("?1") ")",
 		"TTI",
 	},
 	[DIRS1] = {
@@ -3050,17 +3532,13 @@ pkgdb_reanalyse_shlibs(struct pkgdb *db, struct pkg *pkg)
 		for (i = 0; i < 2; i++) {
 			/* Clean out old shlibs first */
 			pkg_debug(4, "Pkgdb: running '%s'", sql[i]);
-			if (sqlite3_prepare_v2(db->sqlite, sql[i], -1,
-					       &stmt_del, NULL)
-			    != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite);
+			if ((stmt_del = pkgdb_stmt_get(db, sql[i])) == NULL)
 				return (EPKG_FATAL);
-			}
 
 			sqlite3_bind_int64(stmt_del, 1, package_id);
 
 			ret = sqlite3_step(stmt_del);
-			sqlite3_finalize(stmt_del);
+			pkgdb_stmt_release(db, stmt_del);
 
 			if (ret != SQLITE_DONE) {
 				ERROR_SQLITE(db->sqlite);
@@ -3264,16 +3742,13 @@ pkgdb_unregister_pkg(struct pkgdb *db, const char *origin)
 	assert(origin != NULL);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt_del, NULL)
-	    != SQLITE_OK){
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt_del = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt_del, 1, origin, -1, SQLITE_STATIC);
 
 	ret = sqlite3_step(stmt_del);
-	sqlite3_finalize(stmt_del);
+	pkgdb_stmt_release(db, stmt_del);
 
 	if (ret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
@@ -3592,20 +4067,130 @@ pkgdb_search_build_search_query(struct sbuf *sql, match_t match,
 	return (EPKG_OK);
 }
 
+/* The columns a search sorted on sort is ordered by, for merging repos */
+static const char * const *
+pkgdb_search_sort_columns(pkgdb_field sort)
+{
+	static const char * const origin[] = { "origin", NULL };
+	static const char * const name[] = { "name", NULL };
+	static const char * const namever[] = { "name", "version", NULL };
+	static const char * const comment[] = { "comment", NULL };
+	static const char * const desc[] = { "desc", NULL };
+
+	switch (sort) {
+	case FIELD_ORIGIN:
+		return (origin);
+	case FIELD_NAME:
+		return (name);
+	case FIELD_NAMEVER:
+		return (namever);
+	case FIELD_COMMENT:
+		return (comment);
+	case FIELD_DESC:
+		return (desc);
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Find the longest run of word characters which any value matched by
+ * pattern must contain, and turn it into a GLOB over search_tokens.
+ * The run is anchored on the sides where the pattern guarantees a word
+ * boundary.  Returns NULL when the search index cannot narrow the
+ * search.
+ */
+static char *
+pkgdb_search_token_glob(const char *pattern, match_t match)
+{
+	const char	*p, *start, *best = NULL;
+	bool		 bounded, best_left = false, best_right = false;
+	bool		 right;
+	size_t		 len, best_len = 0;
+	char		*glob, *g;
+
+	if (match != MATCH_EXACT && match != MATCH_GLOB)
+		return (NULL);
+
+	p = pattern;
+	bounded = true;
+	while (*p != '\0') {
+		if (match == MATCH_GLOB && (*p == '*' || *p == '?')) {
+			bounded = false;
+			p++;
+			continue;
+		}
+		if (match == MATCH_GLOB && *p == '[') {
+			/* skip the bracket expression, ']' first is literal */
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p != '\0' && *p != ']')
+				p++;
+			if (*p == ']')
+				p++;
+			bounded = false;
+			continue;
+		}
+		if (!pkgdb_search_token_char((unsigned char)*p)) {
+			bounded = true;
+			p++;
+			continue;
+		}
+
+		start = p;
+		while (pkgdb_search_token_char((unsigned char)*p))
+			p++;
+		len = p - start;
+		right = (*p == '\0' || match == MATCH_EXACT ||
+		    (*p != '*' && *p != '?' && *p != '['));
+		if (len > best_len) {
+			best = start;
+			best_len = len;
+			best_left = bounded;
+			best_right = right;
+		}
+		bounded = false;
+	}
+
+	if (best_len < PKGDB_SEARCH_TOKEN_MIN)
+		return (NULL);
+
+	if ((glob = malloc(best_len + 3)) == NULL)
+		return (NULL);
+
+	g = glob;
+	if (!best_left)
+		*g++ = '*';
+	for (p = best; p < best + best_len; p++)
+		*g++ = (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+	if (!best_right)
+		*g++ = '*';
+	*g = '\0';
+
+	return (glob);
+}
+
 struct pkgdb_it *
 pkgdb_search(struct pkgdb *db, const char *pattern, match_t match,
     pkgdb_field field, pkgdb_field sort, const char *reponame)
 {
-	sqlite3_stmt	*stmt = NULL;
+	struct pkgdb_it	*it = NULL;
 	struct sbuf	*sql = NULL;
-	int		 ret;
-	const char	*rname;
+	struct sbuf	*tail = NULL;
+	struct sbuf	*reposql = NULL;
+	int		 fields = 0;
+	char		*tokenglob = NULL;
+	const char	*rname = NULL;
+	const char	*multireposql;
 	const char	*basesql = ""
 		"SELECT id, origin, name, version, comment, "
 		"prefix, desc, arch, maintainer, www, "
 		"licenselogic, flatsize, pkgsize, "
 		"cksum, path AS repopath ";
-	const char	*multireposql = ""
+	const char	*repopkgsql = ""
 		"SELECT id, origin, name, version, comment, "
 		"prefix, desc, arch, maintainer, www, "
 		"licenselogic, flatsize, pkgsize, "
@@ -3616,55 +4201,206 @@ pkgdb_search(struct pkgdb *db, const char *pattern, match_t match,
 	assert(pattern != NULL && pattern[0] != '\0');
 	assert(db->type == PKGDB_REMOTE);
 
-	sql = sbuf_new_auto();
-	sbuf_cat(sql, basesql);
+	switch (field) {
+	case FIELD_NAMEVER:
+		fields = PKGDB_SEARCH_NAMEVER;
+		break;
+	case FIELD_COMMENT:
+		fields = PKGDB_SEARCH_COMMENT;
+		break;
+	case FIELD_DESC:
+		fields = PKGDB_SEARCH_DESC;
+		break;
+	default:
+		break;
+	}
 
-	/* add the dbname column to the SELECT */
-	sbuf_cat(sql, ", dbname FROM (");
+	/*
+	 * Only look at the packages the search index says contain the
+	 * longest word of the pattern; the WHERE clause below still
+	 * decides the match.
+	 */
+	multireposql = repopkgsql;
+	if (fields != 0)
+		tokenglob = pkgdb_search_token_glob(pattern, match);
+	if (tokenglob != NULL) {
+		reposql = sbuf_new_auto();
+		sbuf_cat(reposql, repopkgsql);
+		sbuf_printf(reposql, "WHERE id IN ("
+		    "SELECT p.package_id FROM '%%1$s'.search_tokens AS t "
+		    "CROSS JOIN '%%1$s'.search_postings AS p "
+		    "ON p.token_id = t.id "
+		    "WHERE t.token GLOB ?2 AND p.fields & %d) ", fields);
+		sbuf_finish(reposql);
+		multireposql = sbuf_get(reposql);
+	}
 
 	if (reponame != NULL) {
-		if ((rname = pkgdb_get_reponame(db, reponame)) != NULL)
-			sbuf_printf(sql, multireposql, rname, rname);
-		else {
+		if ((rname = pkgdb_get_reponame(db, reponame)) == NULL) {
 			pkg_emit_error("Repository %s can't be loaded",
 					reponame);
-			sbuf_delete(sql);
-			return (NULL);
-		}
-	} else {
-		if (pkg_repos_activated_count() == 0) {
-			pkg_emit_error("No active repositories configured");
-			sbuf_delete(sql);
-			return (NULL);
-		}
-		/* test on all the attached databases */
-		if (pkgdb_sql_all_attached(db->sqlite, sql,
-		    multireposql, " UNION ALL ") != EPKG_OK) {
-			sbuf_delete(sql);
-			return (NULL);
+			goto cleanup;
 		}
+	} else if (pkg_repos_activated_count() == 0) {
+		pkg_emit_error("No active repositories configured");
+		goto cleanup;
 	}
 
-	/* close the UNIONs and build the search query */
-	sbuf_cat(sql, ") WHERE ");
+	/*
+	 * Search each repository with its own statement and let the
+	 * iterator merge the results in sort order.
+	 */
+	sql = sbuf_new_auto();
+	sbuf_cat(sql, basesql);
+	sbuf_cat(sql, ", dbname FROM (");
+	sbuf_cat(sql, multireposql);
+	sbuf_finish(sql);
+
+	tail = sbuf_new_auto();
+	sbuf_cat(tail, ") WHERE ");
+	pkgdb_search_build_search_query(tail, match, field, sort);
+	sbuf_cat(tail, ";");
+	sbuf_finish(tail);
 
-	pkgdb_search_build_search_query(sql, match, field, sort);
-	sbuf_cat(sql, ";");
+	it = pkgdb_it_new_repos(db, rname, sbuf_data(sql), sbuf_data(tail),
+	    pkgdb_search_sort_columns(sort), PKG_REMOTE, PKGDB_IT_FLAG_ONCE);
+	if (it != NULL) {
+		pkgdb_it_bind_text(it, 1, pattern);
+		if (tokenglob != NULL)
+			pkgdb_it_bind_text(it, 2, tokenglob);
+	}
+
+cleanup:
+	if (sql != NULL)
+		sbuf_delete(sql);
+	if (tail != NULL)
+		sbuf_delete(tail);
+	if (reposql != NULL)
+		sbuf_delete(reposql);
+	free(tokenglob);
+
+	return (it);
+}
+
+int
+pkgdb_repos_cksums(struct pkgdb *db, char **sums, size_t *count)
+{
+	sqlite3_stmt	*stmt = NULL;
+	struct sbuf	*sql = NULL;
+	const char	*sum;
+	char		*buf = NULL;
+	size_t		 cap = 0, n = 0;
+	int		 ret;
+	const char	*multireposql = ""
+		"SELECT cksum FROM '%1$s'.packages";
+
+	assert(db != NULL);
+	assert(db->type == PKGDB_REMOTE);
+
+	*sums = NULL;
+	*count = 0;
+
+	if (pkg_repos_activated_count() == 0) {
+		pkg_emit_error("No active repositories configured");
+		return (EPKG_FATAL);
+	}
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, "SELECT DISTINCT substr(cksum, 1, %d) AS sum FROM (",
+	    PKG_FILE_CKSUM_CHARS);
+	if (pkgdb_sql_all_attached(db->sqlite, sql, multireposql,
+	    " UNION ALL ") != EPKG_OK) {
+		sbuf_delete(sql);
+		return (EPKG_FATAL);
+	}
+	sbuf_cat(sql, ") ORDER BY sum;");
 	sbuf_finish(sql);
 
 	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
 	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
+	sbuf_delete(sql);
 	if (ret != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
-		sbuf_delete(sql);
-		return (NULL);
+		return (EPKG_FATAL);
 	}
 
-	sbuf_delete(sql);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if ((sum = sqlite3_column_text(stmt, 0)) == NULL)
+			continue;
+		if (n == cap) {
+			cap = cap == 0 ? 1024 : cap * 2;
+			buf = reallocf(buf, cap * (PKG_FILE_CKSUM_CHARS + 1));
+			if (buf == NULL) {
+				pkg_emit_errno("realloc", "pkgdb_repos_cksums");
+				sqlite3_finalize(stmt);
+				return (EPKG_FATAL);
+			}
+		}
+		strlcpy(buf + n * (PKG_FILE_CKSUM_CHARS + 1), sum,
+		    PKG_FILE_CKSUM_CHARS + 1);
+		n++;
+	}
 
-	sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		sqlite3_finalize(stmt);
+		free(buf);
+		return (EPKG_FATAL);
+	}
+	sqlite3_finalize(stmt);
 
-	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+	*sums = buf;
+	*count = n;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Files of the packages about to be installed, gathered by
+ * pkgdb_integrity_append() and checked against the local files table by
+ * pkgdb_integrity_check().  Each package is recorded once in an
+ * integrity_owner and each of its paths points to it.
+ */
+struct integrity_owner {
+	char	*name;
+	char	*origin;
+	char	*version;
+	struct integrity_owner *next;
+};
+
+struct integrity_entry {
+	char	*path;
+	struct integrity_owner *owner;
+	UT_hash_handle hh;
+};
+
+/*
+ * Below this number of paths it is cheaper to look every path up in the
+ * files table than to walk the whole table.
+ */
+#define INTEGRITY_LOOKUP_MAX	2048
+
+static void
+pkgdb_integrity_free(struct pkgdb *db)
+{
+	struct integrity_entry *e, *etmp;
+	struct integrity_owner *o, *otmp;
+
+	HASH_ITER(hh, db->integrity, e, etmp) {
+		HASH_DEL(db->integrity, e);
+		free(e->path);
+		free(e);
+	}
+
+	LL_FOREACH_SAFE(db->integrity_owners, o, otmp) {
+		free(o->name);
+		free(o->origin);
+		free(o->version);
+		free(o);
+	}
+
+	db->integrity_owners = NULL;
+	db->integrity_count = 0;
 }
 
 int
@@ -3672,102 +4408,108 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p,
 		conflict_func_cb cb, void *cbdata)
 {
 	int		 ret = EPKG_OK;
-	sqlite3_stmt	*stmt = NULL;
-	sqlite3_stmt	*stmt_conflicts = NULL;
 	struct pkg_file	*file = NULL;
-	const char *porigin;
-
-	const char	 sql[] = ""
-		"INSERT INTO integritycheck (name, origin, version, path)"
-		"values (?1, ?2, ?3, ?4);";
-	const char	 sql_conflicts[] = ""
-		"SELECT name, origin, version from integritycheck where path=?1;";
+	struct integrity_owner *owner;
+	struct integrity_entry *e;
+	struct pkg_event_conflict conflict;
+	const char	*name, *origin, *version;
 
 	assert(db != NULL && p != NULL);
 
-	sql_exec(db->sqlite, "CREATE TEMP TABLE IF NOT EXISTS integritycheck ("
-			"name TEXT, "
-			"origin TEXT, "
-			"version TEXT, "
-			"path TEXT UNIQUE);"
-		);
+	pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin,
+	    PKG_VERSION, &version);
 
-	pkg_debug(4, "Pkgdb: running '%s'", sql);
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL)
-	    != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	owner = calloc(1, sizeof(struct integrity_owner));
+	if (owner == NULL) {
+		pkg_emit_errno("calloc", "integrity_owner");
 		return (EPKG_FATAL);
 	}
+	if ((owner->name = strdup(name)) == NULL ||
+	    (owner->origin = strdup(origin)) == NULL ||
+	    (owner->version = strdup(version)) == NULL) {
+		pkg_emit_errno("strdup", "integrity_owner");
+		free(owner->name);
+		free(owner->origin);
+		free(owner);
+		return (EPKG_FATAL);
+	}
+	LL_PREPEND(db->integrity_owners, owner);
 
-	pkg_get(p, PKG_ORIGIN, &porigin);
-
-	pkg_debug(4, "Pkgdb: test conflicts for %s", porigin);
+	pkg_debug(4, "Pkgdb: test conflicts for %s", origin);
 	while (pkg_files(p, &file) == EPKG_OK) {
-		const char	*name, *origin, *version;
 		const char	*pkg_path = pkg_file_path(file);
-		struct pkg_event_conflict *conflicts_list = NULL, *cur;
 
-		pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin,
-		    PKG_VERSION, &version);
-		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, origin, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 3, version, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 4, pkg_path, -1, SQLITE_STATIC);
+		HASH_FIND_STR(db->integrity, pkg_path, e);
+		if (e != NULL) {
+			memset(&conflict, 0, sizeof(conflict));
+			conflict.name = e->owner->name;
+			conflict.origin = e->owner->origin;
+			conflict.version = e->owner->version;
+			pkg_debug(3, "found conflict between %s and %s on path %s",
+			    origin, conflict.origin, pkg_path);
 
-		if (sqlite3_step(stmt) != SQLITE_DONE) {
-
-			pkg_debug(4, "Pkgdb: running '%s'", sql_conflicts);
-			if (sqlite3_prepare_v2(db->sqlite, sql_conflicts,
-			    -1, &stmt_conflicts, NULL) != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite);
-				sqlite3_finalize(stmt);
-				return (EPKG_FATAL);
-			}
+			if (cb != NULL)
+				cb(origin, conflict.origin, cbdata);
 
-			sqlite3_bind_text(stmt_conflicts, 1, pkg_path,
-			    -1, SQLITE_STATIC);
-			cur = conflicts_list;
-			while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-
-				cur = calloc(1, sizeof (struct pkg_event_conflict));
-				cur->name = strdup(sqlite3_column_text(stmt_conflicts, 0));
-				cur->origin = strdup(sqlite3_column_text(stmt_conflicts, 1));
-				cur->version = strdup(sqlite3_column_text(stmt_conflicts, 2));
-				pkg_debug(3, "found conflict between %s and %s on path %s",
-						porigin, cur->origin, pkg_path);
-				LL_PREPEND(conflicts_list, cur);
-
-				if (cb != NULL)
-					cb (porigin, cur->origin, cbdata);
-			}
-			sqlite3_finalize(stmt_conflicts);
-			pkg_emit_integritycheck_conflict(name, version, origin, pkg_path, conflicts_list);
-			cur = conflicts_list;
-			while (cur) {
-				free(cur->name);
-				free(cur->origin);
-				free(cur->version);
-				cur = cur->next;
-				free(conflicts_list);
-				conflicts_list = cur;
-			}
+			pkg_emit_integritycheck_conflict(name, version, origin,
+			    pkg_path, &conflict);
 			ret = EPKG_CONFLICT;
+			continue;
+		}
+
+		e = malloc(sizeof(struct integrity_entry));
+		if (e == NULL) {
+			pkg_emit_errno("malloc", "integrity_entry");
+			return (EPKG_FATAL);
 		}
-		sqlite3_reset(stmt);
+		/* the path is the hash key, uthash cannot hash NULL */
+		if ((e->path = strdup(pkg_path)) == NULL) {
+			pkg_emit_errno("strdup", pkg_path);
+			free(e);
+			return (EPKG_FATAL);
+		}
+		e->owner = owner;
+		HASH_ADD_KEYPTR(hh, db->integrity, e->path, strlen(e->path), e);
+		db->integrity_count++;
 	}
-	sqlite3_finalize(stmt);
 
 	return (ret);
 }
 
+static int
+integrity_entry_cmp(const void *a, const void *b)
+{
+	const struct integrity_entry *ea = *(const struct integrity_entry **)a;
+	const struct integrity_entry *eb = *(const struct integrity_entry **)b;
+
+	return (strcmp(ea->path, eb->path));
+}
+
+static int
+pkgdb_integrity_local_conflict(struct integrity_entry *e, const char *lname,
+    const char *lversion, const char *lorigin, conflict_func_cb cb,
+    void *cbdata)
+{
+	if (strcmp(lorigin, e->owner->origin) == 0)
+		return (EPKG_OK);
+
+	pkg_debug(3, "locally installed %s-%s conflicts on %s with %s-%s",
+	    lname, lversion, e->path, e->owner->name, e->owner->version);
+	if (cb != NULL)
+		cb(lorigin, e->owner->origin, cbdata);
+
+	return (EPKG_CONFLICT);
+}
+
 int
 pkgdb_integrity_check(struct pkgdb *db, conflict_func_cb cb, void *cbdata)
 {
-	int		 ret, retcode = EPKG_OK;
+	int		 retcode = EPKG_OK;
 	sqlite3_stmt	*stmt;
-	sqlite3_stmt	*stmt_conflicts;
-	struct sbuf	*conflictmsg = NULL;
-	struct sbuf *origin;
+	struct integrity_entry **sorted = NULL, *e;
+	unsigned int	 i, n;
+	int		 cmp;
+	const char	*path;
 
 	assert (db != NULL);
 
@@ -3775,120 +4517,83 @@ pkgdb_integrity_check(struct pkgdb *db, conflict_func_cb cb, void *cbdata)
 		"SELECT p.name, p.version, p.origin FROM packages AS p, files AS f "
 		"WHERE p.id = f.package_id AND f.path = ?1;";
 
-	const char	 sql_conflicts[] = ""
-		"SELECT name, version, origin FROM integritycheck WHERE path = ?1;";
-
-	const char sql_integrity_prepare[] = ""
-		"SELECT f.path FROM files as f, integritycheck as i "
-		"LEFT JOIN packages as p ON "
-		"p.id = f.package_id "
-		"WHERE f.path = i.path AND "
-		"p.origin != i.origin GROUP BY f.path";
+	const char	 sql_local_files[] = ""
+		"SELECT f.path, p.name, p.version, p.origin "
+		"FROM files AS f, packages AS p "
+		"WHERE p.id = f.package_id ORDER BY f.path;";
 
-	pkg_debug(4, "Pkgdb: running '%s'", sql_integrity_prepare);
-	if (sqlite3_prepare_v2(db->sqlite,
-		sql_integrity_prepare,
-		-1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (EPKG_FATAL);
-	}
-
-	conflictmsg = sbuf_new_auto();
-	origin = sbuf_new_auto();
-
-	while (sqlite3_step(stmt) != SQLITE_DONE) {
-		sbuf_clear(conflictmsg);
-		sbuf_clear(origin);
+	if (db->integrity_count == 0)
+		return (EPKG_OK);
 
+	if (db->integrity_count <= INTEGRITY_LOOKUP_MAX) {
+		/* Few paths: probe each of them through the files index */
 		pkg_debug(4, "Pkgdb: running '%s'", sql_local_conflict);
-		ret = sqlite3_prepare_v2(db->sqlite, sql_local_conflict, -1,
-		    &stmt_conflicts, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
-			sbuf_delete(origin);
-			sbuf_delete(conflictmsg);
-			return (EPKG_FATAL);
-		}
-
-		sqlite3_bind_text(stmt_conflicts, 1,
-		    sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
-
-		sqlite3_step(stmt_conflicts);
-
-		sbuf_printf(conflictmsg,
-		    "WARNING: locally installed %s-%s conflicts on %s with:\n",
-		    sqlite3_column_text(stmt_conflicts, 0),
-		    sqlite3_column_text(stmt_conflicts, 1),
-		    sqlite3_column_text(stmt, 0));
-		sbuf_cpy(origin, sqlite3_column_text(stmt_conflicts, 2));
-		sqlite3_finalize(stmt_conflicts);
-
-		pkg_debug(4, "Pkgdb: running '%s'", sql_conflicts);
-		ret = sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1,
-		    &stmt_conflicts, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
-			sbuf_delete(conflictmsg);
-			sbuf_delete(origin);
+		if ((stmt = pkgdb_stmt_get(db, sql_local_conflict)) == NULL) {
+			pkgdb_integrity_free(db);
 			return (EPKG_FATAL);
 		}
 
-		sbuf_finish(origin);
-
-		sqlite3_bind_text(stmt_conflicts, 1,
-		    sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
-
-		while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-			sbuf_printf(conflictmsg, "\t- %s-%s\n",
-			    sqlite3_column_text(stmt_conflicts, 0),
-			    sqlite3_column_text(stmt_conflicts, 1));
-			if (cb != NULL)
-				cb (sbuf_data(origin), sqlite3_column_text(stmt_conflicts, 2), cbdata);
+		for (e = db->integrity; e != NULL; e = e->hh.next) {
+			sqlite3_bind_text(stmt, 1, e->path, -1, SQLITE_STATIC);
+			if (sqlite3_step(stmt) == SQLITE_ROW &&
+			    pkgdb_integrity_local_conflict(e,
+			    sqlite3_column_text(stmt, 0),
+			    sqlite3_column_text(stmt, 1),
+			    sqlite3_column_text(stmt, 2),
+			    cb, cbdata) != EPKG_OK)
+				retcode = EPKG_CONFLICT;
+			sqlite3_reset(stmt);
 		}
 
-		sbuf_finish(conflictmsg);
-		sqlite3_finalize(stmt_conflicts);
+		pkgdb_stmt_release(db, stmt);
+		pkgdb_integrity_free(db);
 
-		//pkg_emit_error("%s", sbuf_get(conflictmsg));
-		retcode = EPKG_CONFLICT;
+		return (retcode);
 	}
 
-	sqlite3_finalize(stmt);
-	sbuf_delete(conflictmsg);
-	sbuf_delete(origin);
-
-	assert (sql_exec(db->sqlite, "DROP TABLE IF EXISTS integritycheck") == EPKG_OK);
-
-	return (retcode);
-}
-
-struct pkgdb_it *
-pkgdb_integrity_conflict_local(struct pkgdb *db, const char *origin)
-{
-	sqlite3_stmt	*stmt;
-	int		 ret;
-
-	assert(db != NULL && origin != NULL);
+	/*
+	 * Many paths: sort them and merge them with the files table walked
+	 * in path order, which is the order of its primary key index.
+	 */
+	sorted = malloc(db->integrity_count * sizeof(struct integrity_entry *));
+	if (sorted == NULL) {
+		pkg_emit_errno("malloc", "integrity check");
+		pkgdb_integrity_free(db);
+		return (EPKG_FATAL);
+	}
+	n = 0;
+	for (e = db->integrity; e != NULL; e = e->hh.next)
+		sorted[n++] = e;
+	qsort(sorted, n, sizeof(struct integrity_entry *), integrity_entry_cmp);
 
-	const char	sql_conflicts [] = ""
-		"SELECT DISTINCT p.id AS rowid, p.origin, p.name, p.version, "
-		    "p.prefix "
-		"FROM packages AS p, files AS f, integritycheck AS i "
-		"WHERE p.id = f.package_id AND f.path = i.path "
-		"AND i.origin = ?1 AND i.origin != p.origin";
+	pkg_debug(4, "Pkgdb: running '%s'", sql_local_files);
+	if ((stmt = pkgdb_stmt_get(db, sql_local_files)) == NULL) {
+		free(sorted);
+		pkgdb_integrity_free(db);
+		return (EPKG_FATAL);
+	}
 
-	pkg_debug(4, "Pkgdb: running '%s'", sql_conflicts);
-	ret = sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (NULL);
+	i = 0;
+	while (i < n && sqlite3_step(stmt) == SQLITE_ROW) {
+		path = sqlite3_column_text(stmt, 0);
+		while (i < n && (cmp = strcmp(sorted[i]->path, path)) < 0)
+			i++;
+		if (i < n && cmp == 0) {
+			if (pkgdb_integrity_local_conflict(sorted[i],
+			    sqlite3_column_text(stmt, 1),
+			    sqlite3_column_text(stmt, 2),
+			    sqlite3_column_text(stmt, 3),
+			    cb, cbdata) != EPKG_OK)
+				retcode = EPKG_CONFLICT;
+			i++;
+		}
 	}
 
-	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_TRANSIENT);
+	pkgdb_stmt_release(db, stmt);
+	free(sorted);
+	pkgdb_integrity_free(db);
 
-	return (pkgdb_it_new(db, stmt, PKG_INSTALLED, PKGDB_IT_FLAG_ONCE));
+	return (retcode);
 }
 
 static int
@@ -3919,11 +4624,8 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 
 	while ((attr = va_arg(ap, int)) > 0) {
 		pkg_debug(4, "Pkgdb: running '%s'", sql[attr]);
-		if (sqlite3_prepare_v2(db->sqlite, sql[attr], -1, &stmt, NULL)
-		    != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
+		if ((stmt = pkgdb_stmt_get(db, sql[attr])) == NULL)
 			return (EPKG_FATAL);
-		}
 
 		switch (attr) {
 		case PKG_SET_FLATSIZE:
@@ -3934,7 +4636,7 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 		case PKG_SET_AUTOMATIC:
 			automatic = (int64_t)va_arg(ap, int);
 			if (automatic != 0 && automatic != 1) {
-				sqlite3_finalize(stmt);
+				pkgdb_stmt_release(db, stmt);
 				continue;
 			}
 			sqlite3_bind_int64(stmt, 1, automatic);
@@ -3942,8 +4644,10 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 			break;
 		case PKG_SET_LOCKED:
 			locked = (int64_t)va_arg(ap, int);
-			if (locked != 0 && locked != 1)
+			if (locked != 0 && locked != 1) {
+				pkgdb_stmt_release(db, stmt);
 				continue;
+			}
 			sqlite3_bind_int64(stmt, 1, locked);
 			sqlite3_bind_int64(stmt, 2, id);
 			break;
@@ -3963,11 +4667,11 @@ pkgdb_vset(struct pkgdb *db, int64_t id, va_list ap)
 
 		if (sqlite3_step(stmt) != SQLITE_DONE) {
 			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
+			pkgdb_stmt_release(db, stmt);
 			return (EPKG_FATAL);
 		}
 
-		sqlite3_finalize(stmt);
+		pkgdb_stmt_release(db, stmt);
 	}
 	return (EPKG_OK);
 }
@@ -3997,23 +4701,19 @@ pkgdb_file_set_cksum(struct pkgdb *db, struct pkg_file *file,
 	sqlite3_stmt	*stmt = NULL;
 	const char	 sql_file_update[] = ""
 		"UPDATE files SET sha256 = ?1 WHERE path = ?2";
-	int		 ret;
 
 	pkg_debug(4, "Pkgdb: running '%s'", sql_file_update);
-	ret = sqlite3_prepare_v2(db->sqlite, sql_file_update, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql_file_update)) == NULL)
 		return (EPKG_FATAL);
-	}
 	sqlite3_bind_text(stmt, 1, sha256, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt, 2, pkg_file_path(file), -1, SQLITE_STATIC);
 
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
-		sqlite3_finalize(stmt);
+		pkgdb_stmt_release(db, stmt);
 		return (EPKG_FATAL);
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 	strlcpy(file->sum, sha256, sizeof(file->sum));
 
 	return (EPKG_OK);
@@ -4060,242 +4760,327 @@ pkgshell_open(const char **reponame)
 	*reponame = strdup(localpath);
 }
 
+/*
+ * Database locks are fcntl(2) byte-range locks on PKG_DBDIR/local.lock,
+ * so waiters are queued by the kernel, woken as soon as the lock is
+ * released, and the locks of a dead process vanish with it:
+ *
+ *   LOCKF_GATE      taken exclusively by a writer for as long as it waits
+ *                   for the readers to drain, so that new readers queue
+ *                   up behind it (writer priority)
+ *   LOCKF_READ      shared by readers, exclusive for PKGDB_LOCK_EXCLUSIVE
+ *   LOCKF_ADVISORY  exclusive for PKGDB_LOCK_ADVISORY and
+ *                   PKGDB_LOCK_EXCLUSIVE
+ *
+ * fcntl(2) locks belong to the process, hence the lock state is kept per
+ * process as well and shared by every struct pkgdb it opens.
+ *
+ * Older pkg binaries lock through the pkg_lock table of local.sqlite
+ * instead: the two schemes do not see each other, an old and a new pkg
+ * running at the same time are not excluded.
+ */
+#define LOCKF_GATE	0
+#define LOCKF_READ	1
+#define LOCKF_ADVISORY	2
+
+/* Retry interval of a lock request refused with EDEADLK */
+static const struct timespec lockf_backoff = { 0, 10000000 };
+
+static struct {
+	int	fd;
+	pid_t	pid;
+	bool	writable;
+	int	read;
+	int	advisory;
+	bool	exclusive;
+	bool	exclusive_advisory;	/* LOCKF_ADVISORY taken by exclusive */
+} lockf_state = { -1, 0, false, 0, 0, false, false };
+
+static void
+pkgdb_lockf_alarm(int sig __unused)
+{
+	/* only there to interrupt fcntl(F_SETLKW) */
+}
+
 static int
-pkgdb_write_lock_pid(struct pkgdb *db)
+pkgdb_lockf_open(void)
 {
-	const char lock_pid_sql[] = ""
-			"INSERT INTO pkg_lock_pid VALUES (?1);";
-	sqlite3_stmt	*stmt = NULL;
-	int ret;
+	char path[MAXPATHLEN];
+	const char *dbdir;
 
-	ret = sqlite3_prepare_v2(db->sqlite, lock_pid_sql, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (EPKG_FATAL);
+	/* a forked child does not inherit the locks of its parent */
+	if (lockf_state.fd != -1 && lockf_state.pid != getpid()) {
+		lockf_state.read = lockf_state.advisory = 0;
+		lockf_state.exclusive = lockf_state.exclusive_advisory = false;
+		lockf_state.pid = getpid();
 	}
-	sqlite3_bind_int64(stmt, 1, (int64_t)getpid());
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		ERROR_SQLITE(db->sqlite);
-		sqlite3_finalize(stmt);
-		return (EPKG_FATAL);
+	if (lockf_state.fd != -1)
+		return (EPKG_OK);
+
+	lockf_state.pid = getpid();
+	dbdir = pkg_object_string(pkg_config_get("PKG_DBDIR"));
+	snprintf(path, sizeof(path), "%s/local.lock", dbdir);
+
+	lockf_state.fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (lockf_state.fd != -1) {
+		lockf_state.writable = true;
+		return (EPKG_OK);
 	}
-	sqlite3_finalize(stmt);
 
-	return (EPKG_OK);
+	/* unprivileged users can still share a read lock */
+	if ((lockf_state.fd = open(path, O_RDONLY|O_CLOEXEC)) != -1)
+		return (EPKG_OK);
+
+	return (EPKG_FATAL);
 }
 
-static int
-pkgdb_remove_lock_pid(struct pkgdb *db, int64_t pid)
+/*
+ * Microseconds from now until ts, negative once it has passed
+ */
+static int64_t
+pkgdb_lockf_usec(const struct timespec *ts)
 {
-	const char lock_pid_sql[] = ""
-			"DELETE FROM pkg_lock_pid WHERE pid = ?1;";
-	sqlite3_stmt	*stmt = NULL;
-	int ret;
+	struct timespec now;
 
-	ret = sqlite3_prepare_v2(db->sqlite, lock_pid_sql, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (EPKG_FATAL);
-	}
-	sqlite3_bind_int64(stmt, 1, pid);
-
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		ERROR_SQLITE(db->sqlite);
-		sqlite3_finalize(stmt);
-		return (EPKG_FATAL);
-	}
-	sqlite3_finalize(stmt);
-
-	return (EPKG_OK);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((int64_t)(ts->tv_sec - now.tv_sec) * 1000000 +
+	    (ts->tv_nsec - now.tv_nsec) / 1000);
 }
 
+/*
+ * Set the lock of one byte of the lock file, waiting at most until
+ * deadline (no wait at all when it is not set).  Returns EPKG_END when
+ * the lock is held by another process past the deadline.
+ *
+ * The wait is a fcntl(F_SETLKW) bounded by ITIMER_REAL; the SIGALRM
+ * disposition and the timer of the application are restored afterwards,
+ * the latter less the time spent here.
+ */
 static int
-pkgdb_check_lock_pid(struct pkgdb *db)
+pkgdb_lockf(short type, off_t byte, const struct timespec *deadline)
 {
-	sqlite3_stmt	*stmt = NULL;
-	int ret, found = 0;
-	int64_t pid, lpid;
-
-	ret = sqlite3_prepare_v2(db->sqlite, "SELECT pid FROM pkg_lock_pid;", -1,
-			&stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	struct flock fl;
+	struct timespec start;
+	struct itimerval it, oit;
+	struct sigaction sa, osa;
+	int64_t left;
+	int ret, err;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = byte;
+	fl.l_len = 1;
+
+	if (type == F_UNLCK || deadline == NULL ||
+	    pkgdb_lockf_usec(deadline) <= 0) {
+		if (fcntl(lockf_state.fd, F_SETLK, &fl) == 0)
+			return (EPKG_OK);
+		if (errno == EAGAIN || errno == EACCES)
+			return (EPKG_END);
+		pkg_emit_errno("fcntl", "local.lock");
 		return (EPKG_FATAL);
 	}
 
-	lpid = getpid();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pkgdb_lockf_alarm;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, &osa);
+	getitimer(ITIMER_REAL, &oit);
 
-	while (sqlite3_step(stmt) != SQLITE_DONE) {
-		pid = sqlite3_column_int64(stmt, 0);
-		if (pid != lpid) {
-			if (kill((pid_t)pid, 0) == -1) {
-				pkg_debug(1, "found stale pid %lld in lock database", pid);
-				if (pkgdb_remove_lock_pid(db, pid) != EPKG_OK){
-					sqlite3_finalize(stmt);
-					return (EPKG_FATAL);
-				}
-			}
-			else {
-				found ++;
-			}
+	ret = EPKG_OK;
+	for (;;) {
+		/*
+		 * The timer is one-shot and may already have been consumed
+		 * by a previous round (or by the EDEADLK backoff): arm it
+		 * again with whatever is left before every F_SETLKW.
+		 */
+		if ((left = pkgdb_lockf_usec(deadline)) <= 0) {
+			ret = EPKG_END;
+			break;
+		}
+		memset(&it, 0, sizeof(it));
+		it.it_value.tv_sec = left / 1000000;
+		it.it_value.tv_usec = left % 1000000;
+		setitimer(ITIMER_REAL, &it, NULL);
+
+		if (fcntl(lockf_state.fd, F_SETLKW, &fl) == 0)
+			break;
+		err = errno;
+		if (err != EINTR && err != EDEADLK) {
+			pkg_emit_errno("fcntl", "local.lock");
+			ret = EPKG_FATAL;
+			break;
 		}
+		/*
+		 * EINTR: the alarm, or some other signal that woke us up
+		 * early.  EDEADLK: the owner is itself waiting for a lock
+		 * we hold (two readers both going exclusive); it comes back
+		 * without sleeping, so back off until one of us gives up.
+		 */
+		if (err == EDEADLK)
+			nanosleep(&lockf_backoff, NULL);
 	}
 
-	if (found == 0)
-		return (EPKG_END);
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_REAL, &it, NULL);
+	sigaction(SIGALRM, &osa, NULL);
+	if (oit.it_value.tv_sec != 0 || oit.it_value.tv_usec != 0) {
+		/* pkgdb_lockf_usec(&start) is minus the time spent waiting */
+		left = (int64_t)oit.it_value.tv_sec * 1000000 +
+		    oit.it_value.tv_usec + pkgdb_lockf_usec(&start);
+		if (left <= 0)
+			left = 1;	/* it expired meanwhile: fire it now */
+		oit.it_value.tv_sec = left / 1000000;
+		oit.it_value.tv_usec = left % 1000000;
+		setitimer(ITIMER_REAL, &oit, NULL);
+	}
 
-	return (EPKG_OK);
+	return (ret);
 }
 
+/*
+ * Take LOCKF_READ exclusively, holding the gate while the readers drain
+ */
 static int
-pkgdb_reset_lock(struct pkgdb *db)
+pkgdb_lockf_writer(const struct timespec *deadline)
 {
-	const char init_sql[] = ""
-		"UPDATE pkg_lock SET exclusive=0, advisory=0, read=0;";
 	int ret;
 
-	ret = sqlite3_exec(db->sqlite, init_sql, NULL, NULL, NULL);
-
-	if (ret == SQLITE_OK)
-		return (EPKG_OK);
+	if ((ret = pkgdb_lockf(F_WRLCK, LOCKF_GATE, deadline)) != EPKG_OK)
+		return (ret);
+	ret = pkgdb_lockf(F_WRLCK, LOCKF_READ, deadline);
+	pkgdb_lockf(F_UNLCK, LOCKF_GATE, NULL);
 
-	return (EPKG_FATAL);
+	return (ret);
 }
 
 static int
-pkgdb_try_lock(struct pkgdb *db, const char *lock_sql,
-		double delay, unsigned int retries, pkgdb_lock_t type,
-		bool upgrade)
+pkgdb_try_lock(pkgdb_lock_t type, double delay, unsigned int retries,
+    bool upgrade)
 {
-	unsigned int tries = 0;
-	struct timespec ts;
-	int ret = EPKG_END;
+	struct timespec deadline, *dl = NULL;
+	double wait;
+	int ret;
 
-	while (tries <= retries) {
-		ret = sqlite3_exec(db->sqlite, lock_sql, NULL, NULL, NULL);
-		if (ret != SQLITE_OK) {
-			if (ret == SQLITE_READONLY && type == PKGDB_LOCK_READONLY) {
-				pkg_debug(1, "want read lock but cannot write to database, "
-						"slightly ignore this error for now");
-				return (EPKG_OK);
-			}
-			return (EPKG_FATAL);
+	if (pkgdb_lockf_open() != EPKG_OK) {
+		if (type == PKGDB_LOCK_READONLY) {
+			pkg_debug(1, "want read lock but cannot open the lock "
+			    "file, slightly ignore this error for now");
+			return (EPKG_OK);
 		}
+		pkg_emit_errno("open", "local.lock");
+		return (EPKG_FATAL);
+	}
+	if (!lockf_state.writable && type != PKGDB_LOCK_READONLY) {
+		pkg_emit_error("Insufficient privileges to lock the database");
+		return (EPKG_FATAL);
+	}
 
-		ret = EPKG_END;
-		if (sqlite3_changes(db->sqlite) == 0) {
-			if (pkgdb_check_lock_pid(db) == EPKG_END) {
-				/* No live processes found, so we can safely reset lock */
-				pkg_debug(1, "no concurrent processes found, cleanup the lock");
-				pkgdb_reset_lock(db);
-				if (upgrade) {
-					/*
-					 * In case of upgrade we should obtain a lock from the beginning,
-					 * hence switch upgrade to retain
-					 */
-					return pkgdb_obtain_lock(db, type, delay, retries - tries);
-				}
-				continue;
-			}
-			else if (delay > 0) {
-				ts.tv_sec = (int)delay;
-				ts.tv_nsec = (delay - (int)delay) * 1000000000.;
-				pkg_debug(1, "waiting for database lock for %d times, "
-						"next try in %.2f seconds", tries, delay);
-				(void)nanosleep(&ts, NULL);
-			}
-			else {
-				break;
-			}
+	/* the old polling interface: wait as long as it would have */
+	wait = delay * retries;
+	if (wait > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += (time_t)wait;
+		deadline.tv_nsec += (wait - (time_t)wait) * 1000000000.;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
 		}
-		else if (!upgrade) {
-			ret = pkgdb_write_lock_pid(db);
-			break;
+		dl = &deadline;
+		pkg_debug(1, "waiting up to %.2f seconds for the database lock",
+		    wait);
+	}
+
+	switch (type) {
+	case PKGDB_LOCK_READONLY:
+		/* an exclusive lock already covers reading */
+		if (lockf_state.read == 0 && !lockf_state.exclusive) {
+			ret = pkgdb_lockf(F_RDLCK, LOCKF_GATE, dl);
+			if (ret != EPKG_OK)
+				return (ret);
+			ret = pkgdb_lockf(F_RDLCK, LOCKF_READ, dl);
+			pkgdb_lockf(F_UNLCK, LOCKF_GATE, NULL);
+			if (ret != EPKG_OK)
+				return (ret);
 		}
-		else {
-			ret = EPKG_OK;
-			break;
+		lockf_state.read++;
+		break;
+	case PKGDB_LOCK_ADVISORY:
+		if (lockf_state.advisory == 0 &&
+		    !lockf_state.exclusive_advisory) {
+			ret = pkgdb_lockf(F_WRLCK, LOCKF_ADVISORY, dl);
+			if (ret != EPKG_OK)
+				return (ret);
+		}
+		lockf_state.advisory++;
+		break;
+	case PKGDB_LOCK_EXCLUSIVE:
+		if (lockf_state.exclusive)
+			return (EPKG_END);
+		if (upgrade) {
+			if (lockf_state.advisory == 0)
+				return (EPKG_FATAL);
+		} else if (lockf_state.advisory == 0) {
+			ret = pkgdb_lockf(F_WRLCK, LOCKF_ADVISORY, dl);
+			if (ret != EPKG_OK)
+				return (ret);
+			lockf_state.exclusive_advisory = true;
+		}
+		if ((ret = pkgdb_lockf_writer(dl)) != EPKG_OK) {
+			if (lockf_state.exclusive_advisory) {
+				pkgdb_lockf(F_UNLCK, LOCKF_ADVISORY, NULL);
+				lockf_state.exclusive_advisory = false;
+			}
+			/* a failed attempt must not cost the read lock we had */
+			if (lockf_state.read > 0)
+				pkgdb_lockf(F_RDLCK, LOCKF_READ, NULL);
+			return (ret);
 		}
-		tries ++;
+		lockf_state.exclusive = true;
+		break;
 	}
 
-	return (ret);
+	return (EPKG_OK);
 }
 
 int
 pkgdb_obtain_lock(struct pkgdb *db, pkgdb_lock_t type,
 		double delay, unsigned int retries)
 {
-	int ret;
-	const char table_sql[] = ""
-			"CREATE TABLE pkg_lock "
-			"(exclusive INTEGER(1), advisory INTEGER(1), read INTEGER(8));";
-	const char pid_sql[] = ""
-			"CREATE TABLE IF NOT EXISTS pkg_lock_pid "
-			"(pid INTEGER PRIMARY KEY);";
-	const char init_sql[] = ""
-			"INSERT INTO pkg_lock VALUES(0,0,0);";
-	const char readonly_lock_sql[] = ""
-			"UPDATE pkg_lock SET read=read+1 WHERE exclusive=0;";
-	const char advisory_lock_sql[] = ""
-			"UPDATE pkg_lock SET advisory=1 WHERE exclusive=0 AND advisory=0;";
-	const char exclusive_lock_sql[] = ""
-			"UPDATE pkg_lock SET exclusive=1 WHERE exclusive=0 AND advisory=0 AND read=0;";
-	const char *lock_sql = NULL;
-
 	assert(db != NULL);
 
-	ret = sqlite3_exec(db->sqlite, table_sql, NULL, NULL, NULL);
-	if (ret == SQLITE_OK) {
-		/* Need to initialize */
-		ret = sqlite3_exec(db->sqlite, init_sql, NULL, NULL, NULL);
-		if (ret != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			return (EPKG_FATAL);
-		}
-	}
-
-	ret = sqlite3_exec(db->sqlite, pid_sql, NULL, NULL, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		return (EPKG_FATAL);
-	}
-
 	switch (type) {
 	case PKGDB_LOCK_READONLY:
-		lock_sql = readonly_lock_sql;
+		/* readers see a consistent snapshot of a WAL database */
+		if (db->wal)
+			return (EPKG_OK);
 		pkg_debug(1, "want to get a read only lock on a database");
 		break;
 	case PKGDB_LOCK_ADVISORY:
-		lock_sql = advisory_lock_sql;
 		pkg_debug(1, "want to get an advisory lock on a database");
 		break;
 	case PKGDB_LOCK_EXCLUSIVE:
 		pkg_debug(1, "want to get an exclusive lock on a database");
-		lock_sql = exclusive_lock_sql;
 		break;
 	}
 
-	ret = pkgdb_try_lock(db, lock_sql, delay, retries, type, false);
-
-	return (ret);
+	return (pkgdb_try_lock(type, delay, retries, false));
 }
 
 int
 pkgdb_upgrade_lock(struct pkgdb *db, pkgdb_lock_t old_type, pkgdb_lock_t new_type,
 		double delay, unsigned int retries)
 {
-	const char advisory_exclusive_lock_sql[] = ""
-		"UPDATE pkg_lock SET exclusive=1,advisory=1 WHERE exclusive=0 AND advisory=1 AND read=0;";
 	int ret = EPKG_FATAL;
 
 	assert(db != NULL);
 
 	if (old_type == PKGDB_LOCK_ADVISORY && new_type == PKGDB_LOCK_EXCLUSIVE) {
 		pkg_debug(1, "want to upgrade advisory to exclusive lock");
-		ret = pkgdb_try_lock(db, advisory_exclusive_lock_sql, delay, retries,
-				new_type, true);
+		ret = pkgdb_try_lock(new_type, delay, retries, true);
 	}
 
 	return (ret);
@@ -4304,41 +5089,48 @@ pkgdb_upgrade_lock(struct pkgdb *db, pkgdb_lock_t old_type, pkgdb_lock_t new_typ
 int
 pkgdb_release_lock(struct pkgdb *db, pkgdb_lock_t type)
 {
-	const char readonly_unlock_sql[] = ""
-			"UPDATE pkg_lock SET read=read-1 WHERE read>0;";
-	const char advisory_unlock_sql[] = ""
-			"UPDATE pkg_lock SET advisory=0 WHERE advisory=1;";
-	const char exclusive_unlock_sql[] = ""
-			"UPDATE pkg_lock SET exclusive=0 WHERE exclusive=1;";
-	const char *unlock_sql = NULL;
-	int ret = EPKG_FATAL;
-
 	if (db == NULL)
 		return (EPKG_OK);
 
+	if (type == PKGDB_LOCK_READONLY && db->wal)
+		return (EPKG_OK);
+
+	if (lockf_state.fd == -1)
+		return (EPKG_END);
+
 	switch (type) {
 	case PKGDB_LOCK_READONLY:
-		unlock_sql = readonly_unlock_sql;
 		pkg_debug(1, "release a read only lock on a database");
+		if (lockf_state.read == 0)
+			return (EPKG_END);
+		if (--lockf_state.read == 0 && !lockf_state.exclusive)
+			pkgdb_lockf(F_UNLCK, LOCKF_READ, NULL);
 		break;
 	case PKGDB_LOCK_ADVISORY:
-		unlock_sql = advisory_unlock_sql;
 		pkg_debug(1, "release an advisory lock on a database");
+		if (lockf_state.advisory == 0)
+			return (EPKG_END);
+		if (--lockf_state.advisory == 0 &&
+		    !lockf_state.exclusive_advisory)
+			pkgdb_lockf(F_UNLCK, LOCKF_ADVISORY, NULL);
 		break;
 	case PKGDB_LOCK_EXCLUSIVE:
 		pkg_debug(1, "release an exclusive lock on a database");
-		unlock_sql = exclusive_unlock_sql;
+		if (!lockf_state.exclusive)
+			return (EPKG_END);
+		lockf_state.exclusive = false;
+		/* downgrade atomically if this process still reads */
+		pkgdb_lockf(lockf_state.read > 0 ? F_RDLCK : F_UNLCK,
+		    LOCKF_READ, NULL);
+		if (lockf_state.exclusive_advisory) {
+			lockf_state.exclusive_advisory = false;
+			if (lockf_state.advisory == 0)
+				pkgdb_lockf(F_UNLCK, LOCKF_ADVISORY, NULL);
+		}
 		break;
 	}
 
-	ret = sqlite3_exec(db->sqlite, unlock_sql, NULL, NULL, NULL);
-	if (ret != SQLITE_OK)
-		return (EPKG_FATAL);
-
-	if (sqlite3_changes(db->sqlite) == 0)
-		return (EPKG_END);
-
-	return pkgdb_remove_lock_pid(db, (int64_t)getpid());
+	return (EPKG_OK);
 }
 
 int64_t
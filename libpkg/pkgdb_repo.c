@@ -59,11 +59,14 @@
 /* The package repo schema minor revision.
    Minor schema changes don't prevent older pkgng
    versions accessing the repo. */
-#define REPO_SCHEMA_MINOR 7
+#define REPO_SCHEMA_MINOR 9
 
-/* REPO_SCHEMA_VERSION=2007 */
+/* REPO_SCHEMA_VERSION=2009 */
 #define REPO_SCHEMA_VERSION (REPO_SCHEMA_MAJOR * 1000 + REPO_SCHEMA_MINOR)
 
+/* The first schema carrying the search_tokens/search_postings index */
+#define REPO_SCHEMA_SEARCH_INDEX 2008
+
 typedef enum _sql_prstmt_index {
 	PKG = 0,
 	DEPS,
@@ -78,6 +81,8 @@ typedef enum _sql_prstmt_index {
 	SHLIB_PROV,
 	ANNOTATE1,
 	ANNOTATE2,
+	SEARCH1,
+	SEARCH2,
 	EXISTS,
 	VERSION,
 	DELETE,
@@ -170,6 +175,17 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 		" (SELECT annotation_id FROM annotation WHERE annotation=?3))",
 		"ITT",
 	},
+	[SEARCH1] = {
+		NULL,
+		"INSERT OR IGNORE INTO search_tokens(token) VALUES (?1)",
+		"T",
+	},
+	[SEARCH2] = {
+		NULL,
+		"INSERT OR ROLLBACK INTO search_postings(token_id, package_id, fields) "
+		"VALUES ((SELECT id FROM search_tokens WHERE token = ?1), ?2, ?3)",
+		"TII",
+	},
 	[VERSION] = {
 		NULL,
 		"SELECT version FROM packages WHERE origin=?1",
@@ -184,6 +200,180 @@ static sql_prstmt sql_prepared_statements[PRSTMT_LAST] = {
 };
 
 
+struct search_token {
+	const char	*token;
+	int		 fields;
+	UT_hash_handle	 hh;
+};
+
+bool
+pkgdb_search_token_char(int c)
+{
+	/* ASCII letters and digits, and any byte of a multibyte sequence */
+	return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    (c >= '0' && c <= '9') || (c & 0x80) != 0);
+}
+
+/*
+ * Split text into lowercased runs of token characters, in place.  Runs
+ * shorter than PKGDB_SEARCH_TOKEN_MIN are never looked up by
+ * pkgdb_search() and are not indexed.
+ */
+static int
+search_tokenize(struct search_token **tokens, char *text, int field)
+{
+	struct search_token	*t;
+	char			*p, *start;
+
+	p = text;
+	while (*p != '\0') {
+		if (!pkgdb_search_token_char((unsigned char)*p)) {
+			p++;
+			continue;
+		}
+		start = p;
+		for (; pkgdb_search_token_char((unsigned char)*p); p++) {
+			if (*p >= 'A' && *p <= 'Z')
+				*p += 'a' - 'A';
+		}
+		if (p - start < PKGDB_SEARCH_TOKEN_MIN)
+			continue;
+		if (*p != '\0')
+			*p++ = '\0';
+
+		HASH_FIND_STR(*tokens, start, t);
+		if (t == NULL) {
+			if ((t = malloc(sizeof(*t))) == NULL) {
+				pkg_emit_errno("malloc", "search_token");
+				return (EPKG_FATAL);
+			}
+			t->token = start;
+			t->fields = 0;
+			HASH_ADD_KEYPTR(hh, *tokens, t->token,
+			    strlen(t->token), t);
+		}
+		t->fields |= field;
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Record the words of a package in the search index, using the token
+ * and posting insert statements tok and post.
+ */
+static int
+search_index_package(sqlite3 *sqlite, sqlite3_stmt *tok, sqlite3_stmt *post,
+    int64_t package_id, const char *name, const char *version,
+    const char *comment, const char *desc)
+{
+	struct search_token	*tokens = NULL, *t, *tmp;
+	char			*buf, *n, *c, *d;
+	size_t			 nlen, clen, dlen;
+	int			 ret = EPKG_OK;
+
+	nlen = strlen(name) + strlen(version) + 2;
+	clen = strlen(comment) + 1;
+	dlen = strlen(desc) + 1;
+	if ((buf = malloc(nlen + clen + dlen)) == NULL) {
+		pkg_emit_errno("malloc", "search index");
+		return (EPKG_FATAL);
+	}
+	n = buf;
+	c = n + nlen;
+	d = c + clen;
+	snprintf(n, nlen, "%s-%s", name, version);
+	memcpy(c, comment, clen);
+	memcpy(d, desc, dlen);
+
+	if (search_tokenize(&tokens, n, PKGDB_SEARCH_NAMEVER) != EPKG_OK ||
+	    search_tokenize(&tokens, c, PKGDB_SEARCH_COMMENT) != EPKG_OK ||
+	    search_tokenize(&tokens, d, PKGDB_SEARCH_DESC) != EPKG_OK)
+		ret = EPKG_FATAL;
+
+	HASH_ITER(hh, tokens, t, tmp) {
+		if (ret != EPKG_OK)
+			break;
+		sqlite3_reset(tok);
+		sqlite3_bind_text(tok, 1, t->token, -1, SQLITE_STATIC);
+		sqlite3_reset(post);
+		sqlite3_bind_text(post, 1, t->token, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(post, 2, package_id);
+		sqlite3_bind_int(post, 3, t->fields);
+		if (sqlite3_step(tok) != SQLITE_DONE ||
+		    sqlite3_step(post) != SQLITE_DONE) {
+			ERROR_SQLITE(sqlite);
+			ret = EPKG_FATAL;
+		}
+	}
+
+	HASH_ITER(hh, tokens, t, tmp) {
+		HASH_DEL(tokens, t);
+		free(t);
+	}
+	free(buf);
+
+	return (ret);
+}
+
+/*
+ * Fill the search index of a repo which has just been upgraded to
+ * REPO_SCHEMA_SEARCH_INDEX.
+ */
+static int
+search_index_rebuild(sqlite3 *sqlite, const char *database)
+{
+	sqlite3_stmt	*stmt = NULL, *tok = NULL, *post = NULL;
+	char		 sql[BUFSIZ];
+	int		 ret = EPKG_OK;
+
+	sqlite3_snprintf(sizeof(sql), sql,
+	    "SELECT id, name, version, comment, desc FROM %Q.packages",
+	    database);
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &stmt, NULL) != SQLITE_OK)
+		goto error;
+
+	sqlite3_snprintf(sizeof(sql), sql,
+	    "INSERT OR IGNORE INTO %Q.search_tokens(token) VALUES (?1)",
+	    database);
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &tok, NULL) != SQLITE_OK)
+		goto error;
+
+	sqlite3_snprintf(sizeof(sql), sql,
+	    "INSERT INTO %Q.search_postings(token_id, package_id, fields) "
+	    "VALUES ((SELECT id FROM %Q.search_tokens WHERE token = ?1), "
+	    "?2, ?3)", database, database);
+	if (sqlite3_prepare_v2(sqlite, sql, -1, &post, NULL) != SQLITE_OK)
+		goto error;
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (search_index_package(sqlite, tok, post,
+		    sqlite3_column_int64(stmt, 0),
+		    sqlite3_column_text(stmt, 1),
+		    sqlite3_column_text(stmt, 2),
+		    sqlite3_column_text(stmt, 3),
+		    sqlite3_column_text(stmt, 4)) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+	if (ret != SQLITE_DONE)
+		goto error;
+
+	ret = EPKG_OK;
+	goto cleanup;
+
+error:
+	ERROR_SQLITE(sqlite);
+	ret = EPKG_FATAL;
+cleanup:
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(tok);
+	sqlite3_finalize(post);
+
+	return (ret);
+}
+
 static void
 file_exists(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 {
@@ -607,6 +797,10 @@ try_again:
 		}
 	}
 
+	if (search_index_package(sqlite, STMT(SEARCH1), STMT(SEARCH2),
+	    package_id, name, version, comment, desc) != EPKG_OK)
+		return (EPKG_FATAL);
+
 	return (EPKG_OK);
 }
 
@@ -737,6 +931,11 @@ apply_repo_change(struct pkgdb *db, const char *database,
 		}
 	}
 
+	/* populate the tables a change has just created */
+	if (ret == EPKG_OK && repo_changes == repo_upgrades &&
+	    change->next_version == REPO_SCHEMA_SEARCH_INDEX)
+		ret = search_index_rebuild(db->sqlite, database);
+
 	/* update repo user_version */
 	if (ret == EPKG_OK) {
 		*next_version = change->next_version;
@@ -1026,12 +1225,12 @@ struct pkgdb_it *
 pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match,
     const char *repo)
 {
-	sqlite3_stmt	*stmt = NULL;
+	struct pkgdb_it	*it;
 	struct sbuf	*sql = NULL;
 	const char	*reponame = NULL;
 	const char	*comp = NULL;
-	int		 ret;
-	char		 basesql[BUFSIZ] = ""
+	static const char * const sort[] = { "name", NULL };
+	const char	 basesql[] = ""
 		"SELECT id, origin, name, version, comment, "
 		"prefix, desc, arch, maintainer, www, "
 		"licenselogic, flatsize, pkgsize, "
@@ -1050,53 +1249,37 @@ pkgdb_rquery(struct pkgdb *db, const char *pattern, match_t match,
 
 	reponame = pkgdb_get_reponame(db, repo);
 
+	/*
+	 * A MATCH_CONDITION comes from format_sql_condition(), which
+	 * qualifies the list tables with '%1$s' and escapes '%': it is part
+	 * of the format expanded for each repository, not of the tail.
+	 */
 	sql = sbuf_new_auto();
+	sbuf_cat(sql, basesql);
 	comp = pkgdb_get_pattern_query(pattern, match);
-	if (comp && comp[0])
-		strlcat(basesql, comp, sizeof(basesql));
+	if (comp != NULL)
+		sbuf_cat(sql, comp);
+	sbuf_finish(sql);
 
 	/*
-	 * Working on multiple remote repositories
+	 * Each repository is queried with its own statement, using its own
+	 * indexes, and the iterator merges the results by name.
 	 */
-	if (reponame == NULL) {
-		/* duplicate the query via UNION for all the attached
-		 * databases */
-
-		ret = pkgdb_sql_all_attached(db->sqlite, sql,
-		    basesql, " UNION ALL ");
-		if (ret != EPKG_OK) {
-			sbuf_delete(sql);
-			return (NULL);
-		}
-	} else
-		sbuf_printf(sql, basesql, reponame, reponame);
-
-	sbuf_cat(sql, " ORDER BY name;");
-	sbuf_finish(sql);
-
-	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
-	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), sbuf_size(sql), &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		sbuf_delete(sql);
-		return (NULL);
-	}
-
+	it = pkgdb_it_new_repos(db, reponame, sbuf_data(sql), " ORDER BY name;",
+	    sort, PKG_REMOTE, PKGDB_IT_FLAG_ONCE);
 	sbuf_delete(sql);
 
-	if (match != MATCH_ALL && match != MATCH_CONDITION)
-		sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_TRANSIENT);
+	if (it != NULL && match != MATCH_ALL && match != MATCH_CONDITION)
+		pkgdb_it_bind_text(it, 1, pattern);
 
-	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+	return (it);
 }
 
 struct pkgdb_it *
 pkgdb_rquery_provide(struct pkgdb *db, const char *provide, const char *repo)
 {
-	sqlite3_stmt	*stmt;
-	struct sbuf	*sql = NULL;
+	struct pkgdb_it	*it;
 	const char	*reponame = NULL;
-	int		 ret;
 	const char	 basesql[] = ""
 			"SELECT p.id, p.origin, p.name, p.version, p.comment, "
 			"p.prefix, p.desc, p.arch, p.maintainer, p.www, "
@@ -1111,47 +1294,19 @@ pkgdb_rquery_provide(struct pkgdb *db, const char *provide, const char *repo)
 	assert(db != NULL);
 	reponame = pkgdb_get_reponame(db, repo);
 
-	sql = sbuf_new_auto();
-	/*
-	 * Working on multiple remote repositories
-	 */
-	if (reponame == NULL) {
-		/* duplicate the query via UNION for all the attached
-		 * databases */
-
-		ret = pkgdb_sql_all_attached(db->sqlite, sql,
-				basesql, " UNION ALL ");
-		if (ret != EPKG_OK) {
-			sbuf_delete(sql);
-			return (NULL);
-		}
-	} else
-		sbuf_printf(sql, basesql, reponame);
-
-	sbuf_finish(sql);
-
-	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
-	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		sbuf_delete(sql);
-		return (NULL);
-	}
-
-	sbuf_delete(sql);
-
-	sqlite3_bind_text(stmt, 1, provide, -1, SQLITE_TRANSIENT);
+	it = pkgdb_it_new_repos(db, reponame, basesql, NULL, NULL,
+	    PKG_REMOTE, PKGDB_IT_FLAG_ONCE);
+	if (it != NULL)
+		pkgdb_it_bind_text(it, 1, provide);
 
-	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+	return (it);
 }
 
 struct pkgdb_it *
 pkgdb_find_shlib_provide(struct pkgdb *db, const char *require, const char *repo)
 {
-	sqlite3_stmt	*stmt;
-	struct sbuf	*sql = NULL;
+	struct pkgdb_it	*it;
 	const char	*reponame = NULL;
-	int		 ret;
 	const char	 basesql[] = ""
 			"SELECT p.id, p.origin, p.name, p.version, p.comment, "
 			"p.prefix, p.desc, p.arch, p.maintainer, p.www, "
@@ -1164,47 +1319,19 @@ pkgdb_find_shlib_provide(struct pkgdb *db, const char *require, const char *repo
 	assert(db != NULL);
 	reponame = pkgdb_get_reponame(db, repo);
 
-	sql = sbuf_new_auto();
-	/*
-	 * Working on multiple remote repositories
-	 */
-	if (reponame == NULL) {
-		/* duplicate the query via UNION for all the attached
-		 * databases */
-
-		ret = pkgdb_sql_all_attached(db->sqlite, sql,
-				basesql, " UNION ALL ");
-		if (ret != EPKG_OK) {
-			sbuf_delete(sql);
-			return (NULL);
-		}
-	} else
-		sbuf_printf(sql, basesql, reponame);
-
-	sbuf_finish(sql);
-
-	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
-	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		sbuf_delete(sql);
-		return (NULL);
-	}
-
-	sbuf_delete(sql);
-
-	sqlite3_bind_text(stmt, 1, require, -1, SQLITE_TRANSIENT);
+	it = pkgdb_it_new_repos(db, reponame, basesql, NULL, NULL,
+	    PKG_REMOTE, PKGDB_IT_FLAG_ONCE);
+	if (it != NULL)
+		pkgdb_it_bind_text(it, 1, require);
 
-	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+	return (it);
 }
 
 struct pkgdb_it *
 pkgdb_find_shlib_require(struct pkgdb *db, const char *provide, const char *repo)
 {
-	sqlite3_stmt	*stmt;
-	struct sbuf	*sql = NULL;
+	struct pkgdb_it	*it;
 	const char	*reponame = NULL;
-	int		 ret;
 	const char	 basesql[] = ""
 			"SELECT p.id, p.origin, p.name, p.version, p.comment, "
 			"p.prefix, p.desc, p.arch, p.maintainer, p.www, "
@@ -1217,36 +1344,10 @@ pkgdb_find_shlib_require(struct pkgdb *db, const char *provide, const char *repo
 	assert(db != NULL);
 	reponame = pkgdb_get_reponame(db, repo);
 
-	sql = sbuf_new_auto();
-	/*
-	 * Working on multiple remote repositories
-	 */
-	if (reponame == NULL) {
-		/* duplicate the query via UNION for all the attached
-		 * databases */
-
-		ret = pkgdb_sql_all_attached(db->sqlite, sql,
-				basesql, " UNION ALL ");
-		if (ret != EPKG_OK) {
-			sbuf_delete(sql);
-			return (NULL);
-		}
-	} else
-		sbuf_printf(sql, basesql, reponame);
-
-	sbuf_finish(sql);
-
-	pkg_debug(4, "Pkgdb: running '%s'", sbuf_get(sql));
-	ret = sqlite3_prepare_v2(db->sqlite, sbuf_get(sql), -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
-		sbuf_delete(sql);
-		return (NULL);
-	}
-
-	sbuf_delete(sql);
-
-	sqlite3_bind_text(stmt, 1, provide, -1, SQLITE_TRANSIENT);
+	it = pkgdb_it_new_repos(db, reponame, basesql, NULL, NULL,
+	    PKG_REMOTE, PKGDB_IT_FLAG_ONCE);
+	if (it != NULL)
+		pkgdb_it_bind_text(it, 1, provide);
 
-	return (pkgdb_it_new(db, stmt, PKG_REMOTE, PKGDB_IT_FLAG_ONCE));
+	return (it);
 }
@@ -555,6 +555,26 @@ static struct db_upgrades {
 	    "UNIQUE(package_id, provide_id)"
 	");"
 	},
+	{23,
+	"CREATE INDEX deps_name ON deps(name);"
+	"CREATE INDEX pkg_categories_category_id ON pkg_categories(category_id);"
+	"CREATE INDEX pkg_licenses_license_id ON pkg_licenses(license_id);"
+	"CREATE INDEX pkg_option_option_id ON pkg_option(option_id);"
+	"CREATE INDEX pkg_shlibs_required_shlib_id ON pkg_shlibs_required(shlib_id);"
+	"CREATE INDEX pkg_shlibs_provided_shlib_id ON pkg_shlibs_provided(shlib_id);"
+	"CREATE INDEX pkg_annotation_tag_id ON pkg_annotation(tag_id);"
+	"CREATE INDEX pkg_annotation_value_id ON pkg_annotation(value_id);"
+	},
+	{24,
+	"ALTER TABLE files ADD COLUMN name TEXT;"
+	"UPDATE files SET name = " PKGDB_SQL_BASENAME("path") ";"
+	"CREATE INDEX files_name ON files(name);"
+	"CREATE TRIGGER files_name AFTER INSERT ON files "
+		"WHEN new.name IS NULL BEGIN "
+		"UPDATE files SET name = " PKGDB_SQL_BASENAME("new.path") " "
+		"WHERE path = new.path; "
+	"END;"
+	},
 
 
 	/* Mark the end of the array */
@@ -59,6 +59,7 @@ void pkg_emit_incremental_update(int updated, int removed, int added, int proces
 void pkg_debug(int level, const char *fmt, ...);
 int pkg_emit_sandbox_call(pkg_sandbox_cb call, int fd, void *ud);
 int pkg_emit_sandbox_get_string(pkg_sandbox_cb call, void *ud, char **str, int64_t *len);
+void pkg_event_pipe_flush(void);
 
 
 #endif
@@ -487,8 +487,6 @@ typedef void (*conflict_func_cb)(const char *, const char *, void *);
 int pkgdb_integrity_append(struct pkgdb *db, struct pkg *p,
 		conflict_func_cb cb, void *cbdata);
 int pkgdb_integrity_check(struct pkgdb *db, conflict_func_cb cb, void *cbdata);
-struct pkgdb_it *pkgdb_integrity_conflict_local(struct pkgdb *db,
-						const char *origin);
 
 int pkg_set_mtree(struct pkg *, const char *mtree);
 
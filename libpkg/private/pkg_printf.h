@@ -158,6 +158,8 @@ struct percent_esc {
 	struct sbuf	*item_fmt;
 	struct sbuf	*sep_fmt;
 	fmt_code_t	 fmt_code;
+	struct pkg_printf_prog	*item_prog;	/* item_fmt, compiled */
+	struct pkg_printf_prog	*sep_prog;	/* sep_fmt, compiled */
 };
 
 /* Format handler function prototypes */
@@ -249,7 +251,8 @@ _static struct percent_esc *set_list_defaults(struct percent_esc *,
 					      const char *, const char *);
 
 _static struct sbuf *iterate_item(struct sbuf *, const struct pkg *,
-				  const char *, const void *, int, unsigned);
+				  struct percent_esc *, unsigned,
+				  const void *, int, unsigned);
 
 _static const char *field_modifier(const char *, struct percent_esc *);
 _static const char *field_width(const char *, struct percent_esc *);
@@ -261,11 +264,9 @@ _static const char *maybe_read_hex_byte(struct sbuf *, const char *);
 _static const char *read_oct_byte(struct sbuf *, const char *);
 _static const char *process_escape(struct sbuf *, const char *);
 
-_static const char *process_format_trailer(struct sbuf *, struct percent_esc *,
-					   const char *, const struct pkg *,
-					   const void *, int, unsigned);
-_static const char *process_format_main(struct sbuf *, struct percent_esc *,
-					const char *, const char *, void *);
+_static struct pkg_printf_prog *compile_format(const char *, unsigned);
+_static struct sbuf *exec_item(struct sbuf *, struct pkg_printf_prog *,
+			       const struct pkg *, const void *, int);
 
 #endif
 
@@ -32,17 +32,45 @@
 
 #include "sqlite3.h"
 
+struct integrity_entry;
+struct integrity_owner;
+struct pkgdb_stmt;
+
 struct pkgdb {
 	sqlite3		*sqlite;
 	pkgdb_t		 type;
 	int		 lock_count;
 	bool		 prstmt_initialized;
+	bool		 wal;
+	struct pkgdb_stmt	*stmts;
+	struct integrity_entry	*integrity;
+	struct integrity_owner	*integrity_owners;
+	unsigned int	 integrity_count;
+};
+
+#define PKGDB_IT_SORT_MAX	2
+
+/*
+ * SQL expression for the last component of path: rtrim() strips the
+ * characters which are not a slash from its end, leaving the directory
+ * part to be removed.
+ */
+#define PKGDB_SQL_BASENAME(path) \
+	"replace(" path ", rtrim(" path ", replace(" path ", '/', '')), '')"
+
+/* One statement of an iterator fanned out over the attached repositories */
+struct pkgdb_it_repo {
+	sqlite3_stmt	*stmt;
+	int		 state;
 };
 
 struct pkgdb_it {
 	struct pkgdb	*db;
 	sqlite3	*sqlite;
 	sqlite3_stmt	*stmt;
+	struct pkgdb_it_repo	*repos;
+	unsigned int	 nrepos;
+	int		 sort[PKGDB_IT_SORT_MAX];
 	short	type;
 	short	flags;
 	short	finished;
@@ -63,8 +91,43 @@ int pkgdb_transaction_begin(sqlite3 *sqlite, const char *savepoint);
 int pkgdb_transaction_commit(sqlite3 *sqlite, const char *savepoint);
 int pkgdb_transaction_rollback(sqlite3 *sqlite, const char *savepoint);
 
+/**
+ * Get a prepared statement for sql from the statement cache of db, preparing
+ * it on first use.  It must be handed back with pkgdb_stmt_release(), which
+ * resets it and clears its bindings, or finalizes it if it is not cached.
+ * @return the statement or NULL on error.
+ */
+sqlite3_stmt *pkgdb_stmt_get(struct pkgdb *db, const char *sql);
+void pkgdb_stmt_release(struct pkgdb *db, sqlite3_stmt *stmt);
+
+/**
+ * Passively checkpoint the write-ahead log of the local database, if any.
+ * Never waits on readers.
+ * @return an error code.
+ */
+int pkgdb_checkpoint(struct pkgdb *db);
+
 struct pkgdb_it *pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type, short flags);
 
+/**
+ * Run repo_sql, followed by tail, on reponame or, if NULL, on each attached
+ * repository with its own prepared statement.  repo_sql is a printf(3)
+ * format refering to the repository as %1$s; tail is appended as is.  Each
+ * statement must return its rows ordered by the NULL terminated list of
+ * columns sort, if not NULL: the iterator merges them in that order, rows
+ * which compare equal coming in the order the repositories are attached.
+ * Without sort the repositories are walked one after the other.
+ * @return the iterator, or NULL on error or if no repository is attached.
+ */
+struct pkgdb_it *pkgdb_it_new_repos(struct pkgdb *db, const char *reponame,
+    const char *repo_sql, const char *tail, const char * const *sort,
+    int type, short flags);
+
+/**
+ * Bind a text parameter on each statement of an iterator
+ */
+void pkgdb_it_bind_text(struct pkgdb_it *it, int idx, const char *val);
+
 void pkgshell_open(const char **r);
 
 /**
@@ -119,6 +182,21 @@ int pkgdb_repo_add_package(struct pkg *pkg, const char *pkg_path,
  */
 int pkgdb_repo_remove_package(const char *origin);
 
+/* Bits of search_postings.fields */
+#define PKGDB_SEARCH_NAMEVER	(0x1)
+#define PKGDB_SEARCH_COMMENT	(0x1 << 1)
+#define PKGDB_SEARCH_DESC	(0x1 << 2)
+
+/* Shortest word recorded in the search index */
+#define PKGDB_SEARCH_TOKEN_MIN	3
+
+/**
+ * Whether a byte belongs to a word of the search index
+ * @param c the byte
+ * @return true if c is an ASCII letter or digit or a non-ASCII byte
+ */
+bool pkgdb_search_token_char(int c);
+
 /**
  * Upgrade repo db version if required
  * @param db package database object
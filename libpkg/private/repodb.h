@@ -174,6 +174,32 @@ static const char initsql[] = ""
 	    "  ON DELETE RESTRICT ON UPDATE RESTRICT,"
 	    "UNIQUE(package_id, provide_id)"
 	");"
+	/* inverted index of the words in name-version, comment and desc */
+	"CREATE TABLE search_tokens ("
+	    "id INTEGER PRIMARY KEY,"
+	    "token TEXT NOT NULL UNIQUE"
+	");"
+	"CREATE TABLE search_postings ("
+	    "token_id INTEGER NOT NULL REFERENCES search_tokens(id)"
+	    "  ON DELETE RESTRICT ON UPDATE RESTRICT,"
+	    "package_id INTEGER NOT NULL REFERENCES packages(id)"
+	    "  ON DELETE CASCADE ON UPDATE CASCADE,"
+	    "fields INTEGER NOT NULL,"
+	    "PRIMARY KEY(token_id, package_id)"
+	");"
+	"CREATE INDEX search_postings_package ON search_postings(package_id);"
+	/* reverse lookups used by pkg rquery -e */
+	"CREATE INDEX IF NOT EXISTS deps_origin ON deps(origin);"
+	"CREATE INDEX deps_name ON deps(name);"
+	"CREATE INDEX pkg_categories_category_id ON pkg_categories(category_id);"
+	"CREATE INDEX pkg_licenses_license_id ON pkg_licenses(license_id);"
+	"CREATE INDEX pkg_option_option_id ON pkg_option(option_id);"
+	"CREATE INDEX pkg_shlibs_required_shlib_id "
+	    "ON pkg_shlibs_required(shlib_id);"
+	"CREATE INDEX pkg_shlibs_provided_shlib_id "
+	    "ON pkg_shlibs_provided(shlib_id);"
+	"CREATE INDEX pkg_annotation_tag_id ON pkg_annotation(tag_id);"
+	"CREATE INDEX pkg_annotation_value_id ON pkg_annotation(value_id);"
 	"PRAGMA user_version=%d;"
 	;
 
@@ -319,6 +345,40 @@ static const struct repo_changes repo_upgrades[] = {
 	    "UNIQUE(package_id, provide_id)"
 	");"
 	},
+	{2007,
+	 2008,
+	 "Add search index",
+	"CREATE TABLE %Q.search_tokens ("
+	    "id INTEGER PRIMARY KEY,"
+	    "token TEXT NOT NULL UNIQUE"
+	");"
+	"CREATE TABLE %Q.search_postings ("
+	    "token_id INTEGER NOT NULL REFERENCES search_tokens(id)"
+	    "  ON DELETE RESTRICT ON UPDATE RESTRICT,"
+	    "package_id INTEGER NOT NULL REFERENCES packages(id)"
+	    "  ON DELETE CASCADE ON UPDATE CASCADE,"
+	    "fields INTEGER NOT NULL,"
+	    "PRIMARY KEY(token_id, package_id)"
+	");"
+	"CREATE INDEX %Q.search_postings_package "
+	    "ON search_postings(package_id);"
+	},
+	{2008,
+	 2009,
+	 "Add indexes for condition queries",
+	"CREATE INDEX IF NOT EXISTS %Q.deps_origin ON deps(origin);"
+	"CREATE INDEX %Q.deps_name ON deps(name);"
+	"CREATE INDEX %Q.pkg_categories_category_id "
+	    "ON pkg_categories(category_id);"
+	"CREATE INDEX %Q.pkg_licenses_license_id ON pkg_licenses(license_id);"
+	"CREATE INDEX %Q.pkg_option_option_id ON pkg_option(option_id);"
+	"CREATE INDEX %Q.pkg_shlibs_required_shlib_id "
+	    "ON pkg_shlibs_required(shlib_id);"
+	"CREATE INDEX %Q.pkg_shlibs_provided_shlib_id "
+	    "ON pkg_shlibs_provided(shlib_id);"
+	"CREATE INDEX %Q.pkg_annotation_tag_id ON pkg_annotation(tag_id);"
+	"CREATE INDEX %Q.pkg_annotation_value_id ON pkg_annotation(value_id);"
+	},
 	/* Mark the end of the array */
 	{ -1, -1, NULL, NULL, }
 
@@ -327,6 +387,25 @@ static const struct repo_changes repo_upgrades[] = {
 /* How to downgrade a newer repo to match what the current system
    expects */
 static const struct repo_changes repo_downgrades[] = {
+	{2009,
+	 2008,
+	 "Drop indexes for condition queries",
+	 "DROP INDEX IF EXISTS %Q.deps_origin;"
+	 "DROP INDEX %Q.deps_name;"
+	 "DROP INDEX %Q.pkg_categories_category_id;"
+	 "DROP INDEX %Q.pkg_licenses_license_id;"
+	 "DROP INDEX %Q.pkg_option_option_id;"
+	 "DROP INDEX %Q.pkg_shlibs_required_shlib_id;"
+	 "DROP INDEX %Q.pkg_shlibs_provided_shlib_id;"
+	 "DROP INDEX %Q.pkg_annotation_tag_id;"
+	 "DROP INDEX %Q.pkg_annotation_value_id;"
+	},
+	{2008,
+	 2007,
+	 "Drop search index",
+	 "DROP TABLE %Q.search_postings;"
+	 "DROP TABLE %Q.search_tokens;"
+	},
 	{2007,
 	 2006,
 	 "Revert conflicts and provides creation",
@@ -90,10 +90,13 @@ int format_exec_cmd(char **, const char *, const char *, const char *, char *);
 int is_dir(const char *);
 int is_conf_file(const char *path, char *newpath, size_t len);
 
-void sha256_buf(char *, size_t len, char[SHA256_DIGEST_LENGTH * 2 +1]);
-void sha256_buf_bin(char *, size_t len, char[SHA256_DIGEST_LENGTH]);
+void bin_to_hex(const unsigned char *, size_t len, char *);
+void sha256_buf(const char *, size_t len, char[SHA256_DIGEST_LENGTH * 2 +1]);
+void sha256_buf_bin(const char *, size_t len, char[SHA256_DIGEST_LENGTH]);
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 int sha256_fd(int fd, char[SHA256_DIGEST_LENGTH * 2 +1]);
+int sha256_fd_bin(int fd, unsigned char[SHA256_DIGEST_LENGTH]);
+int sha256_fd_quiet(int fd, char[SHA256_DIGEST_LENGTH * 2 +1]);
 int md5_file(const char *, char[MD5_DIGEST_LENGTH * 2 +1]);
 
 int rsa_new(struct rsa_key **, pem_password_cb *, char *path);
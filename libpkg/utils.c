@@ -28,6 +28,7 @@
 
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <stdio.h>
 
 #include <assert.h>
@@ -294,15 +295,27 @@ is_dir(const char *path)
 	return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
 }
 
-static void
-md5_hash(unsigned char hash[MD5_DIGEST_LENGTH],
-    char out[MD5_DIGEST_LENGTH * 2 + 1])
+/*
+ * Hashes are read in large chunks: the default BUFSIZ is far too small to
+ * keep the SHA-256 implementation busy.  Regular files above
+ * HASH_MMAP_THRESHOLD are mapped instead of being copied through a buffer.
+ */
+#define HASH_READ_BUFSIZ	(128 * 1024)
+#define HASH_MMAP_THRESHOLD	(HASH_READ_BUFSIZ * 4)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+void
+bin_to_hex(const unsigned char *in, size_t len, char *out)
 {
-	int i;
-	for (i = 0; i < MD5_DIGEST_LENGTH; i++)
-		sprintf(out + (i *2), "%02x", hash[i]);
+	size_t i;
 
-	out[MD5_DIGEST_LENGTH * 2] = '\0';
+	for (i = 0; i < len; i++) {
+		out[i * 2] = hex_digits[in[i] >> 4];
+		out[i * 2 + 1] = hex_digits[in[i] & 0x0f];
+	}
+
+	out[len * 2] = '\0';
 }
 
 int
@@ -334,22 +347,11 @@ md5_file(const char *path, char out[MD5_DIGEST_LENGTH * 2 + 1])
 	fclose(fp);
 
 	MD5_Final(hash, &md5);
-	md5_hash(hash, out);
+	bin_to_hex(hash, MD5_DIGEST_LENGTH, out);
 
 	return (EPKG_OK);
 }
 
-static void
-sha256_hash(unsigned char hash[SHA256_DIGEST_LENGTH],
-    char out[SHA256_DIGEST_LENGTH * 2 + 1])
-{
-	int i;
-	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
-		sprintf(out + (i * 2), "%02x", hash[i]);
-
-	out[SHA256_DIGEST_LENGTH * 2] = '\0';
-}
-
 int
 sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
@@ -357,7 +359,7 @@ sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 	int ret;
 
 	if ((fd = open(path, O_RDONLY)) == -1) {
-		pkg_emit_errno("fopen", path);
+		pkg_emit_errno("open", path);
 		return (EPKG_FATAL);
 	}
 
@@ -369,16 +371,16 @@ sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 }
 
 void
-sha256_buf(char *buf, size_t len, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+sha256_buf(const char *buf, size_t len, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
 	unsigned char hash[SHA256_DIGEST_LENGTH];
+
 	sha256_buf_bin(buf, len, hash);
-	out[0] = '\0';
-	sha256_hash(hash, out);
+	bin_to_hex(hash, SHA256_DIGEST_LENGTH, out);
 }
 
 void
-sha256_buf_bin(char *buf, size_t len, char hash[SHA256_DIGEST_LENGTH])
+sha256_buf_bin(const char *buf, size_t len, char hash[SHA256_DIGEST_LENGTH])
 {
 	SHA256_CTX sha256;
 
@@ -387,54 +389,126 @@ sha256_buf_bin(char *buf, size_t len, char hash[SHA256_DIGEST_LENGTH])
 	SHA256_Final(hash, &sha256);
 }
 
-int
-sha256_fd(int fd, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+/*
+ * Hash the whole content of fd, whatever its current offset is.  The file
+ * offset is left untouched: seekable descriptors are read with pread(2) or
+ * mapped, only pipes and the like are consumed with read(2).
+ */
+static int
+sha256_fd_hash(int fd, unsigned char hash[SHA256_DIGEST_LENGTH],
+    const char **failed)
 {
-	int my_fd = -1;
-	FILE *fp = NULL;
-	char buffer[BUFSIZ];
-	unsigned char hash[SHA256_DIGEST_LENGTH];
-	size_t r = 0;
-	int ret = EPKG_OK;
+	struct stat st;
 	SHA256_CTX sha256;
+	unsigned char *buffer, *map;
+	ssize_t r;
+	off_t off = 0;
+	bool seekable = true;
 
-	out[0] = '\0';
+	SHA256_Init(&sha256);
 
-	/* Duplicate the fd so that fclose(3) does not close it. */
-	if ((my_fd = dup(fd)) == -1) {
-		pkg_emit_errno("dup", "");
-		ret = EPKG_FATAL;
-		goto cleanup;
+	if (fstat(fd, &st) == -1) {
+		*failed = "fstat";
+		return (errno);
 	}
 
-	if ((fp = fdopen(my_fd, "rb")) == NULL) {
-		pkg_emit_errno("fdopen", "");
-		ret = EPKG_FATAL;
-		goto cleanup;
+	if (S_ISREG(st.st_mode) && st.st_size >= HASH_MMAP_THRESHOLD) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+			SHA256_Update(&sha256, map, st.st_size);
+			munmap(map, st.st_size);
+			SHA256_Final(hash, &sha256);
+			return (0);
+		}
+		/* Fall back on reading the file */
 	}
 
-	SHA256_Init(&sha256);
+	if ((buffer = malloc(HASH_READ_BUFSIZ)) == NULL) {
+		*failed = "malloc";
+		return (errno);
+	}
 
-	while ((r = fread(buffer, 1, BUFSIZ, fp)) > 0)
+	for (;;) {
+		if (seekable) {
+			r = pread(fd, buffer, HASH_READ_BUFSIZ, off);
+			if (r == -1 && errno == ESPIPE) {
+				seekable = false;
+				continue;
+			}
+		} else {
+			r = read(fd, buffer, HASH_READ_BUFSIZ);
+		}
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
 		SHA256_Update(&sha256, buffer, r);
+		off += r;
+	}
 
-	if (ferror(fp) != 0) {
-		pkg_emit_errno("fread", "");
-		ret = EPKG_FATAL;
-		goto cleanup;
+	if (r == -1) {
+		*failed = "read";
+		r = errno;
+		free(buffer);
+		return (r);
 	}
+	free(buffer);
 
 	SHA256_Final(hash, &sha256);
-	sha256_hash(hash, out);
-cleanup:
 
-	if (fp != NULL)
-		fclose(fp);
-	else if (my_fd != -1)
-		close(my_fd);
-	(void)lseek(fd, 0, SEEK_SET);
+	return (0);
+}
 
-	return (ret);
+int
+sha256_fd_bin(int fd, unsigned char hash[SHA256_DIGEST_LENGTH])
+{
+	const char *failed;
+	int error;
+
+	if ((error = sha256_fd_hash(fd, hash, &failed)) != 0) {
+		errno = error;
+		pkg_emit_errno(failed, "");
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+int
+sha256_fd(int fd, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+
+	out[0] = '\0';
+
+	if (sha256_fd_bin(fd, hash) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	bin_to_hex(hash, SHA256_DIGEST_LENGTH, out);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Same as sha256_fd() but without emitting any event, so that it can run
+ * outside of the main thread: returns 0 or the errno of the failure.
+ */
+int
+sha256_fd_quiet(int fd, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	const char *failed;
+	int error;
+
+	out[0] = '\0';
+
+	if ((error = sha256_fd_hash(fd, hash, &failed)) != 0)
+		return (error);
+
+	bin_to_hex(hash, SHA256_DIGEST_LENGTH, out);
+
+	return (0);
 }
 
 int
@@ -29,6 +29,8 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
 
 #define _WITH_GETLINE
 
@@ -37,11 +39,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sysexits.h>
+#include <ucl.h>
 #include <utlist.h>
 
 #include <expat.h>
@@ -115,21 +120,81 @@ struct audit_entry_sorted {
 };
 
 /*
- * Another small optimization to skip the beginning of the
- * VuXML entry array, if possible.
+ * The compiled database.
  *
- * audit_entry_first_byte_idx[ch] represents the index
- * of the first VuXML entry in the sorted array that has
- * its non-globbing prefix that is started with the character
- * 'ch'.  It allows to skip entries from the beginning of the
- * VuXML array that aren't relevant for the checked port name.
+ * Parsing vuln.xml dominates the run time of pkg audit, so once parsed
+ * and sorted, the entries are flattened in a single buffer which is saved
+ * next to the XML file (vuln.xml.idx) and mapped as is by the next runs,
+ * as long as the XML file keeps the same mtime and size.
+ *
+ * Layout: header, sorted entries, version ranges, CVE names then the
+ * string table.  Strings are referenced by their offset in the string
+ * table, offset 0 meaning "no string".
  */
-static size_t audit_entry_first_byte_idx[256];
+#define AUDIT_DB_MAGIC		"PKGAUDIT"
+#define AUDIT_DB_VERSION	1
+
+struct audit_db_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nentries;
+	uint32_t nranges;
+	uint32_t ncves;
+	uint32_t strtab_len;
+	uint32_t pad;
+	int64_t src_mtime;
+	int64_t src_size;
+	/*
+	 * first_byte_idx[ch] represents the index of the first VuXML entry
+	 * in the sorted array that has its non-globbing prefix that is
+	 * started with the character 'ch'.  It allows to skip entries from
+	 * the beginning of the VuXML array that aren't relevant for the
+	 * checked port name.
+	 */
+	uint32_t first_byte_idx[256];
+};
+
+struct audit_db_entry {
+	uint32_t pkgname;
+	uint32_t desc;
+	uint32_t id;
+	uint32_t url;
+	uint32_t noglob_len;
+	uint32_t next_pfx_incr;
+	uint32_t ranges;	/* First range in the range array */
+	uint32_t nranges;
+	uint32_t cves;		/* First name in the CVE array */
+	uint32_t ncves;
+};
+
+struct audit_db_range {
+	uint32_t v1;
+	uint32_t type1;
+	uint32_t v2;
+	uint32_t type2;
+};
+
+struct audit_db {
+	char *buf;
+	size_t len;
+	bool mapped;
+	const struct audit_db_header *hdr;
+	const struct audit_db_entry *entries;
+	const struct audit_db_range *ranges;
+	const uint32_t *cves;
+	const char *strtab;
+	/* Parsed bounds of the ranges, two per range, filled on first use */
+	struct pkg_version_key **keys;
+};
+
+#define AUDIT_DB_STR(db, off)	((off) == 0 ? NULL : (db)->strtab + (off))
 
 void
 usage_audit(void)
 {
-	fprintf(stderr, "Usage: pkg audit [-Fq] <pattern>\n\n");
+	fprintf(stderr, "Usage: pkg audit [-Fq] [-f file] <pattern>\n");
+	fprintf(stderr, "       pkg audit [-F] [-f file] [-R format] "
+	    "[-r rootdir ...]\n\n");
 	fprintf(stderr, "For more information see 'pkg help audit'.\n");
 }
 
@@ -514,7 +579,7 @@ audit_entry_compare(const void *a, const void *b)
  * next distinct prefix.
  */
 static struct audit_entry_sorted *
-preprocess_db(struct audit_entry *h)
+preprocess_db(struct audit_entry *h, uint32_t first_byte_idx[256])
 {
 	struct audit_entry *e;
 	struct audit_entry_sorted *ret;
@@ -566,19 +631,359 @@ preprocess_db(struct audit_entry *h)
 	}
 
 	/* Calculate jump indexes for the first byte of the package name */
-	bzero(audit_entry_first_byte_idx, sizeof(audit_entry_first_byte_idx));
+	first_byte_idx[0] = 0;
 	for (n = 1, i = 0; n < 256; n++) {
 		while (ret[i].e != NULL &&
-		    (size_t)(ret[i].e->pkgname[0]) < n)
+		    (unsigned char)(ret[i].e->pkgname[0]) < n)
 			i++;
-		audit_entry_first_byte_idx[n] = i;
+		first_byte_idx[n] = i;
 	}
 
 	return (ret);
 }
 
+static uint32_t
+audit_db_add_str(struct sbuf *strtab, const char *str)
+{
+	uint32_t off;
+
+	if (str == NULL)
+		return (0);
+
+	off = sbuf_len(strtab);
+	sbuf_bcat(strtab, str, strlen(str) + 1);
+
+	return (off);
+}
+
+/*
+ * Flatten the parsed entries into the compiled database format.
+ */
+static int
+audit_db_compile(struct audit_entry *h, struct stat *src, char **out,
+    size_t *outlen)
+{
+	struct audit_entry_sorted *sorted;
+	struct audit_db_header hdr;
+	struct audit_db_entry *entries = NULL;
+	struct audit_db_range *ranges = NULL;
+	uint32_t *cves = NULL;
+	struct audit_versions *vers;
+	struct audit_cve *cve;
+	struct sbuf *strtab;
+	size_t n, nranges = 0, ncves = 0, len;
+	char *buf, *p;
+
+	memset(&hdr, 0, sizeof(hdr));
+	sorted = preprocess_db(h, hdr.first_byte_idx);
+
+	for (n = 0; sorted[n].e != NULL; n++) {
+		LL_FOREACH(sorted[n].e->versions, vers)
+			nranges++;
+		LL_FOREACH(sorted[n].e->cve, cve)
+			ncves++;
+	}
+
+	entries = calloc(n, sizeof(*entries));
+	ranges = calloc(nranges, sizeof(*ranges));
+	cves = calloc(ncves, sizeof(*cves));
+	strtab = sbuf_new_auto();
+	if ((n > 0 && entries == NULL) || (nranges > 0 && ranges == NULL) ||
+	    (ncves > 0 && cves == NULL) || strtab == NULL)
+		err(1, "calloc(audit_db)");
+
+	/* Offset 0 is the NULL string */
+	sbuf_putc(strtab, '\0');
+
+	memcpy(hdr.magic, AUDIT_DB_MAGIC, sizeof(hdr.magic));
+	hdr.version = AUDIT_DB_VERSION;
+	hdr.nentries = n;
+	hdr.nranges = nranges;
+	hdr.ncves = ncves;
+	hdr.src_mtime = src->st_mtime;
+	hdr.src_size = src->st_size;
+
+	nranges = ncves = 0;
+	for (n = 0; sorted[n].e != NULL; n++) {
+		struct audit_entry *e = sorted[n].e;
+
+		entries[n].pkgname = audit_db_add_str(strtab, e->pkgname);
+		entries[n].desc = audit_db_add_str(strtab, e->desc);
+		entries[n].id = audit_db_add_str(strtab, e->id);
+		entries[n].url = audit_db_add_str(strtab, e->url);
+		entries[n].noglob_len = sorted[n].noglob_len;
+		entries[n].next_pfx_incr = sorted[n].next_pfx_incr;
+		entries[n].ranges = nranges;
+		LL_FOREACH(e->versions, vers) {
+			ranges[nranges].v1 = audit_db_add_str(strtab,
+			    vers->v1.version);
+			ranges[nranges].type1 = vers->v1.type;
+			ranges[nranges].v2 = audit_db_add_str(strtab,
+			    vers->v2.version);
+			ranges[nranges].type2 = vers->v2.type;
+			nranges++;
+		}
+		entries[n].nranges = nranges - entries[n].ranges;
+		entries[n].cves = ncves;
+		LL_FOREACH(e->cve, cve)
+			cves[ncves++] = audit_db_add_str(strtab, cve->cvename);
+		entries[n].ncves = ncves - entries[n].cves;
+	}
+	free(sorted);
+
+	sbuf_finish(strtab);
+	hdr.strtab_len = sbuf_len(strtab);
+
+	len = sizeof(hdr) + n * sizeof(*entries) + nranges * sizeof(*ranges) +
+	    ncves * sizeof(*cves) + hdr.strtab_len;
+	if ((buf = malloc(len)) == NULL)
+		err(1, "malloc(audit_db)");
+
+	p = buf;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	memcpy(p, entries, n * sizeof(*entries));
+	p += n * sizeof(*entries);
+	memcpy(p, ranges, nranges * sizeof(*ranges));
+	p += nranges * sizeof(*ranges);
+	memcpy(p, cves, ncves * sizeof(*cves));
+	p += ncves * sizeof(*cves);
+	memcpy(p, sbuf_data(strtab), hdr.strtab_len);
+
+	free(entries);
+	free(ranges);
+	free(cves);
+	sbuf_delete(strtab);
+
+	*out = buf;
+	*outlen = len;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Set up the database view over a compiled buffer, checking that it is
+ * consistent so that a corrupted index is never trusted.
+ */
+static int
+audit_db_open_buf(struct audit_db *db, char *buf, size_t len, bool mapped)
+{
+	const struct audit_db_header *hdr = (const struct audit_db_header *)buf;
+	const struct audit_db_entry *e;
+	const struct audit_db_range *r;
+	size_t expected, i;
+
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, AUDIT_DB_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != AUDIT_DB_VERSION)
+		return (EPKG_FATAL);
+
+	expected = sizeof(*hdr) +
+	    (size_t)hdr->nentries * sizeof(struct audit_db_entry) +
+	    (size_t)hdr->nranges * sizeof(struct audit_db_range) +
+	    (size_t)hdr->ncves * sizeof(uint32_t) + hdr->strtab_len;
+	if (len != expected || hdr->strtab_len == 0)
+		return (EPKG_FATAL);
+
+	db->buf = buf;
+	db->len = len;
+	db->mapped = mapped;
+	db->hdr = hdr;
+	db->entries = (const struct audit_db_entry *)(hdr + 1);
+	db->ranges = (const struct audit_db_range *)
+	    (db->entries + hdr->nentries);
+	db->cves = (const uint32_t *)(db->ranges + hdr->nranges);
+	db->strtab = (const char *)(db->cves + hdr->ncves);
+
+	if (db->strtab[hdr->strtab_len - 1] != '\0')
+		return (EPKG_FATAL);
+
+	for (i = 0; i < 256; i++)
+		if (hdr->first_byte_idx[i] > hdr->nentries)
+			return (EPKG_FATAL);
+
+#define CHECK_STR(off)	if ((off) >= hdr->strtab_len) return (EPKG_FATAL)
+	for (i = 0; i < hdr->nentries; i++) {
+		e = &db->entries[i];
+		if (e->pkgname == 0 || e->next_pfx_incr == 0 ||
+		    i + e->next_pfx_incr > hdr->nentries ||
+		    e->ranges + e->nranges > hdr->nranges ||
+		    e->cves + e->ncves > hdr->ncves)
+			return (EPKG_FATAL);
+		CHECK_STR(e->pkgname);
+		CHECK_STR(e->desc);
+		CHECK_STR(e->id);
+		CHECK_STR(e->url);
+	}
+	for (i = 0; i < hdr->nranges; i++) {
+		r = &db->ranges[i];
+		CHECK_STR(r->v1);
+		CHECK_STR(r->v2);
+	}
+	for (i = 0; i < hdr->ncves; i++)
+		CHECK_STR(db->cves[i]);
+#undef CHECK_STR
+
+	return (EPKG_OK);
+}
+
+static void
+audit_db_free(struct audit_db *db)
+{
+	size_t i;
+
+	if (db->buf == NULL)
+		return;
+
+	if (db->keys != NULL) {
+		for (i = 0; i < 2 * (size_t)db->hdr->nranges; i++)
+			pkg_version_key_free(db->keys[i]);
+		free(db->keys);
+		db->keys = NULL;
+	}
+
+	if (db->mapped)
+		munmap(db->buf, db->len);
+	else
+		free(db->buf);
+	db->buf = NULL;
+}
+
+/*
+ * Map the compiled database if it is still in sync with the XML file.
+ */
+static int
+audit_db_open_index(const char *idxpath, struct stat *src, struct audit_db *db)
+{
+	struct stat st;
+	char *map;
+	int fd;
+
+	if ((fd = open(idxpath, O_RDONLY)) == -1)
+		return (EPKG_FATAL);
+
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct audit_db_header)) {
+		close(fd);
+		return (EPKG_FATAL);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (EPKG_FATAL);
+
+	if (audit_db_open_buf(db, map, st.st_size, true) != EPKG_OK ||
+	    db->hdr->src_mtime != (int64_t)src->st_mtime ||
+	    db->hdr->src_size != (int64_t)src->st_size) {
+		munmap(map, st.st_size);
+		db->buf = NULL;
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Save the compiled database, failing silently: an unprivileged user
+ * auditing the system database simply does not get the cache.
+ */
+static void
+audit_db_write_index(const char *idxpath, const char *buf, size_t len)
+{
+	char tmp[MAXPATHLEN];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", idxpath) >= (int)sizeof(tmp))
+		return;
+
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+
+	if (write(fd, buf, len) != (ssize_t)len ||
+	    fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH) == -1) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp, idxpath) == -1)
+		unlink(tmp);
+}
+
+static void free_audit_list(struct audit_entry *h);
+
+/*
+ * Load the vulnerability database: from the compiled index when it is up
+ * to date, otherwise from the XML file, refreshing the index.
+ */
+static int
+audit_db_load(const char *path, struct audit_db *db)
+{
+	struct audit_entry *h = NULL;
+	struct stat st;
+	char idxpath[MAXPATHLEN];
+	char *buf;
+	size_t len;
+	int ret;
+
+	memset(db, 0, sizeof(*db));
+
+	if (stat(path, &st) == -1)
+		return (EPKG_FATAL);
+
+	snprintf(idxpath, sizeof(idxpath), "%s.idx", path);
+	if (audit_db_open_index(idxpath, &st, db) != EPKG_OK) {
+		if ((ret = parse_db_vulnxml(path, &h)) != EPKG_OK)
+			return (ret);
+
+		audit_db_compile(h, &st, &buf, &len);
+		free_audit_list(h);
+
+		if (audit_db_open_buf(db, buf, len, false) != EPKG_OK) {
+			free(buf);
+			db->buf = NULL;
+			return (EPKG_FATAL);
+		}
+
+		audit_db_write_index(idxpath, buf, len);
+	}
+
+	db->keys = calloc(2 * (size_t)db->hdr->nranges, sizeof(*db->keys));
+	if (db->keys == NULL && db->hdr->nranges > 0) {
+		warn("calloc");
+		audit_db_free(db);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Version bounds are parsed the first time a package name matches their
+ * entry, so each of them is parsed at most once per run however many
+ * installed packages get compared against it.  *key is set to NULL when
+ * the range has no such bound.
+ */
+static int
+audit_db_version_key(const struct audit_db *db, size_t idx, uint32_t off,
+    const struct pkg_version_key **key)
+{
+	*key = NULL;
+	if (off == 0)
+		return (EPKG_OK);
+
+	if (db->keys[idx] == NULL &&
+	    pkg_version_key_new(&db->keys[idx], db->strtab + off) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	*key = db->keys[idx];
+	return (EPKG_OK);
+}
+
 static bool
-match_version(const char *pkgversion, struct version_entry *v)
+match_version(const struct pkg_version_key *pkgversion,
+    const struct pkg_version_key *version, int type)
 {
 	bool res = false;
 
@@ -586,93 +991,468 @@ match_version(const char *pkgversion, struct version_entry *v)
 	 * Return true so it is easier for the caller to handle case where there is
 	 * only one version to match: the missing one will always match.
 	 */
-	if (v->version == NULL)
+	if (version == NULL)
 		return true;
 
-	switch (pkg_version_cmp(pkgversion, v->version)) {
+	switch (pkg_version_key_cmp(pkgversion, version)) {
 	case -1:
-		if (v->type == LT || v->type == LTE)
+		if (type == LT || type == LTE)
 			res = true;
 		break;
 	case 0:
-		if (v->type == EQ || v->type == LTE || v->type == GTE)
+		if (type == EQ || type == LTE || type == GTE)
 			res = true;
 		break;
 	case 1:
-		if (v->type == GT || v->type == GTE)
+		if (type == GT || type == GTE)
 			res = true;
 		break;
 	}
 	return res;
 }
 
-static bool
-is_vulnerable(struct audit_entry_sorted *a, struct pkg *pkg)
-{
-	struct audit_entry *e;
-	struct audit_versions *vers;
-	struct audit_cve *cve;
-	const char *pkgname;
-	const char *pkgversion;
-	bool res = false, res1, res2;
-
-	pkg_get(pkg,
-		PKG_NAME, &pkgname,
-		PKG_VERSION, &pkgversion
-	);
+/*
+ * Call cb for each vulnerability entry affecting the given package, once
+ * per entry. The walk stops as soon as cb returns false.  Returns EPKG_OK
+ * when the package is vulnerable, EPKG_END when it is not and EPKG_FATAL
+ * when a version could not be parsed.
+ */
+typedef bool (*audit_match_cb)(const struct audit_db *,
+    const struct audit_db_entry *, const char *, const char *, void *);
 
-	a += audit_entry_first_byte_idx[(size_t)pkgname[0]];
-	for (; (e = a->e) != NULL; a += a->next_pfx_incr) {
+static int
+audit_db_match(const struct audit_db *db, const char *pkgname,
+    const char *pkgversion, audit_match_cb cb, void *data)
+{
+	const struct audit_db_entry *a, *e;
+	const struct audit_db_range *r;
+	const struct pkg_version_key *v1, *v2;
+	struct pkg_version_key *pkgkey = NULL;
+	int res = EPKG_END;
+	size_t n, k, idx;
+
+	n = db->hdr->first_byte_idx[(unsigned char)pkgname[0]];
+	for (; n < db->hdr->nentries; n += a->next_pfx_incr) {
 		int cmp;
 		size_t i;
 
+		a = &db->entries[n];
 		/*
 		 * Audit entries are sorted, so if we had found one
 		 * that is lexicographically greater than our name,
 		 * it and the rest won't match our name.
 		 */
-		cmp = strncmp(pkgname, e->pkgname, a->noglob_len);
+		cmp = strncmp(pkgname, db->strtab + a->pkgname,
+		    a->noglob_len);
 		if (cmp > 0)
 			continue;
 		else if (cmp < 0)
 			break;
 
 		for (i = 0; i < a->next_pfx_incr; i++) {
-			e = a[i].e;
-			if (fnmatch(e->pkgname, pkgname, 0) != 0)
+			e = &a[i];
+			if (fnmatch(db->strtab + e->pkgname, pkgname, 0) != 0)
 				continue;
 
-			LL_FOREACH(e->versions, vers) {
-				res1 = match_version(pkgversion, &vers->v1);
-				res2 = match_version(pkgversion, &vers->v2);
-				if (res1 && res2) {
-					res = true;
-					if (quiet) {
-						printf("%s-%s\n", pkgname, pkgversion);
-						return res; /* avoid reporting the same pkg multiple times */
-					} else {
-						printf("%s-%s is vulnerable:\n", pkgname, pkgversion);
-						printf("%s\n", e->desc);
-						/* XXX: for vulnxml we should use more clever approach indeed */
-						if (e->cve) {
-							cve = e->cve;
-							while (cve) {
-								printf("CVE: %s\n", cve->cvename);
-								cve = cve->next;
-							}
-						}
-						if (e->url)
-							printf("WWW: %s\n\n", e->url);
-						else if (e->id)
-							printf("WWW: http://portaudit.FreeBSD.org/%s.html\n\n", e->id);
-					}
+			if (pkgkey == NULL &&
+			    pkg_version_key_new(&pkgkey, pkgversion) != EPKG_OK)
+				return (EPKG_FATAL);
+
+			for (k = 0; k < e->nranges; k++) {
+				idx = e->ranges + k;
+				r = &db->ranges[idx];
+				/* a bound we failed to parse must not match */
+				if (audit_db_version_key(db, 2 * idx, r->v1,
+				    &v1) != EPKG_OK ||
+				    audit_db_version_key(db, 2 * idx + 1, r->v2,
+				    &v2) != EPKG_OK) {
+					res = EPKG_FATAL;
+					goto out;
+				}
+				if (match_version(pkgkey, v1, r->type1) &&
+				    match_version(pkgkey, v2, r->type2)) {
+					res = EPKG_OK;
+					if (!cb(db, e, pkgname, pkgversion, data))
+						goto out;
 					break;
 				}
 			}
 		}
 	}
 
-	return res;
+out:
+	pkg_version_key_free(pkgkey);
+
+	return (res);
+}
+
+static bool
+print_vulnerable(const struct audit_db *db, const struct audit_db_entry *e,
+    const char *pkgname, const char *pkgversion, __unused void *data)
+{
+	const char *url, *id;
+	size_t c;
+
+	if (quiet) {
+		printf("%s-%s\n", pkgname, pkgversion);
+		return (false); /* avoid reporting the same pkg multiple times */
+	}
+
+	printf("%s-%s is vulnerable:\n", pkgname, pkgversion);
+	printf("%s\n", AUDIT_DB_STR(db, e->desc));
+	/* XXX: for vulnxml we should use more clever approach indeed */
+	for (c = 0; c < e->ncves; c++)
+		printf("CVE: %s\n", AUDIT_DB_STR(db, db->cves[e->cves + c]));
+	url = AUDIT_DB_STR(db, e->url);
+	id = AUDIT_DB_STR(db, e->id);
+	if (url)
+		printf("WWW: %s\n\n", url);
+	else if (id)
+		printf("WWW: http://portaudit.FreeBSD.org/%s.html\n\n", id);
+
+	return (true);
+}
+
+static int
+is_vulnerable(const struct audit_db *db, struct pkg *pkg)
+{
+	const char *pkgname;
+	const char *pkgversion;
+
+	pkg_get(pkg,
+		PKG_NAME, &pkgname,
+		PKG_VERSION, &pkgversion
+	);
+
+	return (audit_db_match(db, pkgname, pkgversion, print_vulnerable, NULL));
+}
+
+/*
+ * Batch mode: every root is audited by its own child process, which
+ * shares the read-only vulnerability database with its siblings, and
+ * reports the entries affecting its packages back through a pipe.
+ */
+struct audit_job {
+	const char *root;
+	pid_t pid;
+	int fd;
+	int status;
+	struct sbuf *out;
+};
+
+static bool
+report_vulnerable(const struct audit_db *db, const struct audit_db_entry *e,
+    const char *pkgname, const char *pkgversion, void *data)
+{
+	FILE *out = data;
+
+	fprintf(out, "%s\t%s\t%zu\n", pkgname, pkgversion,
+	    (size_t)(e - db->entries));
+
+	return (true);
+}
+
+/*
+ * Runs in the child: audit the packages registered under root, or in the
+ * local package database when root is NULL.
+ */
+static int
+audit_root(const struct audit_db *audit_db, const char *root, int fd)
+{
+	struct pkgdb *db = NULL;
+	struct pkgdb_it *it = NULL;
+	struct pkg *pkg = NULL;
+	const char *pkgname, *pkgversion;
+	FILE *out;
+	int ret;
+
+	if ((out = fdopen(fd, "w")) == NULL) {
+		warn("fdopen");
+		return (EX_OSERR);
+	}
+
+	if (root != NULL && (chroot(root) == -1 || chdir("/") == -1)) {
+		warn("chroot(%s)", root);
+		fclose(out);
+		return (EX_OSERR);
+	}
+
+	ret = pkgdb_access(PKGDB_MODE_READ, PKGDB_DB_LOCAL);
+	if (ret == EPKG_ENODB) {
+		fclose(out);
+		return (EX_OK);
+	} else if (ret == EPKG_ENOACCESS) {
+		warnx("%s: Insufficient privileges to read the package "
+		    "database", root != NULL ? root : "/");
+		fclose(out);
+		return (EX_NOPERM);
+	} else if (ret != EPKG_OK ||
+	    pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK) {
+		warnx("%s: Error accessing the package database",
+		    root != NULL ? root : "/");
+		fclose(out);
+		return (EX_IOERR);
+	}
+
+	if (pkgdb_obtain_lock(db, PKGDB_LOCK_READONLY, 0, 0) != EPKG_OK) {
+		pkgdb_close(db);
+		warnx("%s: Cannot get a read lock on a database, it is locked "
+		    "by another process", root != NULL ? root : "/");
+		fclose(out);
+		return (EX_TEMPFAIL);
+	}
+
+	ret = EX_IOERR;
+	if ((it = pkgdb_query(db, NULL, MATCH_ALL)) != NULL) {
+		while ((ret = pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC)) ==
+		    EPKG_OK) {
+			pkg_get(pkg,
+				PKG_NAME, &pkgname,
+				PKG_VERSION, &pkgversion
+			);
+			if (audit_db_match(audit_db, pkgname, pkgversion,
+			    report_vulnerable, out) == EPKG_FATAL)
+				break;
+		}
+		if (ret == EPKG_OK)	/* audit_db_match() failed */
+			ret = EX_OSERR;
+		else
+			ret = (ret == EPKG_END ? EX_OK : EX_IOERR);
+	}
+
+	pkgdb_it_free(it);
+	pkg_free(pkg);
+	pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
+	pkgdb_close(db);
+	if (fclose(out) != 0)
+		ret = EX_IOERR;
+
+	return (ret);
+}
+
+static int
+audit_job_start(const struct audit_db *db, struct audit_job *job)
+{
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		return (EPKG_FATAL);
+	}
+
+	/* Anything buffered would otherwise be written twice */
+	fflush(stdout);
+	fflush(stderr);
+
+	switch (job->pid = fork()) {
+	case -1:
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return (EPKG_FATAL);
+	case 0:
+		close(fds[0]);
+		_exit(audit_root(db, job->root, fds[1]));
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(fds[1]);
+	job->fd = fds[0];
+	job->out = sbuf_new_auto();
+
+	return (EPKG_OK);
+}
+
+static ucl_object_t *
+audit_entry_to_ucl(const struct audit_db *db, const struct audit_db_entry *e)
+{
+	ucl_object_t *obj, *cves;
+	const char *str;
+	size_t c;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	if ((str = AUDIT_DB_STR(db, e->id)) != NULL)
+		ucl_object_insert_key(obj, ucl_object_fromstring(str),
+		    "id", 0, false);
+	if ((str = AUDIT_DB_STR(db, e->desc)) != NULL)
+		ucl_object_insert_key(obj, ucl_object_fromstring(str),
+		    "description", 0, false);
+	if ((str = AUDIT_DB_STR(db, e->url)) != NULL)
+		ucl_object_insert_key(obj, ucl_object_fromstring(str),
+		    "url", 0, false);
+	if (e->ncves > 0) {
+		cves = ucl_object_typed_new(UCL_ARRAY);
+		for (c = 0; c < e->ncves; c++)
+			ucl_array_append(cves, ucl_object_fromstring(
+			    AUDIT_DB_STR(db, db->cves[e->cves + c])));
+		ucl_object_insert_key(obj, cves, "cve", 0, false);
+	}
+
+	return (obj);
+}
+
+/*
+ * Turn the lines reported by a child into
+ * { vulnerable: <count>, packages: { <name>-<version>: [ <entries> ] } }.
+ * The entries of a package are reported one after the other.
+ */
+static ucl_object_t *
+audit_job_to_ucl(const struct audit_db *db, struct audit_job *job,
+    unsigned int *vuln)
+{
+	ucl_object_t *obj, *pkgs, *entries = NULL;
+	char *line, *next, *name, *version, *idx, *end;
+	char key[BUFSIZ], prev[BUFSIZ];
+	unsigned long n;
+	int64_t count = 0;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	pkgs = ucl_object_typed_new(UCL_OBJECT);
+	prev[0] = '\0';
+
+	sbuf_finish(job->out);
+	next = sbuf_data(job->out);
+	while ((line = strsep(&next, "\n")) != NULL) {
+		name = line;
+		if ((version = strchr(name, '\t')) == NULL)
+			continue;
+		*version++ = '\0';
+		if ((idx = strchr(version, '\t')) == NULL)
+			continue;
+		*idx++ = '\0';
+		n = strtoul(idx, &end, 10);
+		if (*end != '\0' || n >= db->hdr->nentries)
+			continue;
+
+		snprintf(key, sizeof(key), "%s-%s", name, version);
+		if (entries == NULL || strcmp(key, prev) != 0) {
+			entries = ucl_object_typed_new(UCL_ARRAY);
+			ucl_object_insert_key(pkgs, entries, key, 0, true);
+			strlcpy(prev, key, sizeof(prev));
+			count++;
+		}
+		ucl_array_append(entries, audit_entry_to_ucl(db,
+		    &db->entries[n]));
+	}
+
+	ucl_object_insert_key(obj, ucl_object_fromint(count), "vulnerable",
+	    0, false);
+	ucl_object_insert_key(obj, pkgs, "packages", 0, false);
+	*vuln += count;
+
+	return (obj);
+}
+
+static int
+audit_batch(const struct audit_db *db, const char **roots, int nroots,
+    enum ucl_emitter format)
+{
+	struct audit_job *jobs;
+	struct pollfd *pfd;
+	ucl_object_t *top;
+	unsigned char *emitted;
+	char buf[BUFSIZ];
+	unsigned int vuln = 0;
+	int *polled;
+	int maxjobs, next = 0, running = 0, npfd, i, ret = EX_OK;
+	size_t len;
+	ssize_t r;
+
+	len = sizeof(maxjobs);
+	if (sysctlbyname("hw.ncpu", &maxjobs, &len, NULL, 0) == -1 ||
+	    maxjobs < 1)
+		maxjobs = 1;
+
+	jobs = calloc(nroots, sizeof(struct audit_job));
+	pfd = calloc(nroots, sizeof(struct pollfd));
+	polled = calloc(nroots, sizeof(int));
+	if (jobs == NULL || pfd == NULL || polled == NULL)
+		err(EX_OSERR, "calloc");
+
+	for (i = 0; i < nroots; i++) {
+		jobs[i].root = roots[i];
+		jobs[i].fd = -1;
+		jobs[i].status = -1;
+	}
+
+	while (next < nroots || running > 0) {
+		while (next < nroots && running < maxjobs) {
+			if (audit_job_start(db, &jobs[next]) == EPKG_OK)
+				running++;
+			next++;
+		}
+		if (running == 0)
+			continue;
+
+		npfd = 0;
+		for (i = 0; i < next; i++) {
+			if (jobs[i].fd == -1)
+				continue;
+			pfd[npfd].fd = jobs[i].fd;
+			pfd[npfd].events = POLLIN;
+			polled[npfd++] = i;
+		}
+
+		if (poll(pfd, npfd, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll");
+		}
+
+		for (i = 0; i < npfd; i++) {
+			struct audit_job *job = &jobs[polled[i]];
+
+			if (pfd[i].revents == 0)
+				continue;
+			r = read(job->fd, buf, sizeof(buf));
+			if (r > 0) {
+				sbuf_bcat(job->out, buf, r);
+				continue;
+			}
+			if (r == -1 && errno == EINTR)
+				continue;
+			close(job->fd);
+			job->fd = -1;
+			while (waitpid(job->pid, &job->status, 0) == -1 &&
+			    errno == EINTR)
+				;
+			running--;
+		}
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	for (i = 0; i < nroots; i++) {
+		if (jobs[i].out == NULL || !WIFEXITED(jobs[i].status) ||
+		    WEXITSTATUS(jobs[i].status) != EX_OK) {
+			warnx("%s: audit failed", jobs[i].root != NULL ?
+			    jobs[i].root : "/");
+			ret = EX_IOERR;
+		} else {
+			ucl_object_insert_key(top,
+			    audit_job_to_ucl(db, &jobs[i], &vuln),
+			    jobs[i].root != NULL ? jobs[i].root : "/", 0, false);
+		}
+		if (jobs[i].out != NULL)
+			sbuf_delete(jobs[i].out);
+	}
+
+	emitted = ucl_object_emit(top, format);
+	if (emitted != NULL) {
+		printf("%s\n", emitted);
+		free(emitted);
+	}
+	ucl_object_unref(top);
+
+	free(jobs);
+	free(pfd);
+	free(polled);
+
+	if (ret == EX_OK && vuln > 0)
+		ret = EXIT_FAILURE;
+
+	return (ret);
 }
 
 static void
@@ -712,8 +1492,7 @@ free_audit_list(struct audit_entry *h)
 int
 exec_audit(int argc, char **argv)
 {
-	struct audit_entry		*h = NULL;
-	struct audit_entry_sorted	*cooked_audit_entries = NULL;
+	struct audit_db			 audit_db;
 	struct pkgdb			*db = NULL;
 	struct pkgdb_it			*it = NULL;
 	struct pkg			*pkg = NULL;
@@ -724,14 +1503,20 @@ exec_audit(int argc, char **argv)
 	char				*audit_file = audit_file_buf;
 	unsigned int			 vuln = 0;
 	bool				 fetch = false;
+	bool				 batch = false;
+	enum ucl_emitter		 format = UCL_EMIT_JSON_COMPACT;
+	const char			**roots = NULL;
+	const char			*local_root[1] = { NULL };
+	int				 nroots = 0;
 	int				 ch;
 	int				 ret = EX_OK, res;
 	const char			*portaudit_site = NULL;
 
+	memset(&audit_db, 0, sizeof(audit_db));
 	db_dir = pkg_object_string(pkg_config_get("PKG_DBDIR"));
 	snprintf(audit_file_buf, sizeof(audit_file_buf), "%s/vuln.xml", db_dir);
 
-	while ((ch = getopt(argc, argv, "qFf:")) != -1) {
+	while ((ch = getopt(argc, argv, "qFf:R:r:")) != -1) {
 		switch (ch) {
 		case 'q':
 			quiet = true;
@@ -742,24 +1527,73 @@ exec_audit(int argc, char **argv)
 		case 'f':
 			audit_file = optarg;
 			break;
+		case 'R':
+			batch = true;
+			if (strcasecmp(optarg, "json") == 0)
+				format = UCL_EMIT_JSON;
+			else if (strcasecmp(optarg, "json-compact") == 0)
+				format = UCL_EMIT_JSON_COMPACT;
+			else if (strcasecmp(optarg, "ucl") == 0)
+				format = UCL_EMIT_CONFIG;
+			else if (strcasecmp(optarg, "yaml") == 0)
+				format = UCL_EMIT_YAML;
+			else {
+				warnx("Invalid format '%s' for the raw output, "
+				    "expecting json, json-compact, ucl or yaml",
+				    optarg);
+				free(roots);
+				return (EX_USAGE);
+			}
+			break;
+		case 'r':
+			batch = true;
+			roots = reallocf(roots, (nroots + 1) * sizeof(*roots));
+			if (roots == NULL)
+				err(EX_OSERR, "realloc");
+			roots[nroots++] = optarg;
+			break;
 		default:
 			usage_audit();
+			free(roots);
 			return(EX_USAGE);
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
+	if (argc > 2 || (batch && argc > 0)) {
+		usage_audit();
+		free(roots);
+		return (EX_USAGE);
+	}
+
 	if (fetch == true) {
 		portaudit_site = pkg_object_string(pkg_config_get("VULNXML_SITE"));
 		if (fetch_and_extract(portaudit_site, audit_file) != EPKG_OK) {
+			free(roots);
 			return (EX_IOERR);
 		}
 	}
 
-	if (argc > 2) {
-		usage_audit();
-		return (EX_USAGE);
+	if (batch) {
+		if (audit_db_load(audit_file, &audit_db) != EPKG_OK) {
+			if (errno == ENOENT)
+				warnx("vulnxml file %s does not exist. "
+				      "Try running 'pkg audit -F' first",
+				      audit_file);
+			else
+				warn("unable to open vulnxml file %s",
+				     audit_file);
+			free(roots);
+			return (EX_DATAERR);
+		}
+		if (nroots == 0)
+			ret = audit_batch(&audit_db, local_root, 1, format);
+		else
+			ret = audit_batch(&audit_db, roots, nroots, format);
+		audit_db_free(&audit_db);
+		free(roots);
+		return (ret);
 	}
 
 	if (argc == 1) {
@@ -774,7 +1608,7 @@ exec_audit(int argc, char **argv)
 		pkg_set(pkg,
 		    PKG_NAME, name,
 		    PKG_VERSION, version);
-		res = parse_db_vulnxml(audit_file, &h);
+		res = audit_db_load(audit_file, &audit_db);
 		if (res != EPKG_OK) {
 			if (errno == ENOENT)
 				warnx("vulnxml file %s does not exist. "
@@ -786,8 +1620,8 @@ exec_audit(int argc, char **argv)
 			ret = EX_DATAERR;
 			goto cleanup;
 		}
-		cooked_audit_entries = preprocess_db(h);
-		is_vulnerable(cooked_audit_entries, pkg);
+		if (is_vulnerable(&audit_db, pkg) == EPKG_FATAL)
+			ret = EX_OSERR;
 		goto cleanup;
 	}
 
@@ -823,7 +1657,7 @@ exec_audit(int argc, char **argv)
 		goto cleanup;
 	}
 
-	res = parse_db_vulnxml(audit_file, &h);
+	res = audit_db_load(audit_file, &audit_db);
 	if (res != EPKG_OK) {
 		if (errno == ENOENT)
 			warnx("unable to open vulnxml file, try running 'pkg audit -F' first");
@@ -832,11 +1666,14 @@ exec_audit(int argc, char **argv)
 		ret = EX_DATAERR;
 		goto cleanup;
 	}
-	cooked_audit_entries = preprocess_db(h);
-
-	while ((ret = pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC)) == EPKG_OK)
-		if (is_vulnerable(cooked_audit_entries, pkg))
+	while ((ret = pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC)) == EPKG_OK) {
+		if ((res = is_vulnerable(&audit_db, pkg)) == EPKG_FATAL) {
+			ret = EX_OSERR;
+			goto cleanup;
+		}
+		if (res == EPKG_OK)
 			vuln++;
+	}
 
 	if (ret == EPKG_END && vuln == 0)
 		ret = EX_OK;
@@ -850,7 +1687,7 @@ cleanup:
 		pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
 	pkgdb_close(db);
 	pkg_free(pkg);
-	free_audit_list(h);
+	audit_db_free(&audit_db);
 
 	return (ret);
 }
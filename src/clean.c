@@ -27,85 +27,113 @@
  */
 
 #include <sys/stat.h>
-#include <sys/queue.h>
-/* For MIN */
 #include <sys/param.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
-#include <fts.h>
+#include <fcntl.h>
 #include <libutil.h>
 #include <pkg.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
-#include <uthash.h>
 
 #include "pkgcli.h"
 
-struct deletion_list {
-	STAILQ_ENTRY(deletion_list) next;
+/*
+ * Files to delete, grouped by the directory they are in: the directories
+ * are kept open so that the files are removed relative to them.
+ */
+struct cache_dir {
 	char	*path;
+	DIR	*dir;
+};
+
+struct cache_file {
+	size_t	 dir;
+	char	*name;
 };
 
-struct sumlist {
-	char sum[PKG_FILE_CKSUM_CHARS + 1];
-	UT_hash_handle hh;
+struct dellist {
+	struct cache_dir	*dirs;
+	size_t			 ndirs;
+	size_t			 dirscap;
+	struct cache_file	*files;
+	size_t			 nfiles;
+	size_t			 filescap;
 };
 
+#define CKSUM_SIZE	(PKG_FILE_CKSUM_CHARS + 1)
+
 #define OUT_OF_DATE	(1U<<0)
 #define REMOVED		(1U<<1)
 #define CKSUM_MISMATCH	(1U<<2)
 #define SIZE_MISMATCH	(1U<<3)
 #define ALL		(1U<<4)
 
-STAILQ_HEAD(dl_head, deletion_list);
-
 static int
-add_to_dellist(struct dl_head *dl,  const char *path)
+add_to_dellist(struct dellist *dl, size_t dir, const char *name)
 {
-	struct deletion_list	*dl_entry;
-
-	assert(path != NULL);
+	struct cache_file	*f;
+
+	assert(name != NULL);
+
+	if (dl->nfiles == dl->filescap) {
+		dl->filescap = dl->filescap == 0 ? 64 : dl->filescap * 2;
+		dl->files = reallocf(dl->files,
+		    dl->filescap * sizeof(struct cache_file));
+		if (dl->files == NULL) {
+			warn("adding deletion list entry");
+			dl->nfiles = dl->filescap = 0;
+			return (EPKG_FATAL);
+		}
+	}
 
-	dl_entry = calloc(1, sizeof(struct deletion_list));
-	if (dl_entry == NULL) {
+	f = &dl->files[dl->nfiles];
+	if ((f->name = strdup(name)) == NULL) {
 		warn("adding deletion list entry");
 		return (EPKG_FATAL);
 	}
-
-	dl_entry->path = strdup(path);
-
-	STAILQ_INSERT_TAIL(dl, dl_entry, next);
+	f->dir = dir;
+	dl->nfiles++;
 
 	return (EPKG_OK);
 }
 
 static void
-free_dellist(struct dl_head *dl)
+free_dellist(struct dellist *dl)
 {
-	struct deletion_list	*dl_entry;
+	size_t	i;
 
-	while (!STAILQ_EMPTY(dl)) {
-		dl_entry = STAILQ_FIRST(dl);
-		STAILQ_REMOVE_HEAD(dl, next);
-		free(dl_entry->path);
+	for (i = 0; i < dl->nfiles; i++)
+		free(dl->files[i].name);
+	for (i = 0; i < dl->ndirs; i++) {
+		free(dl->dirs[i].path);
+		closedir(dl->dirs[i].dir);
 	}
+	free(dl->files);
+	free(dl->dirs);
 }
 
 static int
-delete_dellist(struct dl_head *dl)
+delete_dellist(struct dellist *dl)
 {
-	struct deletion_list	*dl_entry;
+	struct cache_file	*f;
+	struct cache_dir	*d;
 	int			retcode = EX_OK;
 	int			count = 0;
+	size_t			i;
 
-	STAILQ_FOREACH(dl_entry, dl, next) {
+	for (i = 0; i < dl->nfiles; i++) {
+		f = &dl->files[i];
+		d = &dl->dirs[f->dir];
 		if (!quiet)
-			printf("\t%s\n", dl_entry->path);
-		if (unlink(dl_entry->path) != 0) {
-			warn("unlink(%s)", dl_entry->path);
+			printf("\t%s/%s\n", d->path, f->name);
+		if (unlinkat(dirfd(d->dir), f->name, 0) != 0) {
+			warn("unlink(%s/%s)", d->path, f->name);
 			count++;
 			retcode = EX_SOFTWARE;
 		}
@@ -146,6 +174,87 @@ extract_filename_sum(const char *fname, char sum[])
 	return (true);
 }
 
+static int
+cksum_cmp(const void *a, const void *b)
+{
+	return (strcmp(a, b));
+}
+
+/*
+ * Walk the directory opened as fd, adding the files which are not
+ * packages from the repositories to the deletion list, or all of them.
+ */
+static int
+walk_cache(struct dellist *dl, int fd, const char *path, const char *sums,
+    size_t nsums, bool all, int64_t *total)
+{
+	struct dirent	*ent;
+	struct stat	 st;
+	DIR		*d;
+	char		 csum[CKSUM_SIZE];
+	char		*subpath;
+	size_t		 dir;
+	int		 subfd, ret = EPKG_OK;
+
+	if ((d = fdopendir(fd)) == NULL) {
+		warn("opendir(%s)", path);
+		close(fd);
+		return (EPKG_FATAL);
+	}
+
+	if (dl->ndirs == dl->dirscap) {
+		dl->dirscap = dl->dirscap == 0 ? 16 : dl->dirscap * 2;
+		dl->dirs = reallocf(dl->dirs,
+		    dl->dirscap * sizeof(struct cache_dir));
+		if (dl->dirs == NULL)
+			err(EX_OSERR, "realloc");
+	}
+	dir = dl->ndirs++;
+	dl->dirs[dir].dir = d;
+	if ((dl->dirs[dir].path = strdup(path)) == NULL)
+		err(EX_OSERR, "strdup");
+
+	while (ret == EPKG_OK && (ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 ||
+		    strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		if (fstatat(dirfd(d), ent->d_name, &st,
+		    AT_SYMLINK_NOFOLLOW) != 0) {
+			warn("stat(%s/%s)", path, ent->d_name);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			subfd = openat(dirfd(d), ent->d_name,
+			    O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if (subfd == -1) {
+				warn("open(%s/%s)", path, ent->d_name);
+				continue;
+			}
+			if (asprintf(&subpath, "%s/%s", path,
+			    ent->d_name) == -1)
+				err(EX_OSERR, "asprintf");
+			ret = walk_cache(dl, subfd, subpath, sums, nsums, all,
+			    total);
+			free(subpath);
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		if (!all && extract_filename_sum(ent->d_name, csum) &&
+		    bsearch(csum, sums, nsums, CKSUM_SIZE, cksum_cmp) != NULL)
+			continue;
+
+		ret = add_to_dellist(dl, dir, ent->d_name);
+		*total += st.st_size;
+	}
+
+	return (ret);
+}
+
 void
 usage_clean(void)
 {
@@ -157,23 +266,18 @@ int
 exec_clean(int argc, char **argv)
 {
 	struct pkgdb	*db = NULL;
-	struct pkgdb_it	*it = NULL;
-	struct pkg	*p = NULL;
-	struct sumlist	*sumlist = NULL, *s, *t;
-	FTS		*fts = NULL;
-	FTSENT		*ent = NULL;
-	struct dl_head	dl = STAILQ_HEAD_INITIALIZER(dl);
-	const char	*cachedir, *sum;
-	char		*paths[2], csum[PKG_FILE_CKSUM_CHARS + 1];
+	struct dellist	 dl;
+	const char	*cachedir;
+	char		*sums = NULL;
 	bool		 all = false;
 	bool		 dry_run = false;
-	bool		 yes, sumloaded = false;
+	bool		 yes;
 	int		 retcode;
 	int		 ret;
-	int		 ch;
-	size_t		 total = 0, slen;
+	int		 ch, fd;
+	size_t		 nsums = 0;
+	int64_t		 total = 0;
 	char		 size[7];
-	struct pkg_manifest_key *keys = NULL;
 
 	yes = pkg_object_bool(pkg_config_get("ASSUME_ALWAYS_YES"));
 
@@ -200,9 +304,7 @@ exec_clean(int argc, char **argv)
 	argv += optind;
 
 	cachedir = pkg_object_string(pkg_config_get("PKG_CACHEDIR"));
-
-	paths[0] = __DECONST(char*, cachedir);
-	paths[1] = NULL;
+	memset(&dl, 0, sizeof(dl));
 
 	retcode = pkgdb_access(PKGDB_MODE_READ, PKGDB_DB_REPO);
 
@@ -219,63 +321,33 @@ exec_clean(int argc, char **argv)
 
 	retcode = EX_SOFTWARE;
 
-	if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK)
-		return (EX_IOERR);
+	if (!all) {
+		if (pkgdb_open(&db, PKGDB_REMOTE) != EPKG_OK)
+			return (EX_IOERR);
 
-	if (pkgdb_obtain_lock(db, PKGDB_LOCK_READONLY, 0, 0) != EPKG_OK) {
-		pkgdb_close(db);
-		warnx("Cannot get a read lock on a database, it is locked by another process");
-		return (EX_TEMPFAIL);
-	}
+		if (pkgdb_obtain_lock(db, PKGDB_LOCK_READONLY, 0, 0) != EPKG_OK) {
+			pkgdb_close(db);
+			warnx("Cannot get a read lock on a database, it is locked by another process");
+			return (EX_TEMPFAIL);
+		}
 
-	if ((fts = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL) {
-		warn("fts_open(%s)", cachedir);
-		goto cleanup;
+		ret = pkgdb_repos_cksums(db, &sums, &nsums);
+		pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
+		pkgdb_close(db);
+		if (ret != EPKG_OK)
+			return (EX_IOERR);
 	}
 
 	/* Build the list of out-of-date or obsolete packages */
 
-	pkg_manifest_keys_new(&keys);
-	while ((ent = fts_read(fts)) != NULL) {
-		if (ent->fts_info != FTS_F)
-			continue;
-
-		if (all) {
-			ret = add_to_dellist(&dl, ent->fts_path);
-			total += ent->fts_statp->st_size;
-			continue;
-		}
-
-		if (sumlist == NULL && !sumloaded) {
-			it = pkgdb_search(db, "*", MATCH_GLOB, FIELD_NAME, FIELD_NONE, NULL);
-			while (pkgdb_it_next(it, &p, PKG_LOAD_BASIC) == EPKG_OK) {
-				pkg_get(p, PKG_CKSUM, &sum);
-				slen = MIN(strlen(sum), PKG_FILE_CKSUM_CHARS);
-				s = calloc(1, sizeof(struct sumlist));
-				memcpy(s->sum, sum, slen);
-				s->sum[slen] = '\0';
-				HASH_ADD_STR(sumlist, sum, s);
-			}
-			pkgdb_it_free(it);
-			pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
-			pkgdb_close(db);
-		}
-
-		s = NULL;
-		if (extract_filename_sum(ent->fts_name, csum))
-			HASH_FIND_STR(sumlist, csum, s);
-		if (s == NULL) {
-			ret = add_to_dellist(&dl, ent->fts_path);
-			total += ent->fts_statp->st_size;
-			continue;
-		}
-	}
-	HASH_ITER(hh, sumlist, s, t) {
-		HASH_DEL(sumlist, s);
-		free(s);
+	if ((fd = open(cachedir, O_RDONLY|O_DIRECTORY)) == -1) {
+		warn("open(%s)", cachedir);
+		goto cleanup;
 	}
+	if (walk_cache(&dl, fd, cachedir, sums, nsums, all, &total) != EPKG_OK)
+		goto cleanup;
 
-	if (STAILQ_EMPTY(&dl)) {
+	if (dl.nfiles == 0) {
 		if (!quiet)
 			printf("Nothing to do.\n");
 		retcode = EX_OK;
@@ -295,11 +367,8 @@ exec_clean(int argc, char **argv)
 		retcode = EX_OK;
 
 cleanup:
-	pkg_manifest_keys_free(keys);
 	free_dellist(&dl);
-
-	if (fts != NULL)
-		fts_close(fts);
+	free(sums);
 
 	return (retcode);
 }
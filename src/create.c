@@ -98,6 +98,9 @@ pkg_create_matches(int argc, char **argv, match_t match, pkg_formats fmt,
 	}
 
 	switch (fmt) {
+	case TZST:
+		format = "tzst";
+		break;
 	case TXZ:
 		format = "txz";
 		break;
@@ -178,7 +181,7 @@ cleanup:
  * -g: globbing
  * -r: rootdir for the package
  * -m: path to dir where to find the metadata
- * -f <format>: format could be txz, tgz, tbz or tar
+ * -f <format>: format could be tzst, txz, tgz, tbz or tar
  * -o: output directory where to create packages by default ./ is used
  */
 
@@ -257,6 +260,8 @@ exec_create(int argc, char **argv)
 			++format;
 		if (strcmp(format, "txz") == 0)
 			fmt = TXZ;
+		else if (strcmp(format, "tzst") == 0)
+			fmt = TZST;
 		else if (strcmp(format, "tbz") == 0)
 			fmt = TBZ;
 		else if (strcmp(format, "tgz") == 0)
@@ -267,7 +267,11 @@ struct query_flags {
 	const int dbflags;
 };
 
-void print_query(struct pkg *pkg, char *qstr, char multiline);
+struct query_format;
+
+struct query_format *query_format_compile(const char *qstr);
+void query_format_free(struct query_format *qf);
+void print_query(struct pkg *pkg, struct query_format *qf, char multiline);
 int format_sql_condition(const char *str, struct sbuf *sqlcond,
 			 bool for_remote);
 int analyse_query_string(char *qstr, struct query_flags *q_flags,
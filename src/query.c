@@ -74,101 +74,168 @@ static struct query_flags accepted_query_flags[] = {
 	{ 't', "",		0, PKG_LOAD_BASIC },
 };
 
+/*
+ * A query format is translated once into a list of operations: chunks
+ * of literal text, and pkg_printf() escapes compiled with
+ * pkg_printf_compile() which take either the package or the list item
+ * as their argument.
+ */
+typedef enum {
+	QUERY_TEXT,
+	QUERY_PKG,
+	QUERY_DATA,
+	QUERY_AUTOMATIC,
+	QUERY_LOCKED,
+	QUERY_MESSAGE,
+} query_op_t;
+
+struct query_op {
+	query_op_t		 type;
+	struct pkg_printf_prog	*prog;
+	size_t			 off;
+	size_t			 len;
+};
+
+struct query_format {
+	struct sbuf		*text;
+	struct query_op		*ops;
+	unsigned		 nops;
+	unsigned		 cap;
+};
+
+static struct query_op *
+query_add_op(struct query_format *qf, query_op_t type, const char *fmt)
+{
+	struct query_op	*op;
+
+	if (qf->nops == qf->cap) {
+		qf->cap = qf->cap == 0 ? 8 : qf->cap * 2;
+		qf->ops = reallocf(qf->ops, qf->cap * sizeof(struct query_op));
+		if (qf->ops == NULL)
+			err(EX_OSERR, "realloc");
+	}
+	op = &qf->ops[qf->nops++];
+	op->type = type;
+	op->prog = NULL;
+	op->off = op->len = 0;
+
+	if (fmt != NULL && (op->prog = pkg_printf_compile(fmt)) == NULL)
+		err(EX_OSERR, "pkg_printf_compile");
+
+	return (op);
+}
+
 static void
-format_str(struct pkg *pkg, struct sbuf *dest, const char *qstr, const void *data)
+query_add_char(struct query_format *qf, char c)
 {
-	bool automatic;
-	bool locked;
+	struct query_op	*op;
+	size_t		 off;
 
-	sbuf_clear(dest);
+	off = sbuf_len(qf->text);
+	sbuf_putc(qf->text, c);
+
+	op = qf->nops > 0 ? &qf->ops[qf->nops - 1] : NULL;
+	if (op == NULL || op->type != QUERY_TEXT) {
+		op = query_add_op(qf, QUERY_TEXT, NULL);
+		op->off = off;
+	}
+	op->len++;
+}
+
+struct query_format *
+query_format_compile(const char *qstr)
+{
+	struct query_format	*qf;
+
+	if ((qf = calloc(1, sizeof(struct query_format))) == NULL)
+		err(EX_OSERR, "calloc");
+	qf->text = sbuf_new_auto();
 
 	while (qstr[0] != '\0') {
 		if (qstr[0] == '%') {
 			qstr++;
 			switch (qstr[0]) {
 			case 'n':
-				pkg_sbuf_printf(dest, "%n", pkg);
+				query_add_op(qf, QUERY_PKG, "%n");
 				break;
 			case 'v':
-				pkg_sbuf_printf(dest, "%v", pkg);
+				query_add_op(qf, QUERY_PKG, "%v");
 				break;
 			case 'o':
-				pkg_sbuf_printf(dest, "%o", pkg);
+				query_add_op(qf, QUERY_PKG, "%o");
 				break;
 			case 'R':
-				pkg_sbuf_printf(dest, "%N", pkg);
+				query_add_op(qf, QUERY_PKG, "%N");
 				break;
 			case 'p':
-				pkg_sbuf_printf(dest, "%p", pkg);
+				query_add_op(qf, QUERY_PKG, "%p");
 				break;
 			case 'm':
-				pkg_sbuf_printf(dest, "%m", pkg);
+				query_add_op(qf, QUERY_PKG, "%m");
 				break;
 			case 'c':
-				pkg_sbuf_printf(dest, "%c", pkg);
+				query_add_op(qf, QUERY_PKG, "%c");
 				break;
 			case 'w':
-				pkg_sbuf_printf(dest, "%w", pkg);
+				query_add_op(qf, QUERY_PKG, "%w");
 				break;
 			case 'a':
-				pkg_get(pkg, PKG_AUTOMATIC, &automatic);
-				sbuf_printf(dest, "%d", automatic);
+				query_add_op(qf, QUERY_AUTOMATIC, NULL);
 				break;
 			case 'k':
-				pkg_get(pkg, PKG_LOCKED, &locked);
-				sbuf_printf(dest, "%d", locked);
+				query_add_op(qf, QUERY_LOCKED, NULL);
 				break;
 			case 't':
-				pkg_sbuf_printf(dest, "%t", pkg);
+				query_add_op(qf, QUERY_PKG, "%t");
 				break;
 			case 's':
 				qstr++;
 				if (qstr[0] == 'h') 
-					pkg_sbuf_printf(dest, "%?sB", pkg);
+					query_add_op(qf, QUERY_PKG, "%?sB");
 			        else if (qstr[0] == 'b')
-					pkg_sbuf_printf(dest, "%s", pkg);
+					query_add_op(qf, QUERY_PKG, "%s");
 				break;
 			case 'e':
-				pkg_sbuf_printf(dest, "%e", pkg);
+				query_add_op(qf, QUERY_PKG, "%e");
 				break;
 			case '?':
 				qstr++;
 				switch (qstr[0]) {
 				case 'd':
-					pkg_sbuf_printf(dest, "%?d", pkg);
+					query_add_op(qf, QUERY_PKG, "%?d");
 					break;
 				case 'r':
-					pkg_sbuf_printf(dest, "%?r", pkg);
+					query_add_op(qf, QUERY_PKG, "%?r");
 					break;
 				case 'C':
-					pkg_sbuf_printf(dest, "%?C", pkg);
+					query_add_op(qf, QUERY_PKG, "%?C");
 					break;
 				case 'F':
-					pkg_sbuf_printf(dest, "%?F", pkg);
+					query_add_op(qf, QUERY_PKG, "%?F");
 					break;
 				case 'O':
-					pkg_sbuf_printf(dest, "%?O", pkg);
+					query_add_op(qf, QUERY_PKG, "%?O");
 					break;
 				case 'D':
-					pkg_sbuf_printf(dest, "%?D", pkg);
+					query_add_op(qf, QUERY_PKG, "%?D");
 					break;
 				case 'L':
-					pkg_sbuf_printf(dest, "%?L", pkg);
+					query_add_op(qf, QUERY_PKG, "%?L");
 					break;
 				case 'U':
-					pkg_sbuf_printf(dest, "%?U", pkg);
+					query_add_op(qf, QUERY_PKG, "%?U");
 					break;
 				case 'G':
-					pkg_sbuf_printf(dest, "%?G", pkg);
+					query_add_op(qf, QUERY_PKG, "%?G");
 					break;
 				case 'B':
-					pkg_sbuf_printf(dest, "%?B", pkg);
+					query_add_op(qf, QUERY_PKG, "%?B");
 					break;
 				case 'b':
-					pkg_sbuf_printf(dest, "%?b", pkg);
+					query_add_op(qf, QUERY_PKG, "%?b");
 					break;
 				case 'A':
-					pkg_sbuf_printf(dest, "%?A", pkg);
+					query_add_op(qf, QUERY_PKG, "%?A");
 					break;
 				}
 				break;
@@ -176,156 +243,214 @@ format_str(struct pkg *pkg, struct sbuf *dest, const char *qstr, const void *dat
 				qstr++;
 				switch (qstr[0]) {
 				case 'd':
-					pkg_sbuf_printf(dest, "%#d", pkg);
+					query_add_op(qf, QUERY_PKG, "%#d");
 					break;
 				case 'r':
-					pkg_sbuf_printf(dest, "%#r", pkg);
+					query_add_op(qf, QUERY_PKG, "%#r");
 					break;
 				case 'C':
-					pkg_sbuf_printf(dest, "%#C", pkg);
+					query_add_op(qf, QUERY_PKG, "%#C");
 					break;
 				case 'F':
-					pkg_sbuf_printf(dest, "%#F", pkg);
+					query_add_op(qf, QUERY_PKG, "%#F");
 					break;
 				case 'O':
-					pkg_sbuf_printf(dest, "%#O", pkg);
+					query_add_op(qf, QUERY_PKG, "%#O");
 					break;
 				case 'D':
-					pkg_sbuf_printf(dest, "%#D", pkg);
+					query_add_op(qf, QUERY_PKG, "%#D");
 					break;
 				case 'L':
-					pkg_sbuf_printf(dest, "%#L", pkg);
+					query_add_op(qf, QUERY_PKG, "%#L");
 					break;
 				case 'U':
-					pkg_sbuf_printf(dest, "%#U", pkg);
+					query_add_op(qf, QUERY_PKG, "%#U");
 					break;
 				case 'G':
-					pkg_sbuf_printf(dest, "%#G", pkg);
+					query_add_op(qf, QUERY_PKG, "%#G");
 					break;
 				case 'B':
-					pkg_sbuf_printf(dest, "%#B", pkg);
+					query_add_op(qf, QUERY_PKG, "%#B");
 					break;
 				case 'b':
-					pkg_sbuf_printf(dest, "%#b", pkg);
+					query_add_op(qf, QUERY_PKG, "%#b");
 					break;
 				case 'A':
-					pkg_sbuf_printf(dest, "%#A", pkg);
+					query_add_op(qf, QUERY_PKG, "%#A");
 					break;
 				}
 				break;
 			case 'q':
-				pkg_sbuf_printf(dest, "%q", pkg);
+				query_add_op(qf, QUERY_PKG, "%q");
 				break;
 			case 'l':
-				pkg_sbuf_printf(dest, "%l", pkg);
+				query_add_op(qf, QUERY_PKG, "%l");
 				break;
 			case 'd':
 				qstr++;
 				if (qstr[0] == 'n')
-					pkg_sbuf_printf(dest, "%dn", data);
+					query_add_op(qf, QUERY_DATA, "%dn");
 				else if (qstr[0] == 'o')
-					pkg_sbuf_printf(dest, "%do", data);
+					query_add_op(qf, QUERY_DATA, "%do");
 				else if (qstr[0] == 'v')
-					pkg_sbuf_printf(dest, "%dv", data);
+					query_add_op(qf, QUERY_DATA, "%dv");
 				break;
 			case 'r':
 				qstr++;
 				if (qstr[0] == 'n')
-					pkg_sbuf_printf(dest, "%rn", data);
+					query_add_op(qf, QUERY_DATA, "%rn");
 				else if (qstr[0] == 'o')
-					pkg_sbuf_printf(dest, "%ro", data);
+					query_add_op(qf, QUERY_DATA, "%ro");
 				else if (qstr[0] == 'v')
-					pkg_sbuf_printf(dest, "%rv", data);
+					query_add_op(qf, QUERY_DATA, "%rv");
 				break;
 			case 'C':
-				pkg_sbuf_printf(dest, "%Cn", data);
+				query_add_op(qf, QUERY_DATA, "%Cn");
 				break;
 			case 'F':
 				qstr++;
 				if (qstr[0] == 'p')
-					pkg_sbuf_printf(dest, "%Fn", data);
+					query_add_op(qf, QUERY_DATA, "%Fn");
 				else if (qstr[0] == 's')
-					pkg_sbuf_printf(dest, "%Fs", data);
+					query_add_op(qf, QUERY_DATA, "%Fs");
 				break;
 			case 'O':
 				qstr++;
 				if (qstr[0] == 'k')
-					pkg_sbuf_printf(dest, "%On", data);
+					query_add_op(qf, QUERY_DATA, "%On");
 				else if (qstr[0] == 'v')
-					pkg_sbuf_printf(dest, "%Ov", data);
+					query_add_op(qf, QUERY_DATA, "%Ov");
 				else if (qstr[0] == 'd') /* default value */
-					pkg_sbuf_printf(dest, "%Od", data);
+					query_add_op(qf, QUERY_DATA, "%Od");
 				else if (qstr[0] == 'D') /* description */
-					pkg_sbuf_printf(dest, "%OD", data);
+					query_add_op(qf, QUERY_DATA, "%OD");
 				break;
 			case 'D':
-				pkg_sbuf_printf(dest, "%Dn", data);
+				query_add_op(qf, QUERY_DATA, "%Dn");
 				break;
 			case 'L':
-				pkg_sbuf_printf(dest, "%Ln", data);
+				query_add_op(qf, QUERY_DATA, "%Ln");
 				break;
 			case 'U':
-				pkg_sbuf_printf(dest, "%Un", data);
+				query_add_op(qf, QUERY_DATA, "%Un");
 				break;
 			case 'G':
-				pkg_sbuf_printf(dest, "%Gn", data);
+				query_add_op(qf, QUERY_DATA, "%Gn");
 				break;
 			case 'B':
-				pkg_sbuf_printf(dest, "%Bn", data);
+				query_add_op(qf, QUERY_DATA, "%Bn");
 				break;
 			case 'b':
-				pkg_sbuf_printf(dest, "%bn", data);
+				query_add_op(qf, QUERY_DATA, "%bn");
 				break;
 			case 'A':
 				qstr++;
 				if (qstr[0] == 't')
-					pkg_sbuf_printf(dest, "%An", data);
+					query_add_op(qf, QUERY_DATA, "%An");
 				else if (qstr[0] == 'v')
-					pkg_sbuf_printf(dest, "%Av", data);
+					query_add_op(qf, QUERY_DATA, "%Av");
 				break;
 			case 'M':
-				if (pkg_has_message(pkg))
-					pkg_sbuf_printf(dest, "%M", pkg);
+				query_add_op(qf, QUERY_MESSAGE, "%M");
 				break;
 			case '%':
-				sbuf_putc(dest, '%');
+				query_add_char(qf, '%');
 				break;
 			}
 		} else  if (qstr[0] == '\\') {
 			qstr++;
 			switch (qstr[0]) {
 			case 'n':
-				sbuf_putc(dest, '\n');
+				query_add_char(qf, '\n');
 				break;
 			case 'a':
-				sbuf_putc(dest, '\a');
+				query_add_char(qf, '\a');
 				break;
 			case 'b':
-				sbuf_putc(dest, '\b');
+				query_add_char(qf, '\b');
 				break;
 			case 'f':
-				sbuf_putc(dest, '\f');
+				query_add_char(qf, '\f');
 				break;
 			case 'r':
-				sbuf_putc(dest, '\r');
+				query_add_char(qf, '\r');
 				break;
 			case '\\':
-				sbuf_putc(dest, '\\');
+				query_add_char(qf, '\\');
 				break;
 			case 't':
-				sbuf_putc(dest, '\t');
+				query_add_char(qf, '\t');
 				break;
 			}
 		} else {
-			sbuf_putc(dest, qstr[0]);
+			query_add_char(qf, qstr[0]);
 		}
 		qstr++;
 	}
+	sbuf_finish(qf->text);
+
+	return (qf);
+}
+
+void
+query_format_free(struct query_format *qf)
+{
+	unsigned	i;
+
+	if (qf == NULL)
+		return;
+
+	for (i = 0; i < qf->nops; i++)
+		pkg_printf_free(qf->ops[i].prog);
+	free(qf->ops);
+	sbuf_delete(qf->text);
+	free(qf);
+}
+
+static void
+format_str(struct pkg *pkg, struct sbuf *dest, struct query_format *qf,
+    const void *data)
+{
+	struct query_op	*op;
+	const char	*text;
+	bool		 automatic;
+	bool		 locked;
+	unsigned	 i;
+
+	sbuf_clear(dest);
+	text = sbuf_data(qf->text);
+
+	for (i = 0; i < qf->nops; i++) {
+		op = &qf->ops[i];
+		switch (op->type) {
+		case QUERY_TEXT:
+			sbuf_bcat(dest, text + op->off, op->len);
+			break;
+		case QUERY_PKG:
+			pkg_printf_exec(dest, op->prog, pkg);
+			break;
+		case QUERY_DATA:
+			pkg_printf_exec(dest, op->prog, data);
+			break;
+		case QUERY_AUTOMATIC:
+			pkg_get(pkg, PKG_AUTOMATIC, &automatic);
+			sbuf_printf(dest, "%d", automatic);
+			break;
+		case QUERY_LOCKED:
+			pkg_get(pkg, PKG_LOCKED, &locked);
+			sbuf_printf(dest, "%d", locked);
+			break;
+		case QUERY_MESSAGE:
+			if (pkg_has_message(pkg))
+				pkg_printf_exec(dest, op->prog, pkg);
+			break;
+		}
+	}
 	sbuf_finish(dest);
 }
 
 void
-print_query(struct pkg *pkg, char *qstr, char multiline)
+print_query(struct pkg *pkg, struct query_format *qf, char multiline)
 {
 	struct sbuf		*output = sbuf_new_auto();
 	struct pkg_dep		*dep    = NULL;
@@ -341,13 +466,13 @@ print_query(struct pkg *pkg, char *qstr, char multiline)
 	switch (multiline) {
 	case 'd':
 		while (pkg_deps(pkg, &dep) == EPKG_OK) {
-			format_str(pkg, output, qstr, dep);
+			format_str(pkg, output, qf, dep);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'r':
 		while (pkg_rdeps(pkg, &dep) == EPKG_OK) {
-			format_str(pkg, output, qstr, dep);
+			format_str(pkg, output, qf, dep);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
@@ -355,25 +480,25 @@ print_query(struct pkg *pkg, char *qstr, char multiline)
 		it = NULL;
 		pkg_get(pkg, PKG_CATEGORIES, &list);
 		while ((o = pkg_object_iterate(list, &it))) {
-			format_str(pkg, output, qstr, o);
+			format_str(pkg, output, qf, o);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'O':
 		while (pkg_options(pkg, &option) == EPKG_OK) {
-			format_str(pkg, output, qstr, option);
+			format_str(pkg, output, qf, option);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'F':
 		while (pkg_files(pkg, &file) == EPKG_OK) {
-			format_str(pkg, output, qstr, file);
+			format_str(pkg, output, qf, file);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'D':
 		while (pkg_dirs(pkg, &dir) == EPKG_OK) {
-			format_str(pkg, output, qstr, dir);
+			format_str(pkg, output, qf, dir);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
@@ -381,31 +506,31 @@ print_query(struct pkg *pkg, char *qstr, char multiline)
 		it = NULL;
 		pkg_get(pkg, PKG_LICENSES, &list);
 		while ((o = pkg_object_iterate(list, &it))) {
-			format_str(pkg, output, qstr, o);
+			format_str(pkg, output, qf, o);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'U':
 		while (pkg_users(pkg, &user) == EPKG_OK) {
-			format_str(pkg, output, qstr, user);
+			format_str(pkg, output, qf, user);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'G':
 		while (pkg_groups(pkg, &group) == EPKG_OK) {
-			format_str(pkg, output, qstr, group);
+			format_str(pkg, output, qf, group);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'B':
 		while (pkg_shlibs_required(pkg, &shlib) == EPKG_OK) {
-			format_str(pkg, output, qstr, shlib);
+			format_str(pkg, output, qf, shlib);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	case 'b':
 		while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
-			format_str(pkg, output, qstr, shlib);
+			format_str(pkg, output, qf, shlib);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
@@ -413,12 +538,12 @@ print_query(struct pkg *pkg, char *qstr, char multiline)
 		it = NULL;
 		pkg_get(pkg, PKG_ANNOTATIONS, &list);
 		while ((o = pkg_object_iterate(list, &it))) {
-			format_str(pkg, output, qstr, o);
+			format_str(pkg, output, qf, o);
 			printf("%s\n", sbuf_data(output));
 		}
 		break;
 	default:
-		format_str(pkg, output, qstr, dep);
+		format_str(pkg, output, qf, dep);
 		printf("%s\n", sbuf_data(output));
 		break;
 	}
@@ -438,11 +563,75 @@ typedef enum {
 	POST_EXPR,
 } state_t;
 
+/*
+ * Conditions on the elements of a list are compiled into a semi-join on
+ * the relation table, so that sqlite can evaluate the subquery once and
+ * drive it through the *_id indexes instead of testing every package.
+ * The comparison operator and value are appended to the text below and
+ * the subquery is closed once the value has been read.
+ */
+static const struct query_cond_list {
+	char		 list;
+	char		 field;
+	const char	*sql;
+} cond_lists[] = {
+	{ 'd', 'n', "p.id IN (SELECT d.package_id FROM %1$sdeps AS d "
+	    "WHERE d.name" },
+	{ 'd', 'o', "p.id IN (SELECT d.package_id FROM %1$sdeps AS d "
+	    "WHERE d.origin" },
+	{ 'd', 'v', "p.id IN (SELECT d.package_id FROM %1$sdeps AS d "
+	    "WHERE d.version" },
+	{ 'r', 'n', "p.origin IN (SELECT d.origin FROM %1$sdeps AS d "
+	    "JOIN %1$spackages AS r ON r.id = d.package_id WHERE r.name" },
+	{ 'r', 'o', "p.origin IN (SELECT d.origin FROM %1$sdeps AS d "
+	    "JOIN %1$spackages AS r ON r.id = d.package_id WHERE r.origin" },
+	{ 'r', 'v', "p.origin IN (SELECT d.origin FROM %1$sdeps AS d "
+	    "JOIN %1$spackages AS r ON r.id = d.package_id WHERE r.version" },
+	{ 'C', '\0', "p.id IN (SELECT d.package_id FROM %1$spkg_categories AS d "
+	    "JOIN %1$scategories AS c ON c.id = d.category_id WHERE c.name" },
+	{ 'L', '\0', "p.id IN (SELECT d.package_id FROM %1$spkg_licenses AS d "
+	    "JOIN %1$slicenses AS l ON l.id = d.license_id WHERE l.name" },
+	{ 'O', 'k', "p.id IN (SELECT d.package_id FROM %1$spkg_option AS d "
+	    "JOIN %1$soption AS o ON o.option_id = d.option_id "
+	    "WHERE o.option" },
+	{ 'O', 'v', "p.id IN (SELECT d.package_id FROM %1$spkg_option AS d "
+	    "WHERE d.value" },
+	{ 'B', '\0', "p.id IN (SELECT d.package_id FROM %1$spkg_shlibs_required "
+	    "AS d JOIN %1$sshlibs AS s ON s.id = d.shlib_id WHERE s.name" },
+	{ 'b', '\0', "p.id IN (SELECT d.package_id FROM %1$spkg_shlibs_provided "
+	    "AS d JOIN %1$sshlibs AS s ON s.id = d.shlib_id WHERE s.name" },
+	{ 'A', 't', "p.id IN (SELECT d.package_id FROM %1$spkg_annotation AS d "
+	    "JOIN %1$sannotation AS a ON a.annotation_id = d.tag_id "
+	    "WHERE a.annotation" },
+	{ 'A', 'v', "p.id IN (SELECT d.package_id FROM %1$spkg_annotation AS d "
+	    "JOIN %1$sannotation AS a ON a.annotation_id = d.value_id "
+	    "WHERE a.annotation" },
+	{ '\0', '\0', NULL },
+};
+
+static const struct query_cond_list *
+cond_list_lookup(const char *str)
+{
+	const struct query_cond_list *cl;
+
+	for (cl = cond_lists; cl->list != '\0'; cl++) {
+		if (cl->list == str[0] &&
+		    (cl->field == '\0' || cl->field == str[1]))
+			return (cl);
+	}
+
+	return (NULL);
+}
+
 int
 format_sql_condition(const char *str, struct sbuf *sqlcond, bool for_remote)
 {
 	state_t state = NONE;
 	unsigned int bracket_level = 0;
+	const struct query_cond_list *cl;
+	const char *dbstr = for_remote ? "'%1$s'." : "";
+	const char *sqlop;
+	bool in_list = false;
 
 	sbuf_cat(sqlcond, " WHERE ");
 	while (str[0] != '\0') {
@@ -510,55 +699,72 @@ format_sql_condition(const char *str, struct sbuf *sqlcond, bool for_remote)
 					sbuf_cat(sqlcond, "desc");
 					state = OPERATOR_STRING;
 					break;
+				case 'd':
+				case 'r':
+				case 'C':
+				case 'L':
+				case 'O':
+				case 'B':
+				case 'b':
+				case 'A':
+					if ((cl = cond_list_lookup(str)) == NULL)
+						goto bad_option;
+					if (cl->field != '\0')
+						str++;
+					sbuf_printf(sqlcond, cl->sql, dbstr);
+					in_list = true;
+					state = OPERATOR_STRING;
+					break;
 				case '#': /* FALLTHROUGH */
 				case '?':
+					/* EXISTS stops at the first matching row */
+					sqlop = (str[0] == '#' ? "(SELECT COUNT(*) FROM" :
+					    "EXISTS (SELECT 1 FROM");
 					str++;
-					const char *dbstr = for_remote ? "'%1$s'." : "";
-					const char *sqlop = (str[0] == '#' ? "COUNT(*)" : "COUNT(*) > 0");
 					switch (str[0]) {
 						case 'd':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %sdeps AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %sdeps AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'r':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %sdeps AS d WHERE d.origin=p.origin)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %sdeps AS d WHERE d.origin=p.origin)", sqlop, dbstr);
 							break;
 						case 'C':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_categories AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_categories AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'F':
 							if (for_remote)
 								goto bad_option;
-							sbuf_printf(sqlcond, "(SELECT %s FROM %sfiles AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %sfiles AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'O':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %soption JOIN %spkg_option USING(option_id) AS d WHERE d.package_id=p.id)", sqlop, dbstr, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_option AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'D':
 							if (for_remote)
 								goto bad_option;
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_directories AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_directories AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'L':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_licenses AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_licenses AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'U':
 							if (for_remote)
 								goto bad_option;
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_users AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_users AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'G':
 							if (for_remote)
 								goto bad_option;
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_groups AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_groups AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'B':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_shlibs_required AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_shlibs_required AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'b':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_shlibs_provided AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_shlibs_provided AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						case 'A':
-							sbuf_printf(sqlcond, "(SELECT %s FROM %spkg_annotation AS d WHERE d.package_id=p.id)", sqlop, dbstr);
+							sbuf_printf(sqlcond, "%s %spkg_annotation AS d WHERE d.package_id=p.id)", sqlop, dbstr);
 							break;
 						default:
 							goto bad_option;
@@ -706,6 +912,10 @@ bad_option:
 			    (state == QUOTEDSTRING && str[0] == '"') ||
 			    (state == SQUOTEDSTRING && str[0] == '\'')) {
 				sbuf_putc(sqlcond, '\'');
+				if (in_list) {
+					sbuf_putc(sqlcond, ')');
+					in_list = false;
+				}
 				state = POST_EXPR;
 			} else {
 				sbuf_putc(sqlcond, str[0]);
@@ -719,6 +929,8 @@ bad_option:
 	}
 	if (state == STRING) {
 		sbuf_putc(sqlcond, '\'');
+		if (in_list)
+			sbuf_putc(sqlcond, ')');
 		state = POST_EXPR;
 	}
 
@@ -847,6 +1059,7 @@ exec_query(int argc, char **argv)
 	char multiline = 0;
 	char *condition = NULL;
 	struct sbuf *sqlcond = NULL;
+	struct query_format *qf = NULL;
 	const unsigned int q_flags_len = (sizeof(accepted_query_flags)/sizeof(accepted_query_flags[0]));
 
         /* Set default case sensitivity for searching */
@@ -912,7 +1125,9 @@ exec_query(int argc, char **argv)
 		}
 
 		pkg_manifest_keys_free(keys);
-		print_query(pkg, argv[0], multiline);
+		qf = query_format_compile(argv[0]);
+		print_query(pkg, qf, multiline);
+		query_format_free(qf);
 		pkg_free(pkg);
 		return (EX_OK);
 	}
@@ -947,15 +1162,19 @@ exec_query(int argc, char **argv)
 		return (EX_TEMPFAIL);
 	}
 
+	qf = query_format_compile(argv[0]);
+
 	if (match == MATCH_ALL || match == MATCH_CONDITION) {
 		const char *condition_sql = NULL;
 		if (match == MATCH_CONDITION && sqlcond)
 			condition_sql = sbuf_data(sqlcond);
-		if ((it = pkgdb_query(db, condition_sql, match)) == NULL)
-			return (EX_IOERR);
+		if ((it = pkgdb_query(db, condition_sql, match)) == NULL) {
+			retcode = EX_IOERR;
+			goto cleanup;
+		}
 
 		while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK)
-			print_query(pkg, argv[0],  multiline);
+			print_query(pkg, qf, multiline);
 
 		if (ret != EPKG_END)
 			retcode = EX_SOFTWARE;
@@ -973,15 +1192,15 @@ exec_query(int argc, char **argv)
 
 			while ((ret = pkgdb_it_next(it, &pkg, query_flags)) == EPKG_OK) {
 				nprinted++;
-				print_query(pkg, argv[0], multiline);
+				print_query(pkg, qf, multiline);
 			}
 
+			pkgdb_it_free(it);
+
 			if (ret != EPKG_END) {
 				retcode = EX_SOFTWARE;
 				break;
 			}
-
-			pkgdb_it_free(it);
 		}
 		if (nprinted == 0 && retcode == EX_OK) {
 			/* ensure to return a non-zero status when no package
@@ -993,6 +1212,9 @@ exec_query(int argc, char **argv)
 cleanup:
 	if (pkg != NULL)
 		pkg_free(pkg);
+	query_format_free(qf);
+	if (sqlcond != NULL)
+		sbuf_delete(sqlcond);
 
 	pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
 	pkgdb_close(db);
@@ -111,6 +111,7 @@ exec_rquery(int argc, char **argv)
 	char multiline = 0;
 	char *condition = NULL;
 	struct sbuf *sqlcond = NULL;
+	struct query_format *qf = NULL;
 	const unsigned int q_flags_len = (sizeof(accepted_rquery_flags)/sizeof(accepted_rquery_flags[0]));
 	const char *reponame = NULL;
 	bool auto_update;
@@ -212,6 +213,8 @@ exec_rquery(int argc, char **argv)
 
 	if (index_output)
 		query_flags = PKG_LOAD_BASIC|PKG_LOAD_CATEGORIES;
+	else
+		qf = query_format_compile(argv[0]);
 
 	if (match == MATCH_ALL || match == MATCH_CONDITION) {
 		const char *condition_sql = NULL;
@@ -224,7 +227,7 @@ exec_rquery(int argc, char **argv)
 			if (index_output)
 				print_index(pkg);
 			else
-				print_query(pkg, argv[0],  multiline);
+				print_query(pkg, qf, multiline);
 		}
 
 		if (ret != EPKG_END)
@@ -243,7 +246,7 @@ exec_rquery(int argc, char **argv)
 				if (index_output)
 					print_index(pkg);
 				else
-					print_query(pkg, argv[0], multiline);
+					print_query(pkg, qf, multiline);
 			}
 
 			if (ret != EPKG_END) {
@@ -258,6 +261,7 @@ exec_rquery(int argc, char **argv)
 	}
 
 	pkg_free(pkg);
+	query_format_free(qf);
 	pkgdb_close(db);
 
 	return (retcode);
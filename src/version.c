@@ -30,12 +30,18 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/sbuf.h>
+#include <sys/sysctl.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 
 #define _WITH_GETLINE
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pkg.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,12 +55,62 @@
 
 #include "pkgcli.h"
 
+/*
+ * The INDEX is mapped once and its entries point into the mapping, so
+ * neither the origin nor the version are NUL terminated.
+ */
 struct index_entry {
+	const char *origin;
+	const char *version;
+	size_t versionlen;
+	UT_hash_handle hh;
+};
+
+struct index {
+	char *map;
+	size_t len;
+	struct index_entry *entries;
+	struct index_entry *head;
+};
+
+/*
+ * PKGVERSION of a port as found by a previous run of pkg version -P,
+ * valid as long as the Makefiles of the port and of its category are
+ * unchanged.
+ */
+struct port_cache_entry {
 	char *origin;
-	char *version;
+	char *version;		/* NULL if the port is not in the tree */
+	int64_t mtime;
+	int64_t size;
+	int64_t catmtime;
+	UT_hash_handle hh;
+};
+
+/* A make(1) -V query, run in the background */
+struct make_job {
+	char *dir;
+	const char *var;
+	pid_t pid;
+	int fd;
+	struct sbuf *out;
 	UT_hash_handle hh;
 };
 
+/* An installed package being compared against the ports tree */
+struct port_query {
+	struct pkg *pkg;
+	const char *origin;
+	const char *version;
+	struct port_cache_entry *cached;
+	struct make_job *category;
+	struct make_job *port;
+	struct stat st;
+	struct stat catst;
+};
+
+#define PORTS_CACHE_FILE	"ports_version.cache"
+
 void
 usage_version(void)
 {
@@ -259,37 +315,66 @@ indexfilename(char *filebuf, size_t filebuflen)
 	return (filebuf);
 }
 
-static struct index_entry *
-hash_indexfile(const char *indexfilename)
+static void
+hash_indexfile(const char *indexfilename, struct index *index)
 {
-	FILE			*indexfile;
-	struct index_entry	*indexhead = NULL;
 	struct index_entry	*entry;
-	char			*version, *origin;
-	char			*line = NULL, *l, *p;
-	size_t			 linecap = 0;
-	int			 dirs;
+	struct stat		 st;
+	const char		*line, *eol, *end, *pkgend, *portend;
+	const char		*version, *origin, *p;
+	size_t			 nlines, originlen;
+	int			 fd, dirs;
 
+	memset(index, 0, sizeof(*index));
 
 	/* Create a hash table of all the package names and port
 	 * directories from the index file. */
 
-	indexfile = fopen(indexfilename, "r");
-	if (!indexfile)
+	if ((fd = open(indexfilename, O_RDONLY)) == -1)
 		err(EX_NOINPUT, "Unable to open %s", indexfilename);
+	if (fstat(fd, &st) == -1)
+		err(EX_NOINPUT, "Unable to stat %s", indexfilename);
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
 
-	while (getline(&line, &linecap, indexfile) > 0) {
+	index->len = st.st_size;
+	index->map = mmap(NULL, index->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index->map == MAP_FAILED)
+		err(EX_NOINPUT, "Unable to map %s", indexfilename);
+	madvise(index->map, index->len, MADV_SEQUENTIAL);
+	end = index->map + index->len;
+
+	for (nlines = 1, p = index->map;
+	    (p = memchr(p, '\n', end - p)) != NULL; p++)
+		nlines++;
+
+	index->entries = calloc(nlines, sizeof(struct index_entry));
+	if (index->entries == NULL)
+		err(EX_SOFTWARE, "Out of memory while reading %s",
+		    indexfilename);
+	entry = index->entries;
+
+	for (line = index->map; line < end; line = eol + 1) {
 		/* line is pkgname|portdir|... */
 
-		l = line;
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
 
-		version = strsep(&l, "|");
-		version = strrchr(version, '-');
-		version[0] = '\0';
-		version++;
+		if ((pkgend = memchr(line, '|', eol - line)) == NULL)
+			continue;
+		for (version = pkgend; version > line; version--)
+			if (version[-1] == '-')
+				break;
+		if (version == line)
+			continue;
 
-		origin = strsep(&l, "|");
-		for (dirs = 0, p = l; p > origin; p--) {
+		origin = pkgend + 1;
+		if ((portend = memchr(origin, '|', eol - origin)) == NULL)
+			portend = eol;
+		for (dirs = 0, p = portend; p > origin; p--) {
 			if ( p[-1] == '/' ) {
 				dirs++;
 				if (dirs == 2) {
@@ -299,38 +384,23 @@ hash_indexfile(const char *indexfilename)
 			}
 		}
 
-		entry = malloc(sizeof(struct index_entry));
-		if (entry != NULL) {
-			entry->version = strdup(version);
-			entry->origin = strdup(origin);
-		}
-
-		if (entry == NULL || entry->version == NULL ||
-		    entry->origin == NULL)
-			err(EX_SOFTWARE, "Out of memory while reading %s",
-			    indexfilename);
-
-		HASH_ADD_KEYPTR(hh, indexhead, entry->origin,
-				strlen(entry->origin), entry);
+		originlen = portend - origin;
+		entry->origin = origin;
+		entry->version = version;
+		entry->versionlen = pkgend - version;
+		HASH_ADD_KEYPTR(hh, index->head, entry->origin, originlen,
+				entry);
+		entry++;
 	}
-
-	free(line);
-	fclose(indexfile);
-
-	return (indexhead);
 }
 
 static void
-free_index(struct index_entry *indexhead)
+free_index(struct index *index)
 {
-	struct index_entry	*entry, *tmp;
-
-	HASH_ITER(hh, indexhead, entry, tmp) {
-		HASH_DEL(indexhead, entry);
-		free(entry->origin);
-		free(entry->version);
-		free(entry);
-	}
+	HASH_CLEAR(hh, index->head);
+	free(index->entries);
+	if (index->map != NULL)
+		munmap(index->map, index->len);
 	return;
 }
 
@@ -339,7 +409,8 @@ do_source_index(unsigned int opt, char limchar, char *pattern, match_t match,
 		int argc, char ** restrict argv, const char *matchorigin)
 {
 	char			 filebuf[MAXPATHLEN];
-	struct index_entry	*indexhead;
+	char			 version[BUFSIZ];
+	struct index		 index;
 	struct index_entry	*entry;
 	struct pkgdb		*db = NULL;
 	struct pkgdb_it		*it = NULL;
@@ -364,11 +435,11 @@ do_source_index(unsigned int opt, char limchar, char *pattern, match_t match,
 	if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK)
 		return (EX_IOERR);
 
-	indexhead = hash_indexfile(indexfile);
+	hash_indexfile(indexfile, &index);
 
 	if (pkgdb_obtain_lock(db, PKGDB_LOCK_READONLY, 0, 0) != EPKG_OK) {
 		pkgdb_close(db);
-		free_index(indexhead);
+		free_index(&index);
 		warnx("Cannot get a read lock on the database. "
 		      "It is locked by another process");
 		return (EX_TEMPFAIL);
@@ -387,15 +458,17 @@ do_source_index(unsigned int opt, char limchar, char *pattern, match_t match,
 		    strcmp(origin, matchorigin) != 0)
 			continue;
 		
-		HASH_FIND_STR(indexhead, origin, entry);
-		if (entry != NULL)
-			print_version(pkg, "index", entry->version,
-			    limchar, opt);
+		HASH_FIND(hh, index.head, origin, strlen(origin), entry);
+		if (entry != NULL) {
+			snprintf(version, sizeof(version), "%.*s",
+			    (int)entry->versionlen, entry->version);
+			print_version(pkg, "index", version, limchar, opt);
+		}
 	}
 
 cleanup:
 	pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
-	free_index(indexhead);
+	free_index(&index);
 	pkg_free(pkg);
 	pkgdb_it_free(it);
 	pkgdb_close(db);
@@ -484,109 +557,338 @@ cleanup:
 	return (retcode);
 }
 
-static int
-exec_buf(struct sbuf *cmd) {
-	FILE *fp;
-	char buf[BUFSIZ];
+static void
+make_job_start(struct make_job *job)
+{
+	int fds[2], null;
 
-	if ((fp = popen(sbuf_data(cmd), "r")) == NULL)
-		return (0);
+	job->out = sbuf_new_auto();
+	job->fd = -1;
 
-	sbuf_clear(cmd);
-	while (fgets(buf, BUFSIZ, fp) != NULL)
-		sbuf_cat(cmd, buf);
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		return;
+	}
 
-	pclose(fp);
-	sbuf_finish(cmd);
+	switch (job->pid = fork()) {
+	case -1:
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	case 0:
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		if ((null = open("/dev/null", O_WRONLY)) != -1)
+			dup2(null, STDERR_FILENO);
+		execlp("make", "make", "-C", job->dir, "-V", job->var,
+		    (char *)NULL);
+		_exit(127);
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(fds[1]);
+	job->fd = fds[0];
+}
+
+/*
+ * Run the queries with at most one make(1) per CPU at a time, keeping the
+ * output of each of them.
+ */
+static void
+run_make_jobs(struct make_job **jobs, size_t njobs)
+{
+	struct pollfd	*pfd;
+	size_t		*polled;
+	size_t		 next = 0, running = 0, npfd, i;
+	char		 buf[BUFSIZ];
+	int		 maxjobs, status;
+	size_t		 len;
+	ssize_t		 r;
+
+	if (njobs == 0)
+		return;
+
+	len = sizeof(maxjobs);
+	if (sysctlbyname("hw.ncpu", &maxjobs, &len, NULL, 0) == -1 ||
+	    maxjobs < 1)
+		maxjobs = 1;
+
+	pfd = calloc(njobs, sizeof(struct pollfd));
+	polled = calloc(njobs, sizeof(size_t));
+	if (pfd == NULL || polled == NULL)
+		err(EX_OSERR, "calloc");
+
+	while (next < njobs || running > 0) {
+		while (next < njobs && running < (size_t)maxjobs) {
+			make_job_start(jobs[next]);
+			if (jobs[next]->fd != -1)
+				running++;
+			next++;
+		}
+		if (running == 0)
+			continue;
+
+		for (npfd = 0, i = 0; i < next; i++) {
+			if (jobs[i]->fd == -1)
+				continue;
+			pfd[npfd].fd = jobs[i]->fd;
+			pfd[npfd].events = POLLIN;
+			polled[npfd++] = i;
+		}
+
+		if (poll(pfd, npfd, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll");
+		}
+
+		for (i = 0; i < npfd; i++) {
+			struct make_job *job = jobs[polled[i]];
+
+			if (pfd[i].revents == 0)
+				continue;
+			r = read(job->fd, buf, sizeof(buf));
+			if (r > 0) {
+				sbuf_bcat(job->out, buf, r);
+				continue;
+			}
+			if (r == -1 && errno == EINTR)
+				continue;
+			close(job->fd);
+			job->fd = -1;
+			while (waitpid(job->pid, &status, 0) == -1 &&
+			    errno == EINTR)
+				;
+			running--;
+		}
+	}
 
-	return (sbuf_len(cmd));
+	for (i = 0; i < njobs; i++)
+		sbuf_finish(jobs[i]->out);
+
+	free(pfd);
+	free(polled);
+}
+
+static void
+free_make_job(struct make_job *job)
+{
+	if (job == NULL)
+		return;
+
+	free(job->dir);
+	if (job->out != NULL)
+		sbuf_delete(job->out);
+	free(job);
 }
 
 static bool
-validate_origin(const char *portsdir, const char *origin)
+validate_origin(struct make_job *category, const char *origin)
 {
-	bool		exists = false;
-	struct sbuf	*makecmd;
-	char		*category, *dir, *results, *d;
-	size_t		dirlen;
-
-	/* Strip the last path component from the absolute origin of
-	 * the port -- giving the category directory.  Use make(1) to
-	 * print out the SUBDIR variable from that category, and check
+	char		*results, *d;
+	const char	*dir;
+
+	/* The category make(1) printed out its SUBDIR variable: check
 	 * that the port directory appears in the list.
 	 *
 	 * Return false if (a) the category Makefile doesn't exist (or
 	 * make(1) fails for some other reason) or (b) the port is not
 	 * listed in SUBDIR
-	 *
-	 * FFR Memoize this? Hash the port directories from SUBDIR for
-	 * fast subsequent lookups?
 	 */
 
-	asprintf(&category, "%s/%s", portsdir, origin);
-	if (category == NULL)
-		err(EX_OSERR, "validate_origin()");
-
-	dir = strrchr(category, '/');
-	dir[0] = '\0';
-	dir++;
-	dirlen = strlen(dir);
+	if (category == NULL || sbuf_len(category->out) <= 0)
+		return (false);
 
-	makecmd = sbuf_new_auto();
-	sbuf_printf(makecmd, "make -C %s -V SUBDIR 2>/dev/null", category);
-	
-	if (exec_buf(makecmd) <= 0)
-		goto cleanup;
+	dir = strrchr(origin, '/') + 1;
+	results = sbuf_data(category->out);
 
-	results = sbuf_data(makecmd);
-	
-	while ((d = strsep(&results, " ")) != NULL) {
-		if (d[0] == dir[0] && strncmp(d, dir, dirlen) == 0) {
-			exists = true;
-			break;
+	while ((d = strsep(&results, " \t\n")) != NULL) {
+		if (strcmp(d, dir) == 0) {
+			/* Restore the list for the next port */
+			if (results != NULL)
+				results[-1] = ' ';
+			return (true);
 		}
+		if (results != NULL)
+			results[-1] = ' ';
 	}
-			
-cleanup:
-	free(category);
-	sbuf_delete(makecmd);
 
-	return (exists);
+	return (false);
 }
 
 static const char *
-port_version(struct sbuf *cmd, const char *portsdir, const char *origin)
+port_version(struct make_job *port)
 {
 	char	*output;
-	char	*version = NULL;
 
-	/* Validate the port origin -- check the SUBDIR settings
-	   in the ports and category Makefiles, then extract the
-	   version from the port itself. */
+	if (port == NULL || sbuf_len(port->out) <= 0)
+		return (NULL);
 
-	if (validate_origin(portsdir, origin)) {
-		sbuf_printf(cmd, "make -C %s/%s -VPKGVERSION 2>/dev/null",
-		     portsdir, origin);
-		sbuf_finish(cmd);
+	output = sbuf_data(port->out);
+	output[strcspn(output, "\n")] = '\0';
 
-		if (exec_buf(cmd) != 0) {
-			output = sbuf_data(cmd);
-			version = strsep(&output, "\n");
-		}
+	return (output);
+}
+
+static struct port_cache_entry *
+ports_cache_load(const char *portsdir)
+{
+	struct port_cache_entry	*cache = NULL, *entry;
+	char			 path[MAXPATHLEN];
+	char			*line = NULL, *l, *origin, *version;
+	char			*mtime, *size, *catmtime;
+	size_t			 linecap = 0;
+	ssize_t			 linelen;
+	FILE			*f;
+
+	snprintf(path, sizeof(path), "%s/%s",
+	    pkg_object_string(pkg_config_get("PKG_DBDIR")), PORTS_CACHE_FILE);
+	if ((f = fopen(path, "r")) == NULL)
+		return (NULL);
+
+	/* The cache is only valid for the ports tree it was made from */
+	if ((linelen = getline(&line, &linecap, f)) <= 0 ||
+	    line[linelen - 1] != '\n' ||
+	    strncmp(line, portsdir, linelen - 1) != 0 ||
+	    portsdir[linelen - 1] != '\0') {
+		free(line);
+		fclose(f);
+		return (NULL);
 	}
-	return (version);
+
+	/* origin mtime size catmtime [version] */
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		l = line;
+		origin = strsep(&l, "\t");
+		mtime = strsep(&l, "\t");
+		size = strsep(&l, "\t");
+		catmtime = strsep(&l, "\t");
+		version = strsep(&l, "\t");
+		if (catmtime == NULL)
+			continue;
+
+		HASH_FIND_STR(cache, origin, entry);
+		if (entry != NULL)
+			continue;
+
+		if ((entry = calloc(1, sizeof(*entry))) == NULL ||
+		    (entry->origin = strdup(origin)) == NULL)
+			err(EX_OSERR, "calloc");
+		if (version != NULL && *version != '\0' &&
+		    (entry->version = strdup(version)) == NULL)
+			err(EX_OSERR, "strdup");
+		entry->mtime = strtoll(mtime, NULL, 10);
+		entry->size = strtoll(size, NULL, 10);
+		entry->catmtime = strtoll(catmtime, NULL, 10);
+		HASH_ADD_KEYPTR(hh, cache, entry->origin,
+		    strlen(entry->origin), entry);
+	}
+
+	free(line);
+	fclose(f);
+
+	return (cache);
+}
+
+/*
+ * Save the cache, failing silently: an unprivileged user simply does not
+ * get it.
+ */
+static void
+ports_cache_write(struct port_cache_entry *cache, const char *portsdir)
+{
+	struct port_cache_entry	*entry, *tmp;
+	char			 path[MAXPATHLEN], tmppath[MAXPATHLEN];
+	FILE			*f;
+	int			 fd;
+
+	snprintf(path, sizeof(path), "%s/%s",
+	    pkg_object_string(pkg_config_get("PKG_DBDIR")), PORTS_CACHE_FILE);
+	snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		return;
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+
+	fprintf(f, "%s\n", portsdir);
+	HASH_ITER(hh, cache, entry, tmp) {
+		fprintf(f, "%s\t%jd\t%jd\t%jd\t%s\n", entry->origin,
+		    (intmax_t)entry->mtime, (intmax_t)entry->size,
+		    (intmax_t)entry->catmtime,
+		    entry->version != NULL ? entry->version : "");
+	}
+
+	if (fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH) == -1 ||
+	    fclose(f) != 0 || rename(tmppath, path) == -1)
+		unlink(tmppath);
+}
+
+static void
+ports_cache_free(struct port_cache_entry *cache)
+{
+	struct port_cache_entry	*entry, *tmp;
+
+	HASH_ITER(hh, cache, entry, tmp) {
+		HASH_DEL(cache, entry);
+		free(entry->origin);
+		free(entry->version);
+		free(entry);
+	}
+}
+
+/*
+ * Slave ports take their version from their master port, and other ports
+ * may include a Makefile of another port: changes there would not
+ * invalidate the cache, so always ask make(1) for them.
+ */
+static bool
+port_is_cacheable(const char *makefile)
+{
+	FILE	*f;
+	char	*line = NULL;
+	size_t	 linecap = 0;
+	bool	 cacheable = true;
+
+	if ((f = fopen(makefile, "r")) == NULL)
+		return (false);
+
+	while (cacheable && getline(&line, &linecap, f) > 0) {
+		if (strstr(line, "MASTERDIR") != NULL ||
+		    (strstr(line, ".include") != NULL &&
+		    strchr(line, '"') != NULL))
+			cacheable = false;
+	}
+
+	free(line);
+	fclose(f);
+
+	return (cacheable);
 }
 
 static int
 do_source_ports(unsigned int opt, char limchar, char *pattern, match_t match,
 		const char *matchorigin, const char *portsdir)
 {
-	struct pkgdb	*db = NULL;
-	struct pkgdb_it	*it = NULL;
-	struct pkg	*pkg = NULL;
-	struct sbuf	*cmd;
-	const char	*origin;
-	const char	*version;
+	struct pkgdb		*db = NULL;
+	struct pkgdb_it		*it = NULL;
+	struct pkg		*pkg = NULL;
+	struct port_query	*queries = NULL, *q;
+	struct port_cache_entry	*cache, *entry;
+	struct make_job		*categories = NULL, *job, *tmp;
+	struct make_job		**jobs = NULL;
+	char			 path[MAXPATHLEN];
+	const char		*origin;
+	size_t			 nqueries = 0, cap = 0, njobs = 0, i;
+	bool			 dirty = false;
 
 	if ( (opt & VERSION_SOURCES) != VERSION_SOURCE_PORTS ) {
 		usage_version();
@@ -610,8 +912,6 @@ do_source_ports(unsigned int opt, char limchar, char *pattern, match_t match,
 	if ((it = pkgdb_query(db, pattern, match)) == NULL)
 			goto cleanup;
 
-	cmd = sbuf_new_auto();
-
 	while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK) {
 		pkg_get(pkg, PKG_ORIGIN, &origin);
 
@@ -620,12 +920,138 @@ do_source_ports(unsigned int opt, char limchar, char *pattern, match_t match,
 		    strcmp(origin, matchorigin) != 0)
 			continue;
 
-		version = port_version(cmd, portsdir, origin);
-		print_version(pkg, "port", version, limchar, opt);
-		sbuf_clear(cmd);
+		if (nqueries == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			queries = reallocf(queries, cap * sizeof(*queries));
+			if (queries == NULL)
+				err(EX_OSERR, "realloc");
+		}
+		memset(&queries[nqueries], 0, sizeof(*queries));
+		queries[nqueries].pkg = pkg;
+		queries[nqueries++].origin = origin;
+		pkg = NULL;
+	}
+
+	cache = ports_cache_load(portsdir);
+
+	/*
+	 * Take the versions of the unchanged ports from the cache, and
+	 * find out which categories have to be checked for the others:
+	 * each category Makefile is only asked once.
+	 */
+	if (nqueries > 0 && (jobs = calloc(2 * nqueries, sizeof(*jobs))) == NULL)
+		err(EX_OSERR, "calloc");
+
+	for (i = 0; i < nqueries; i++) {
+		q = &queries[i];
+		if (strchr(q->origin, '/') == NULL)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/Makefile", portsdir,
+		    q->origin);
+		if (stat(path, &q->st) == -1)
+			memset(&q->st, 0, sizeof(q->st));
+		snprintf(path, sizeof(path), "%s/%.*s/Makefile", portsdir,
+		    (int)(strrchr(q->origin, '/') - q->origin), q->origin);
+		if (stat(path, &q->catst) == -1)
+			memset(&q->catst, 0, sizeof(q->catst));
+
+		HASH_FIND_STR(cache, q->origin, entry);
+		if (entry != NULL && q->st.st_mtime != 0 &&
+		    entry->mtime == (int64_t)q->st.st_mtime &&
+		    entry->size == (int64_t)q->st.st_size &&
+		    entry->catmtime == (int64_t)q->catst.st_mtime) {
+			q->cached = entry;
+			q->version = entry->version;
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%.*s", portsdir,
+		    (int)(strrchr(q->origin, '/') - q->origin), q->origin);
+		HASH_FIND_STR(categories, path, job);
+		if (job == NULL) {
+			if ((job = calloc(1, sizeof(*job))) == NULL ||
+			    (job->dir = strdup(path)) == NULL)
+				err(EX_OSERR, "calloc");
+			job->var = "SUBDIR";
+			job->fd = -1;
+			HASH_ADD_KEYPTR(hh, categories, job->dir,
+			    strlen(job->dir), job);
+			jobs[njobs++] = job;
+		}
+		q->category = job;
 	}
 
-	sbuf_delete(cmd);
+	run_make_jobs(jobs, njobs);
+
+	/* Then extract the version from the ports themselves */
+	njobs = 0;
+	for (i = 0; i < nqueries; i++) {
+		q = &queries[i];
+		if (q->category == NULL || !validate_origin(q->category, q->origin))
+			continue;
+
+		if ((q->port = calloc(1, sizeof(*q->port))) == NULL ||
+		    asprintf(&q->port->dir, "%s/%s", portsdir, q->origin) == -1)
+			err(EX_OSERR, "calloc");
+		q->port->var = "PKGVERSION";
+		q->port->fd = -1;
+		jobs[njobs++] = q->port;
+	}
+
+	run_make_jobs(jobs, njobs);
+
+	for (i = 0; i < nqueries; i++) {
+		q = &queries[i];
+		if (q->cached == NULL && q->category != NULL) {
+			q->version = port_version(q->port);
+
+			snprintf(path, sizeof(path), "%s/%s/Makefile",
+			    portsdir, q->origin);
+			HASH_FIND_STR(cache, q->origin, entry);
+			if (q->st.st_mtime != 0 && port_is_cacheable(path)) {
+				if (entry == NULL) {
+					if ((entry = calloc(1, sizeof(*entry))) == NULL ||
+					    (entry->origin = strdup(q->origin)) == NULL)
+						err(EX_OSERR, "calloc");
+					HASH_ADD_KEYPTR(hh, cache, entry->origin,
+					    strlen(entry->origin), entry);
+				}
+				free(entry->version);
+				entry->version = NULL;
+				if (q->version != NULL &&
+				    (entry->version = strdup(q->version)) == NULL)
+					err(EX_OSERR, "strdup");
+				entry->mtime = q->st.st_mtime;
+				entry->size = q->st.st_size;
+				entry->catmtime = q->catst.st_mtime;
+				dirty = true;
+			} else if (entry != NULL) {
+				HASH_DEL(cache, entry);
+				free(entry->origin);
+				free(entry->version);
+				free(entry);
+				dirty = true;
+			}
+		}
+
+		print_version(q->pkg, "port", q->version, limchar, opt);
+	}
+
+	if (dirty)
+		ports_cache_write(cache, portsdir);
+
+	for (i = 0; i < nqueries; i++) {
+		free_make_job(queries[i].port);
+		pkg_free(queries[i].pkg);
+	}
+	HASH_ITER(hh, categories, job, tmp) {
+		HASH_DEL(categories, job);
+		free_make_job(job);
+	}
+	ports_cache_free(cache);
+	free(queries);
+	free(jobs);
 
 cleanup:
 	pkgdb_release_lock(db, PKGDB_LOCK_READONLY);
@@ -0,0 +1,623 @@
+/*
+ * Microbenchmarks of the libpkg hot paths.
+ *
+ * A synthetic local database and a file:// repository of the requested
+ * size are generated in a scratch directory, then each operation is timed
+ * on them.  Results are written to stdout, one JSON object per line.
+ */
+
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fts.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pkg.h>
+#include "private/pkg.h"
+
+#define BENCH_REPO	"bench"
+
+struct bench {
+	const char	*name;
+	uint64_t	 ops;
+	struct timespec	 elapsed;
+	struct timespec	 start;
+};
+
+static unsigned		 npkgs = 1000;
+static unsigned		 nfiles = 20;
+static const char	*abi;
+static char		 workdir[MAXPATHLEN];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pkg_bench [-k] [-d workdir] [-f files] "
+	    "[-n packages]\n");
+	exit(EXIT_FAILURE);
+}
+
+static int
+event_callback(void *data __unused, struct pkg_event *ev)
+{
+	switch (ev->type) {
+	case PKG_EVENT_ERROR:
+		warnx("%s", ev->e_pkg_error.msg);
+		break;
+	case PKG_EVENT_ERRNO:
+		warnx("%s(%s): %s", ev->e_errno.func, ev->e_errno.arg,
+		    strerror(ev->e_errno.no));
+		break;
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+static void
+bench_init(struct bench *b, const char *name)
+{
+	memset(b, 0, sizeof(struct bench));
+	b->name = name;
+}
+
+static void
+bench_start(struct bench *b)
+{
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void
+bench_stop(struct bench *b, uint64_t ops)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->elapsed.tv_sec += now.tv_sec - b->start.tv_sec;
+	b->elapsed.tv_nsec += now.tv_nsec - b->start.tv_nsec;
+	while (b->elapsed.tv_nsec < 0) {
+		b->elapsed.tv_sec--;
+		b->elapsed.tv_nsec += 1000000000L;
+	}
+	while (b->elapsed.tv_nsec >= 1000000000L) {
+		b->elapsed.tv_sec++;
+		b->elapsed.tv_nsec -= 1000000000L;
+	}
+	b->ops += ops;
+}
+
+static void
+bench_report(struct bench *b)
+{
+	struct rusage ru;
+	double secs;
+
+	secs = b->elapsed.tv_sec + b->elapsed.tv_nsec / 1e9;
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("{\"bench\": \"%s\", \"packages\": %u, \"files\": %u, "
+	    "\"ops\": %" PRIu64 ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+	    "\"maxrss_kb\": %ld}\n", b->name, npkgs, npkgs * nfiles, b->ops,
+	    secs, secs > 0 ? b->ops / secs : 0, ru.ru_maxrss);
+	fflush(stdout);
+}
+
+/*
+ * Version of package i: generation 0 is what gets registered in the
+ * local database, generation 1 what the repository offers.
+ */
+static void
+bench_version(char *buf, size_t len, unsigned i, unsigned gen)
+{
+	switch (i % 4) {
+	case 0:
+		snprintf(buf, len, "%u.%u", gen + 1, i % 100);
+		break;
+	case 1:
+		snprintf(buf, len, "%u.%u.%u_%u", gen + 1, i % 100, i / 100,
+		    i % 3);
+		break;
+	case 2:
+		snprintf(buf, len, "%u.%ua%u", gen + 1, i % 10, i % 7);
+		break;
+	default:
+		snprintf(buf, len, "%u.%u,1", gen + 1, i % 50);
+		break;
+	}
+}
+
+static void
+bench_manifest(struct sbuf *b, unsigned i, unsigned gen)
+{
+	char version[32];
+	unsigned j, dep;
+
+	bench_version(version, sizeof(version), i, gen);
+
+	sbuf_clear(b);
+	sbuf_printf(b,
+	    "name: bench%u\n"
+	    "version: \"%s\"\n"
+	    "origin: bench/bench%u\n"
+	    "categories: [bench]\n"
+	    "comment: Synthetic benchmark package %u\n"
+	    "arch: \"%s\"\n"
+	    "www: http://www.example.org/\n"
+	    "maintainer: bench@example.org\n"
+	    "prefix: /usr/local\n"
+	    "flatsize: %u\n"
+	    "licenselogic: single\n"
+	    "licenses: [BSD]\n"
+	    "desc: Synthetic package generated by pkg_bench\n"
+	    "options: {DOCS: on, EXAMPLES: off}\n",
+	    i, version, i, i, abi, nfiles * 512);
+
+	if (i > 0) {
+		sbuf_cat(b, "deps: {\n");
+		dep = i - 1;
+		bench_version(version, sizeof(version), dep, gen);
+		sbuf_printf(b, "  bench%u: {origin: bench/bench%u, "
+		    "version: \"%s\"}\n", dep, dep, version);
+		dep = i / 2;
+		if (dep != i - 1) {
+			bench_version(version, sizeof(version), dep, gen);
+			sbuf_printf(b, "  bench%u: {origin: bench/bench%u, "
+			    "version: \"%s\"}\n", dep, dep, version);
+		}
+		sbuf_cat(b, "}\n");
+	}
+
+	sbuf_cat(b, "files: {\n");
+	for (j = 0; j < nfiles; j++)
+		sbuf_printf(b, "  /usr/local/share/bench%u/file%u: "
+		    "\"%064x\"\n", i, j, i * nfiles + j);
+	sbuf_cat(b, "}\n");
+	sbuf_finish(b);
+}
+
+static int
+bench_parse(struct pkg **pkg, struct sbuf *b, struct pkg_manifest_key *keys,
+    struct bench *bench)
+{
+	int ret;
+
+	if (pkg_new(pkg, PKG_FILE) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (bench != NULL)
+		bench_start(bench);
+	ret = pkg_parse_manifest(*pkg, sbuf_data(b), sbuf_len(b), keys);
+	if (bench != NULL)
+		bench_stop(bench, 1);
+
+	if (ret != EPKG_OK)
+		pkg_free(*pkg);
+
+	return (ret);
+}
+
+static int
+bench_write_package(struct pkg *pkg, const char *manifest)
+{
+	struct packing *pack;
+	char path[MAXPATHLEN];
+	char *compact = NULL;
+	const char *name, *version;
+
+	pkg_get(pkg, PKG_NAME, &name, PKG_VERSION, &version);
+	snprintf(path, sizeof(path), "%s/repo/All/%s-%s", workdir, name,
+	    version);
+
+	if (pkg_emit_manifest(pkg, &compact, PKG_MANIFEST_EMIT_COMPACT,
+	    NULL) != EPKG_OK)
+		return (EPKG_FATAL);
+	if (packing_init(&pack, path, TAR) != EPKG_OK) {
+		free(compact);
+		return (EPKG_FATAL);
+	}
+	packing_append_buffer(pack, compact, "+COMPACT_MANIFEST",
+	    strlen(compact));
+	packing_append_buffer(pack, manifest, "+MANIFEST", strlen(manifest));
+	packing_finish(pack);
+	free(compact);
+
+	return (EPKG_OK);
+}
+
+static void
+bench_conflict(const char *a __unused, const char *b __unused, void *data)
+{
+	(*(uint64_t *)data)++;
+}
+
+/*
+ * Generate both generations of every package.  Along the way, time
+ * manifest parsing and emission, fill the local database and the
+ * integrity check set, and write the repository packages.
+ */
+static int
+bench_populate(struct pkgdb *db)
+{
+	struct bench parse, emit, reg;
+	struct pkg_manifest_key *keys = NULL;
+	struct sbuf *b;
+	struct pkg *pkg;
+	char *manifest;
+	uint64_t conflicts = 0;
+	unsigned i;
+	int ret = EPKG_OK;
+
+	bench_init(&parse, "pkg_parse_manifest");
+	bench_init(&emit, "pkg_emit_manifest");
+	bench_init(&reg, "pkgdb_register_pkg");
+
+	pkg_manifest_keys_new(&keys);
+	b = sbuf_new_auto();
+
+	for (i = 0; i < npkgs && ret == EPKG_OK; i++) {
+		bench_manifest(b, i, 0);
+		if ((ret = bench_parse(&pkg, b, keys, NULL)) != EPKG_OK)
+			break;
+		bench_start(&reg);
+		ret = pkgdb_register_ports(db, pkg);
+		bench_stop(&reg, 1);
+		pkg_free(pkg);
+		if (ret != EPKG_OK)
+			break;
+
+		bench_manifest(b, i, 1);
+		if ((ret = bench_parse(&pkg, b, keys, &parse)) != EPKG_OK)
+			break;
+		bench_start(&emit);
+		ret = pkg_emit_manifest(pkg, &manifest, 0, NULL);
+		bench_stop(&emit, 1);
+		if (ret == EPKG_OK) {
+			ret = bench_write_package(pkg, manifest);
+			free(manifest);
+		}
+		if (ret == EPKG_OK)
+			pkgdb_integrity_append(db, pkg, bench_conflict,
+			    &conflicts);
+		pkg_free(pkg);
+	}
+
+	sbuf_delete(b);
+	pkg_manifest_keys_free(keys);
+
+	if (ret != EPKG_OK) {
+		warnx("failed to generate package %u", i);
+		return (ret);
+	}
+
+	bench_report(&parse);
+	bench_report(&emit);
+	bench_report(&reg);
+
+	return (EPKG_OK);
+}
+
+static void
+bench_version_cmp(void)
+{
+	struct bench b;
+	char (*versions)[32];
+	unsigned i, n, rounds;
+
+	n = npkgs < 1000 ? 1000 : npkgs;
+	if ((versions = calloc(n, sizeof(*versions))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (i = 0; i < n; i++)
+		bench_version(versions[i], sizeof(versions[i]), i, i % 2);
+
+	bench_init(&b, "pkg_version_cmp");
+	bench_start(&b);
+	for (rounds = 0; rounds < 100; rounds++)
+		for (i = 0; i < n; i++)
+			pkg_version_cmp(versions[i],
+			    versions[(i * 7 + rounds) % n]);
+	bench_stop(&b, (uint64_t)n * rounds);
+	bench_report(&b);
+
+	free(versions);
+}
+
+static int
+bench_create_repo(void)
+{
+	struct bench b;
+	char path[MAXPATHLEN];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/repo", workdir);
+
+	bench_init(&b, "pkg_create_repo");
+	bench_start(&b);
+	ret = pkg_create_repo(path, path, true, NULL, NULL);
+	if (ret == EPKG_OK)
+		ret = pkg_finish_repo(path, NULL, NULL, 0, true);
+	bench_stop(&b, npkgs);
+	if (ret != EPKG_OK)
+		return (ret);
+	bench_report(&b);
+
+	return (EPKG_OK);
+}
+
+static int
+bench_repo_update(void)
+{
+	struct bench b;
+	struct pkg_repo *repo;
+	int ret;
+
+	if ((repo = pkg_repo_find_name(BENCH_REPO)) == NULL) {
+		warnx("repository %s is not configured", BENCH_REPO);
+		return (EPKG_FATAL);
+	}
+
+	bench_init(&b, "pkg_repo_update_incremental");
+	bench_start(&b);
+	ret = pkg_update(repo, true);
+	bench_stop(&b, npkgs);
+	if (ret != EPKG_OK)
+		return (ret);
+	bench_report(&b);
+
+	return (EPKG_OK);
+}
+
+static int
+bench_it_next(struct pkgdb *db)
+{
+	static const struct {
+		const char	*name;
+		unsigned	 flags;
+	} loads[] = {
+		{ "pkgdb_it_next:basic",		PKG_LOAD_BASIC },
+		{ "pkgdb_it_next:deps",			PKG_LOAD_DEPS },
+		{ "pkgdb_it_next:rdeps",		PKG_LOAD_RDEPS },
+		{ "pkgdb_it_next:files",		PKG_LOAD_FILES },
+		{ "pkgdb_it_next:scripts",		PKG_LOAD_SCRIPTS },
+		{ "pkgdb_it_next:options",		PKG_LOAD_OPTIONS },
+		{ "pkgdb_it_next:mtree",		PKG_LOAD_MTREE },
+		{ "pkgdb_it_next:dirs",			PKG_LOAD_DIRS },
+		{ "pkgdb_it_next:categories",		PKG_LOAD_CATEGORIES },
+		{ "pkgdb_it_next:licenses",		PKG_LOAD_LICENSES },
+		{ "pkgdb_it_next:users",		PKG_LOAD_USERS },
+		{ "pkgdb_it_next:groups",		PKG_LOAD_GROUPS },
+		{ "pkgdb_it_next:shlibs_required",	PKG_LOAD_SHLIBS_REQUIRED },
+		{ "pkgdb_it_next:shlibs_provided",	PKG_LOAD_SHLIBS_PROVIDED },
+		{ "pkgdb_it_next:annotations",		PKG_LOAD_ANNOTATIONS },
+		{ "pkgdb_it_next:conflicts",		PKG_LOAD_CONFLICTS },
+		{ "pkgdb_it_next:provides",		PKG_LOAD_PROVIDES },
+	};
+	struct bench b;
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL;
+	unsigned i;
+	uint64_t count;
+
+	for (i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+		bench_init(&b, loads[i].name);
+		bench_start(&b);
+		if ((it = pkgdb_query(db, NULL, MATCH_ALL)) == NULL)
+			return (EPKG_FATAL);
+		count = 0;
+		while (pkgdb_it_next(it, &pkg, loads[i].flags) == EPKG_OK)
+			count++;
+		pkgdb_it_free(it);
+		bench_stop(&b, count);
+		bench_report(&b);
+	}
+	pkg_free(pkg);
+
+	return (EPKG_OK);
+}
+
+static void
+bench_integrity_check(struct pkgdb *db)
+{
+	struct bench b;
+	uint64_t conflicts = 0;
+
+	bench_init(&b, "pkgdb_integrity_check");
+	bench_start(&b);
+	pkgdb_integrity_check(db, bench_conflict, &conflicts);
+	bench_stop(&b, (uint64_t)npkgs * nfiles);
+	bench_report(&b);
+}
+
+static int
+bench_solve(void)
+{
+	struct bench jobs, sat;
+	struct pkgdb *db = NULL;
+	struct pkg_jobs *j = NULL;
+	struct pkg_solve_problem *problem;
+	int ret;
+
+	if ((ret = pkgdb_open(&db, PKGDB_REMOTE)) != EPKG_OK)
+		return (ret);
+
+	if ((ret = pkg_jobs_new(&j, PKG_JOBS_UPGRADE, db)) != EPKG_OK)
+		goto cleanup;
+	pkg_jobs_set_repository(j, BENCH_REPO);
+
+	bench_init(&jobs, "pkg_jobs_solve");
+	bench_start(&jobs);
+	ret = pkg_jobs_solve(j);
+	bench_stop(&jobs, 1);
+	if (ret != EPKG_OK)
+		goto cleanup;
+	bench_report(&jobs);
+
+	/* The same universe again, this time timing the SAT solver alone */
+	if ((problem = pkg_solve_jobs_to_sat(j)) == NULL) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	bench_init(&sat, "pkg_solve_sat_problem");
+	bench_start(&sat);
+	if (!pkg_solve_sat_problem(problem))
+		ret = EPKG_FATAL;
+	bench_stop(&sat, 1);
+	pkg_solve_problem_free(problem);
+	if (ret == EPKG_OK)
+		bench_report(&sat);
+
+cleanup:
+	pkg_jobs_free(j);
+	pkgdb_close(db);
+
+	return (ret);
+}
+
+static int
+bench_setup(void)
+{
+	FILE *f;
+	char path[MAXPATHLEN];
+	static const char *dirs[] = { "db", "cache", "repos", "repo",
+	    "repo/All" };
+	unsigned i;
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", workdir, dirs[i]);
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			warn("mkdir(%s)", path);
+			return (EPKG_FATAL);
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/pkg.conf", workdir);
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("%s", path);
+		return (EPKG_FATAL);
+	}
+	fprintf(f, "PKG_DBDIR: \"%s/db\"\n"
+	    "PKG_CACHEDIR: \"%s/cache\"\n"
+	    "REPOS_DIR: [\"%s/repos\"]\n"
+	    "HANDLE_RC_SCRIPTS: false\n"
+	    "SYSLOG: false\n", workdir, workdir, workdir);
+	fclose(f);
+
+	snprintf(path, sizeof(path), "%s/repos/%s.conf", workdir, BENCH_REPO);
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("%s", path);
+		return (EPKG_FATAL);
+	}
+	fprintf(f, "%s: {\n"
+	    "  url: \"file://%s/repo\",\n"
+	    "  mirror_type: none,\n"
+	    "  signature_type: none,\n"
+	    "  enabled: yes\n"
+	    "}\n", BENCH_REPO, workdir);
+	fclose(f);
+
+	snprintf(path, sizeof(path), "%s/pkg.conf", workdir);
+
+	return (pkg_init(path, NULL));
+}
+
+static void
+bench_cleanup(void)
+{
+	FTS *fts;
+	FTSENT *e;
+	char *paths[2] = { workdir, NULL };
+
+	if ((fts = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL)
+		return;
+	while ((e = fts_read(fts)) != NULL) {
+		if (e->fts_info == FTS_DP)
+			rmdir(e->fts_accpath);
+		else if (e->fts_info != FTS_D)
+			unlink(e->fts_accpath);
+	}
+	fts_close(fts);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pkgdb *db = NULL;
+	bool keep = false;
+	int ch, ret;
+
+	workdir[0] = '\0';
+	while ((ch = getopt(argc, argv, "d:f:kn:")) != -1) {
+		switch (ch) {
+		case 'd':
+			strlcpy(workdir, optarg, sizeof(workdir));
+			keep = true;
+			break;
+		case 'f':
+			nfiles = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'n':
+			npkgs = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (npkgs == 0)
+		usage();
+
+	if (workdir[0] == '\0') {
+		strlcpy(workdir, "/tmp/pkg_bench.XXXXXX", sizeof(workdir));
+		if (mkdtemp(workdir) == NULL)
+			err(EXIT_FAILURE, "mkdtemp");
+	} else if (mkdir(workdir, 0755) == -1 && errno != EEXIST)
+		err(EXIT_FAILURE, "mkdir(%s)", workdir);
+
+	pkg_event_register(event_callback, NULL);
+
+	if ((ret = bench_setup()) != EPKG_OK)
+		goto cleanup;
+	abi = pkg_object_string(pkg_config_get("ABI"));
+
+	bench_version_cmp();
+
+	if ((ret = pkgdb_open(&db, PKGDB_DEFAULT)) != EPKG_OK)
+		goto cleanup;
+	if ((ret = bench_populate(db)) != EPKG_OK)
+		goto cleanup;
+
+	if ((ret = bench_create_repo()) != EPKG_OK)
+		goto cleanup;
+	if ((ret = bench_repo_update()) != EPKG_OK)
+		goto cleanup;
+
+	if ((ret = bench_it_next(db)) != EPKG_OK)
+		goto cleanup;
+	bench_integrity_check(db);
+	pkgdb_close(db);
+	db = NULL;
+
+	ret = bench_solve();
+
+cleanup:
+	pkgdb_close(db);
+	if (pkg_initialized())
+		pkg_shutdown();
+	if (keep)
+		fprintf(stderr, "pkg_bench: data kept in %s\n", workdir);
+	else
+		bench_cleanup();
+
+	return (ret == EPKG_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
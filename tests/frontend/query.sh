@@ -0,0 +1,60 @@
+#! /usr/bin/env atf-sh
+
+atf_test_case query
+query_head() {
+	atf_set "descr" "testing pkg query -e"
+}
+
+query_body() {
+	export PKG_DBDIR=$HOME/pkg
+	export INSTALL_AS_USER=yes
+
+	mkdir -p $PKG_DBDIR
+
+	for p in dep test ; do
+		mkdir -p $HOME/$p
+		cat > $HOME/$p/+MANIFEST <<EOM
+name: $p
+origin: test/$p
+version: "1.0"
+arch: "freebsd:9:x86:64"
+comment: a test 100%
+www: http://www.example.org/
+maintainer: test@example.org
+prefix: /usr/local
+desc: Test package
+categories: [test]
+EOM
+	done
+	cat >> $HOME/test/+MANIFEST <<EOM
+deps: {dep: {origin: test/dep, version: "1.0"}}
+EOM
+
+	for p in dep test ; do
+		atf_check -s exit:0 -o ignore -e empty \
+		    pkg register -t -M $HOME/$p/+MANIFEST
+	done
+
+	atf_check -s exit:0 -o inline:"test\n" -e empty \
+	    pkg query -e '%#d > 0' '%n'
+	atf_check -s exit:0 -o inline:"test\n" -e empty \
+	    pkg query -e '%dn == dep' '%n'
+	atf_check -s exit:0 -o inline:"dep\n" -e empty \
+	    pkg query -e '%#r > 0' '%n'
+	atf_check -s exit:0 -o inline:"dep\n" -e empty \
+	    pkg query -e '%rn == test' '%n'
+
+	# each list predicate is a subquery: many of them exceed BUFSIZ
+	cond='%dn == dep'
+	for i in 1 2 3 4 5 6 7 8 9 10 11 12 ; do
+		cond="$cond || %dn == dep$i || %ro == test/dep$i"
+	done
+	atf_check -s exit:0 -o inline:"test\n" -e empty \
+	    pkg query -e "$cond" '%n'
+}
+
+atf_init_test_cases() {
+	. $(atf_get_srcdir)/test_environment
+
+	atf_add_test_case query
+}
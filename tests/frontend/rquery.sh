@@ -0,0 +1,58 @@
+#! /usr/bin/env atf-sh
+
+atf_test_case rquery
+rquery_head() {
+	atf_set "descr" "testing pkg rquery -e"
+}
+
+rquery_body() {
+	export PKG_DBDIR=$HOME/pkg
+	export PKG_CACHEDIR=$HOME/cache
+	export REPOS_DIR=$HOME/repos
+	export INSTALL_AS_USER=yes
+
+	mkdir -p $PKG_DBDIR $PKG_CACHEDIR $REPOS_DIR $HOME/repo $HOME/root
+	abi=$(pkg -C '' config abi)
+
+	for p in dep test ; do
+		mkdir -p $HOME/$p
+		cat > $HOME/$p/+MANIFEST <<EOM
+name: $p
+origin: test/$p
+version: "1.0"
+arch: "$abi"
+comment: a test 100%
+www: http://www.example.org/
+maintainer: test@example.org
+prefix: /usr/local
+desc: Test package
+categories: [test]
+EOM
+	done
+	cat >> $HOME/test/+MANIFEST <<EOM
+deps: {dep: {origin: test/dep, version: "1.0"}}
+EOM
+
+	for p in dep test ; do
+		atf_check -s exit:0 -o ignore -e empty \
+		    pkg -C '' create -o $HOME/repo -r $HOME/root -m $HOME/$p
+	done
+	atf_check -s exit:0 -o ignore -e empty pkg -C '' repo $HOME/repo
+	cat > $REPOS_DIR/test.conf <<EOM
+test: { url: "file://$HOME/repo", enabled: yes }
+EOM
+	atf_check -s exit:0 -o ignore -e ignore pkg -C '' update -f
+
+	atf_check -s exit:0 -o inline:"test\n" -e empty \
+	    pkg -C '' rquery -e '%#d > 0' '%n'
+	atf_check -s exit:0 -o inline:"test\n" -e empty \
+	    pkg -C '' rquery -e '%dn == dep' '%n'
+	atf_check -s exit:0 -o inline:"dep\ntest\n" -e empty \
+	    pkg -C '' rquery -e '%c ~ *100%' '%n'
+}
+
+atf_init_test_cases() {
+	. $(atf_get_srcdir)/test_environment
+
+	atf_add_test_case rquery
+}
@@ -0,0 +1,66 @@
+#include <atf-c.h>
+#include <pkg.h>
+
+static const char *versions[] = {
+	"0.1",
+	"1",
+	"1.0",
+	"1.0.0",
+	"1.0_1",
+	"1.0,1",
+	"1.0_1,1",
+	"1.0a",
+	"1.0alpha1",
+	"1.0beta2",
+	"1.0pre1",
+	"1.0rc1",
+	"1.0pl1",
+	"1.0.a",
+	"1.*",
+	"1.10",
+	"1.9",
+	"1.2+3",
+	"1.2+3.1",
+	"1.2.1+3",
+	"2.0.2003.09.16",
+	"2.0:2003.09.16",
+	"10a1b2",
+	"10a1.b2",
+	"pkg-1.3.0_2",
+	"pkg-devel-1.3.0.a,1",
+	NULL
+};
+
+ATF_TC(key_cmp);
+
+ATF_TC_HEAD(key_cmp, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "pkg_version_key_cmp() agrees with pkg_version_cmp()");
+}
+
+ATF_TC_BODY(key_cmp, tc)
+{
+	struct pkg_version_key *k1, *k2;
+	int i, j;
+
+	for (i = 0; versions[i] != NULL; i++) {
+		ATF_REQUIRE_EQ(EPKG_OK, pkg_version_key_new(&k1, versions[i]));
+		for (j = 0; versions[j] != NULL; j++) {
+			ATF_REQUIRE_EQ(EPKG_OK,
+			    pkg_version_key_new(&k2, versions[j]));
+			ATF_CHECK_EQ_MSG(pkg_version_cmp(versions[i], versions[j]),
+			    pkg_version_key_cmp(k1, k2), "%s vs %s",
+			    versions[i], versions[j]);
+			pkg_version_key_free(k2);
+		}
+		pkg_version_key_free(k1);
+	}
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, key_cmp);
+
+	return (atf_no_error());
+}